@@ -53,7 +53,7 @@ namespace Device {
             SIVR = 0xF0,     // Spurious Interrupt Vector Register
             ICR1 = 0x300,    // Interrupt Command Register Lower
             ICR2 = 0x310,    // Interrupt Command Register Higher
-            LVT = 0x320,     // Local Vector Table
+            LVT = 0x320,     // Local Vector Table entry for the timer
             LINT1 = 0x350,   // Local Interrupt ID
             LINT2 = 0x360,   // Local Interrupt ID
             TIMER_DIVISOR = 0x3E0, // Frequency divisor for the timer.
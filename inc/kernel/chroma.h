@@ -20,6 +20,7 @@
 #include <kernel/system/io.h>
 #include <kernel/system/memory.h>
 #include <kernel/system/pci.h>
+#include <kernel/system/timer.h>
 
 #ifdef __cplusplus
   #include <kernel/system/core.hpp>
@@ -70,6 +71,10 @@ void WriteChar(const char character);
 void WriteStringWithFont(const char* string);
 
 void InitSerial();
+// Send serial output from the UART's interrupt, instead of only when something else is written. Needs the APIC.
+void InitSerialInterrupts();
+// Flush the serial buffer and write straight to the port from now on. For when the kernel is going down.
+void SerialPanic();
 void InitPrint();
 
 void SetupInitialGDT();
@@ -84,6 +89,7 @@ extern "C" {
 
     int Main();
     void Exit(int code);
+    size_t GetCurrentCoreID();
     void SomethingWentWrong(const char* Message);
 #ifdef __cplusplus
 }
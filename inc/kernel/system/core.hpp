@@ -45,23 +45,41 @@ class Core {
     GDT CoreGDT = { 0, 0 };
     TSS64 CoreTSS = { };
 
+    // The save area whose contents are live in this core's FPU, SSE and AVX registers, if any.
+    uint8_t* ExtendedOwner = nullptr;
+    // The save area of the process running now. It's loaded the first time the process touches those registers.
+    uint8_t* ExtendedPending = nullptr;
+
+    // Make Data the state for the process being switched in, or null for the idle loop. The registers are only loaded if it uses them.
     void LoadExtraRegisters(uint8_t* Data);
+    // Write the registers back to Data, if they hold its state and it has used them since it was switched in.
     void SaveExtraRegisters(uint8_t* Data);
 
+    // Handle a Device Not Available fault. Returns false if it wasn't caused by lazy switching.
+    bool ExtraRegistersTrap();
+
+    // Enable SSE and AVX on the calling core. The bootstrap core decides the features and area size; run it there first.
+    static void InitExtraRegisters();
+    // A zeroed save area, sized and aligned for this CPU's XSAVE, or for FXSAVE if it has none.
+    static uint8_t* AllocateExtraRegisters();
+    static void FreeExtraRegisters(uint8_t* Data);
+
     void StackTrace(size_t Cycles);
 
     static Core* GetCurrent() {
         size_t CoreID = 0;
         __asm__ __volatile__("mov %0, %%fs\n" : "=r"(CoreID) : :);
-        return Processors[CoreID];
+        return __atomic_load_n(&Processors[CoreID], __ATOMIC_ACQUIRE);
     }
 
-    static Core* GetCore(int ID) { return Processors[ID]; }
+    static Core* GetCore(int ID) { return __atomic_load_n(&Processors[ID], __ATOMIC_ACQUIRE); }
 
     static void PreInit();
     static void Init();
 
    private:
+    /* Only ever written while cores are being brought up, and read on every exception and reschedule, so it has no lock.
+     * A Core is filled in before it's stored here, so whoever loads the pointer sees all of it. */
     static Core* Processors[];
 
     void Bootstrap();
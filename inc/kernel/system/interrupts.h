@@ -100,6 +100,9 @@ void IRQ15Handler(INTERRUPT_FRAME* Frame);
 
 void IRQ100Handler(INTERRUPT_FRAME* Frame);
 void IRQ127Handler(INTERRUPT_FRAME* Frame);
+void IRQ251Handler(INTERRUPT_FRAME* Frame); // Reschedule
+void IRQ252Handler(INTERRUPT_FRAME* Frame); // Local APIC timer
+void IRQ253Handler(INTERRUPT_FRAME* Frame); // TLB shootdown
 
 #ifdef __cplusplus
 }
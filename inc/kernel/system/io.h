@@ -53,6 +53,9 @@ size_t      WriteControlRegister(int CRX, size_t Data);
 size_t      WriteExtendedControlRegister(size_t XCRX, size_t Data);
 
 void        InvalidatePage(size_t Page);
+void        InvalidatePCID(size_t Type, size_t PCID, size_t Page);
+
+size_t      ReadTimeStampCounter(void);
 
 // XCS = Extended Code Segment
 size_t      ReadXCS(void);
@@ -143,6 +143,9 @@ extern "C" {
 
 #define KERNEL_STACK_REGION 0xFFFFE00000000000ull   // Kernel Stack Space
 #define KERNEL_STACK_END    0xFFFFE00040000000ull   // End of Kernel Stack Space
+#define KERNEL_STACK_SIZE   0x0000000000010000ull   // Usable bytes in each kernel thread stack
+#define KERNEL_STACK_GUARD  0x0000000000001000ull   // The unmapped page under each stack
+#define KERNEL_STACK_SLOT   (KERNEL_STACK_SIZE + KERNEL_STACK_GUARD)
 
 #define KERNEL_HEAP_REGION  0xFFFFE00080000000ull   // Kernel Object Space (kmalloc will allocate into this region)
 #define KERNEL_HEAP_END     0xFFFFE000C0000000ull   // End of Kernel Object Space
@@ -172,8 +175,25 @@ typedef struct {
     ticketlock_t Lock;
 
     size_t*  PML4;
+    volatile size_t ActiveCores;    // Bitmap of the cores that have this address space loaded, or hold a PCID for it.
 } address_space_t;
 
+// How many single pages a TLB batch will list before it gives up and flushes everything.
+#define TLB_BATCH_PAGES 32
+
+/**
+ * A list of virtual pages whose mappings have changed, waiting to be invalidated by FlushTLBBatch.
+ */
+typedef struct {
+    size_t Count;
+    size_t Pages[TLB_BATCH_PAGES];
+    bool   FlushAll;                // Too much changed to list; reload CR3 instead.
+    bool   Shared;                  // Something in the higher half changed, which every address space shares.
+} tlb_batch_t;
+
+// The IPI vector that tells another core to process its pending TLB invalidations.
+#define TLB_SHOOTDOWN_VECTOR 253
+
 typedef enum {
     MAP_WRITE = 0x1,
     MAP_EXEC = 0x2,
@@ -191,11 +211,27 @@ typedef struct {
 
     directptr_t Base;
 
+    // The head of the free list for each order.
     directptr_t* List;
 
+    // How many bytes past Base the free maps cover.
+    size_t Length;
+    // For each order, a bitmap with one bit per block. Set if that block is on a free list.
+    uint8_t** FreeMap;
+
     ticketlock_t Lock;
 } buddy_t;
 
+// Counters for a single core's cache of free physical frames.
+typedef struct {
+    size_t Hits;    // Page allocations served straight from the cache
+    size_t Misses;  // Page allocations that found the cache empty
+    size_t Refills; // Batches pulled in from the buddy lists
+    size_t Drains;  // Batches pushed back out to the buddy lists
+    size_t Frees;   // Page frees absorbed by the cache
+    size_t Cached;  // Frames currently held by the cache
+} frame_cache_stats_t;
+
 /*********************************************
 *    A b s t r a c t     A l l o c a t o r
 **********************************************/
@@ -205,6 +241,14 @@ const char* IntToAscii(int In);
 typedef void* allocator_t;
 typedef void* mempool_t;
 
+typedef struct {
+    size_t UsedBlocks;
+    size_t UsedBytes;
+    size_t FreeBlocks;
+    size_t FreeBytes;
+    size_t LargestFreeBlock;
+} allocator_stats_t;
+
 allocator_t CreateAllocator(void* Memory);
 allocator_t CreateAllocatorWithPool(void* Memory, size_t Bytes);
 
@@ -230,6 +274,10 @@ size_t      AllocatorMaxBlockSize(void);
 size_t      AllocatorPoolOverhead(void);
 size_t      AllocatorAllocateOverhead(void);
 
+int         AllocatorCheckHeap(allocator_t Allocator);
+int         AllocatorCheckPool(mempool_t Pool);
+void        AllocatorGetPoolStats(mempool_t Pool, allocator_stats_t* Stats);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -275,6 +323,10 @@ void        PhysFreePage(directptr_t Page);
 
 void        PhysFreeMem(directptr_t Phys, size_t count);
 
+void        PhysGetFrameCacheStats(size_t Core, frame_cache_stats_t* Stats);
+
+void        PhysDumpFrameCacheStats();
+
 size_t      SeekFrame();
 
 void        MemoryTest();
@@ -295,6 +347,14 @@ void*       memcpy(void* dest, void const* src, size_t len);
 void MapVirtualPage(address_space_t* AddressSpace, size_t Physical, size_t Virtual, size_t PageFlags);
 void MapVirtualPageNoDirect(address_space_t* AddressSpace, size_t Physical, size_t Virtual, size_t PageFlags);
 
+void MapVirtualRange(address_space_t* AddressSpace, size_t Physical, size_t Virtual, size_t Length, size_t PageFlags, tlb_batch_t* Batch);
+void UnmapVirtualRange(address_space_t* AddressSpace, size_t Virtual, size_t Length, tlb_batch_t* Batch);
+void FlushTLBBatch(address_space_t* AddressSpace, tlb_batch_t* Batch);
+void LoadAddressSpace(address_space_t* Next);
+void TLBCoreOnline(address_space_t* Current);
+void TLBSwitchBenchmark();
+void TLBShootdownInterrupt();
+
 size_t DecodeVirtualAddress(address_space_t* AddressSpace, size_t VirtualAddress);
 size_t DecodeVirtualAddressNoDirect(address_space_t* AddressSpace, size_t VirtualAddress);
 
@@ -306,9 +366,21 @@ void* ReallocateMemory(void* VirtualAddress, size_t NewSize);
 
 void  FreeMemory(void* VirtualAddress);
 
-void* AllocateKernelStack();
+/**
+ * Kernel thread stacks.
+ * Each is KERNEL_STACK_SIZE bytes in its own slot of KERNEL_STACK_REGION, with an unmapped guard page below it,
+ *  so running off the bottom faults instead of trampling whatever is next.
+ * The addresses handed out are the lowest usable byte; the stack grows down from Stack + KERNEL_STACK_SIZE.
+ */
+void   InitKernelStacks();
+
+void*  AllocateKernelStack();
 
-void  FreeKernelStack(void* StackAddress);
+void   FreeKernelStack(void* StackAddress);
+
+size_t KernelStackHighWater(void* StackAddress);
+
+bool   IsKernelStackGuard(size_t Address);
 
 void  PageFaultHandler(INTERRUPT_FRAME Frame);
 
@@ -317,6 +389,33 @@ extern void    *PREFIX(realloc)(void *, size_t);	///< The standard function.
 extern void    *PREFIX(calloc)(size_t, size_t);		///< The standard function.
 extern void     PREFIX(free)(void *);				///< The standard function.
 
+/**
+ * Allocation profiling.
+ * When built with the CHROMA_ALLOC_PROFILE CMake option, every kmalloc, kcalloc, krealloc, kfree and operator new
+ *  is attributed to the address it was called from, and AllocProfileDump prints the busiest call sites.
+ * Without it, the hooks below compile to nothing and AllocProfileDump only says so.
+ */
+void AllocProfileRecord(void* Pointer, size_t Size, void* Caller);
+void AllocProfileForget(void* Pointer);
+void AllocProfileRetag(void* Pointer, void* Caller);
+void AllocProfileDump();
+
+#ifdef CHROMA_ALLOC_PROFILE
+#define ALLOC_PROFILE_ALLOC(Pointer, Size) \
+    AllocProfileRecord((Pointer), (Size), __builtin_return_address(0))
+#define ALLOC_PROFILE_FREE(Pointer) \
+    AllocProfileForget((Pointer))
+#define ALLOC_PROFILE_REALLOC(Old, New, Size) \
+    do { if ((New) != NULL || (Size) == 0) { AllocProfileForget((Old)); AllocProfileRecord((New), (Size), __builtin_return_address(0)); } } while (0)
+#define ALLOC_PROFILE_RETAG(Pointer) \
+    AllocProfileRetag((Pointer), __builtin_return_address(0))
+#else
+#define ALLOC_PROFILE_ALLOC(Pointer, Size)      ((void) 0)
+#define ALLOC_PROFILE_FREE(Pointer)             ((void) 0)
+#define ALLOC_PROFILE_REALLOC(Old, New, Size)   ((void) 0)
+#define ALLOC_PROFILE_RETAG(Pointer)            ((void) 0)
+#endif
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/************************
+ *** Team Kitty, 2021 ***
+ ***     Chroma       ***
+ ***********************/
+
+/* This file contains the sleeping locks.
+ * A ticketlock spins until it gets the lock, which is fine for a few instructions, and a waste of a whole time slice
+ *  when the holder has been switched out. These block instead, so the core goes to someone who can use it.
+ *
+ * They're all built on the futex: wait on an address for as long as it holds a value, and wake whoever waits on it.
+ * Uncontended, none of them leaves the calling process or takes a lock.
+ *
+ * None of them may be used from an interrupt handler, or with interrupts disabled.
+ */
+
+class Process;
+
+// Wake every waiter, however many there are.
+#define FUTEX_WAKE_ALL ((size_t) -1)
+
+// How many times a mutex is retried, while its holder is running, before the caller goes to sleep on it.
+#define MUTEX_SPINS 4096
+
+// Block while *Address holds Expected. Returns false straight away if it doesn't. Waking up is no promise that it changed.
+bool FutexWait(volatile uint32_t* Address, uint32_t Expected);
+
+// Wake up to Count processes waiting on Address. Returns how many were woken.
+size_t FutexWake(volatile uint32_t* Address, size_t Count);
+
+/**
+ * A lock that spins for as long as its holder is on a core, and sleeps once it isn't, or after MUTEX_SPINS tries.
+ * State is 0 when it's free, 1 when it's held, and 2 when it's held and someone might be asleep waiting for it.
+ */
+class Mutex {
+    volatile uint32_t State;
+    Process* volatile Owner;
+
+public:
+    constexpr Mutex() : State(0), Owner(nullptr) {};
+
+    void Lock();
+
+    bool TryLock();
+
+    void Unlock();
+};
+
+class Semaphore {
+    volatile uint32_t Count;
+    volatile uint32_t Waiters;
+
+public:
+    constexpr Semaphore(uint32_t Initial = 0) : Count(Initial), Waiters(0) {};
+
+    // Take one, blocking until there is one.
+    void Wait();
+
+    bool TryWait();
+
+    void Post();
+};
+
+/**
+ * Waiters block on the sequence number they saw when they let go of the mutex,
+ *  so a signal sent between them letting go and blocking isn't missed.
+ */
+class ConditionVariable {
+    volatile uint32_t Sequence;
+
+public:
+    constexpr ConditionVariable() : Sequence(0) {};
+
+    // Let go of Lock, and wait to be signalled. Lock is held again when this returns, and the condition must be checked again.
+    void Wait(Mutex* Lock);
+
+    void Signal();
+
+    void Broadcast();
+};
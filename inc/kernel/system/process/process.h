@@ -11,13 +11,41 @@
  ***     Chroma       ***
  ***********************/
 
-#define MAX_CORES 8
-#define MAX_PROCESSES 128
-#define PROCESS_STACK 65535
+// How many process slots, and hash buckets, the process table starts with. Both double as needed.
+#define PROCESS_TABLE_INITIAL 64
+#define PROCESS_STACK KERNEL_STACK_SIZE
+
+// How many messages each process' mailbox holds. Must be a power of two.
+#define MAILBOX_SLOTS 32
+// The most a message can carry in its own slot. Anything bigger goes as pages.
+#define MESSAGE_INLINE 88
+// Set in a message's Flags when Content is a page transfer that the receiver now owns.
+#define MESSAGE_PAGES 0x1
 
 #define USE_CURRENT_CPU ((size_t)-1)
 #define BALANCE_CPUS ((size_t)-2)
 
+// Scheduling priorities, within a class. 0 is the most urgent.
+// A realtime process only runs when no more urgent realtime process can; a fair process gets more time the lower its priority.
+#define PRIORITY_LEVELS 8
+#define PRIORITY_DEFAULT 4
+
+// The lists of a run queue: one per realtime priority, then one for the fair class and one for the idle class.
+#define QUEUE_LEVEL_FAIR PRIORITY_LEVELS
+#define QUEUE_LEVEL_IDLE (PRIORITY_LEVELS + 1)
+#define QUEUE_LEVELS (PRIORITY_LEVELS + 2)
+
+// An affinity mask that lets a process run anywhere.
+#define AFFINITY_ALL ((size_t)-1)
+
+// Sent to a halted core to make it look at its run queue.
+#define RESCHEDULE_VECTOR 251
+
+class RunQueue;
+class WaitQueue;
+class ProcessTable;
+class Mailbox;
+
 
 typedef void (* function_t)();
 
@@ -39,6 +67,13 @@ public:
         PROCESS_REAP        // Process wants to die
     };
 
+    // How the scheduler picks between processes. Every realtime process runs ahead of every fair one, and so on down.
+    enum SchedulingClass {
+        CLASS_REALTIME,     // First in, first out within a priority. Only a more urgent realtime process, or blocking, takes the core away.
+        CLASS_FAIR,         // Shares the core in proportion to a weight set by priority, by always running whoever has had the least.
+        CLASS_IDLE          // Only runs when nothing else on the core wants to.
+    };
+
     // The process' buffers, for moving data in and out of the system
     enum BufferTypes {
         STDOUT,
@@ -54,17 +89,16 @@ public:
         uint8_t Type; // An entry of BufferTypes.
     } __attribute__((packed));
 
-    // A packet used for IPC
+    // A packet used for IPC. Exactly two cache lines, so that neighbouring slots of a mailbox don't share one.
     struct ProcessMessage {
-        uint8_t MessageID;
-        size_t Source;      // Originating PID
-        size_t Destination; // Target PID
-        size_t Content;     // Pointer to the data.
-        size_t Length;      // Size of the data. End is Content + Length
-        size_t Response;
-        bool Read;          // True if message has been read
-        bool Free;          // True if memory can be reused for something else
-    } __attribute__((packed));
+        volatile size_t Sequence;   // Which pass of the mailbox ring this slot is ready for. See Mailbox.
+        size_t Source;              // Originating PID
+        uint32_t Type;              // Up to the sender and receiver to agree on.
+        uint32_t Flags;             // MESSAGE_PAGES, or 0.
+        size_t Length;              // Size of the data.
+        size_t Content;             // The pages, for a page transfer. Unused otherwise.
+        uint8_t Inline[MESSAGE_INLINE]; // The data, for anything that fits.
+    };
 
     // Important information about the process.
     // Its' stack and stack pointer, plus the page tables.
@@ -99,15 +133,57 @@ private:
     bool IsInterrupted = false; // True if an interrupt was fired while this process is active
 
     uint8_t Signals[8]; // Interrupt / IRQ / Signal handlers.
-    uint8_t Sleeping;   // 0 if active, else the process is waiting for something. TODO: remove this, use State?
+    size_t Sleeping;    // 0 if active, nonzero while the process waits for its sleep timer (or forever, if it's dying).
+    timer_event_t SleepTimer {};
+
+    Mailbox* Messages = nullptr; // A queue of IPC messages.
+
+    uint8_t Class = CLASS_FAIR;
+    uint8_t Priority = PRIORITY_DEFAULT;
+    size_t Affinity = AFFINITY_ALL; // Bit n is set if the process may run on core n.
+
+    // For the fair class: how much time it has had, in TSC cycles scaled by its weight, and when it was last charged for it.
+    size_t VirtualRuntime = 0;
+    size_t RunStarted = 0;
 
-    ProcessMessage* Messages; // A queue of IPC messages.
-    size_t LastMessage; // The index of the current message.
+    // Links for the run queue this process is waiting in, if it is runnable.
+    // RequeueLock is held by Requeue from reading the state to linking the process in, so that two cores can't both queue it.
+    ticketlock_t RequeueLock {};
+    RunQueue* Queue = nullptr;
+    uint8_t QueueLevel = 0;     // The list it was queued in.
+    Process* QueueNext = nullptr;
+    Process* QueuePrev = nullptr;
 
     lainlib::bitmap ProcessMemory;
 
+    // Set from when a core switches to the process until it has finished switching away, and is off its stack.
+    volatile bool OnCore = false;
+
+    // Links for the wait queue this process is blocked on, if any, and what it's waiting for there. Zero for a plain wait.
+    WaitQueue* WaitingOn = nullptr;
+    size_t WaitKey = 0;
+    Process* WaitNext = nullptr;
+    Process* WaitPrev = nullptr;
+
+    // The next process for the reaper, once this one has been killed.
+    Process* DeadNext = nullptr;
+
+    // The next process in the same bucket of the process table's PID and name indexes.
+    Process* PIDNext = nullptr;
+    Process* NameNext = nullptr;
+
     // TODO: Stack Trace & MFS
 
+    // Put the process in the run queue it belongs in, or take it out of any, to match its state.
+    void Requeue();
+    // The same, with RequeueLock already held.
+    void RequeueLocked();
+
+    friend class RunQueue;
+    friend class WaitQueue;
+    friend class ProcessTable;
+    friend class ProcessManager;
+
 public:
 
     Process(size_t KPID) : State(PROCESS_AVAILABLE), UniquePID(-1), KernelPID(KPID) {
@@ -115,7 +191,7 @@ public:
 
     Process(const char* ProcessName, size_t KPID, size_t UPID, size_t EntryPoint, bool Userspace)
             : User(Userspace), UniquePID(UPID), KernelPID(KPID), Entry(EntryPoint), ORS(false), Sleeping(0),
-              LastMessage(0), ProcessMemory(new uint8_t[USERSPACE_MEM_SIZE / PAGE_SIZE / 8], USERSPACE_MEM_SIZE / PAGE_SIZE){
+              ProcessMemory(new uint8_t[USERSPACE_MEM_SIZE / PAGE_SIZE / 8], USERSPACE_MEM_SIZE / PAGE_SIZE){
 
         memcpy((void*) Name, ProcessName, strlen(ProcessName) + 1);
         ProcessMemory.setFree(0, USERSPACE_MEM_SIZE / PAGE_SIZE);
@@ -134,18 +210,20 @@ public:
 
     void InitMemory();
 
+    // Give the process a mailbox, so it can be sent messages.
     void InitMessages();
 
+    Mailbox* GetMailbox() { return Messages; };
+
     void Kill() {
-        State = ProcessState::PROCESS_REAP;
         Sleeping = -1;
+        SetState(ProcessState::PROCESS_REAP);
     };
 
     void Destroy();
 
-    void Rename(const char* NewName) {
-        memcpy(Name, NewName, strlen(Name) > strlen(NewName) ? strlen(Name) : strlen(NewName));
-    }
+    // Change the name, and where the process table indexes it.
+    void Rename(const char* NewName);
 
     void* AllocateProcessSpace(size_t Bytes);
 
@@ -164,20 +242,47 @@ public:
         }
     };
 
-    void SetState(ProcessState NewState) { State = NewState; };
+    void SetState(ProcessState NewState);
 
-    void SetActive(bool NewState) { IsActive = NewState; };
+    void SetActive(bool NewState) { IsActive = NewState; Requeue(); };
 
-    void SetCore(size_t CoreID) { Core = CoreID; };
+    void SetCore(size_t CoreID) { Core = CoreID; Requeue(); };
 
-    void IncreaseSleep(size_t Interval) { Sleeping += Interval; };
+    void SetPriority(uint8_t NewPriority) {
+        Priority = NewPriority < PRIORITY_LEVELS ? NewPriority : PRIORITY_LEVELS - 1;
+        Requeue();
+    };
+
+    void SetScheduling(SchedulingClass NewClass, uint8_t NewPriority) {
+        Class = NewClass;
+        SetPriority(NewPriority);
+    };
+
+    // Restrict the process to a set of cores, moving it if its current core isn't one of them.
+    void SetAffinity(size_t Mask) {
+        if (Mask == 0)
+            return;
+        Affinity = Mask;
+        if (!(Affinity & (1ull << Core)))
+            SetCore(__builtin_ctzll(Affinity));
+    };
 
-    void DecreaseSleep(size_t Interval) { Sleeping -= Interval; };
+    // Take the process off its run queue until the given tick.
+    void SleepUntil(size_t Deadline);
+
+    // Take the process off its run queue until something calls Wake.
+    void Block();
+
+    // End a sleep early, or on time; called by the sleep timer.
+    void Wake();
 
     /*************************************************************/
 
     ProcessHeader* GetHeader() { return &Header; };
 
+    // The most of its stack this process has used so far.
+    size_t GetStackHighWater() const { return Header.Stack == nullptr ? 0 : KernelStackHighWater(Header.Stack); };
+
     const char* GetName() const { return Name; };
 
     size_t GetPID() const { return UniquePID; };
@@ -196,7 +301,9 @@ public:
 
     bool IsSleeping() const { return Sleeping; };
 
-    size_t GetSleepCounter() const { return Sleeping; };
+    bool IsOnCore() const { return __atomic_load_n(&OnCore, __ATOMIC_ACQUIRE); };
+
+    size_t GetEntry() const { return Entry; };
 
     bool CanRun(const size_t CPU) const {
         bool flag = !(ORS && !IsActive);
@@ -206,6 +313,21 @@ public:
 
     size_t GetCore() const { return Core; };
 
+    uint8_t GetPriority() const { return Priority; };
+
+    SchedulingClass GetClass() const { return (SchedulingClass) Class; };
+
+    // Which of its run queue's lists the process goes in.
+    uint8_t GetQueueLevel() const {
+        return Class == CLASS_REALTIME ? Priority : Class == CLASS_FAIR ? QUEUE_LEVEL_FAIR : QUEUE_LEVEL_IDLE;
+    };
+
+    size_t GetVirtualRuntime() const { return VirtualRuntime; };
+
+    size_t GetAffinity() const { return Affinity; };
+
+    bool CanRunOn(size_t CPU) const { return CPU < 64 && (Affinity & (1ull << CPU)); };
+
     bool IsUserspace() { return User; };
 
     bool IsSystem() { return System; };
@@ -232,7 +354,7 @@ public:
  */
 class ProcessManager {
 public:
-    TSS64 TSS[MAX_CORES];
+    TSS64 TSS[Constants::Core::MAX_CORES];
     uint32_t CoreCount = 1;
 
     ProcessManager() {}
@@ -242,9 +364,12 @@ public:
     // Sets internal data, such as the paging tables.
     void SwitchContextInternal(Process* next);
 
-    // Switch to the given process on the current core.
+    // Switch to the given process on the current core, or back to its idle loop if it's null. Returns once switched back to.
     size_t SwitchContext(INTERRUPT_FRAME* frame, Process* NextProcess);
 
+    // Requeue the process this core just switched away from, and set the timer for the one now running.
+    void FinishSwitch();
+
     // Tell all cores to immediately switch context.
     void NotifyAllCores();
 
@@ -260,17 +385,49 @@ public:
     // Kill the given process with the given return code.
     void Kill(size_t PID, int Code);
 
+    // Put a process on the dead list and wake the reaper. The process is marked as dying first.
+    static void Bury(Process* Target);
+
+    // Destroy every dead process that has finished switching away. Returns true if any haven't yet.
+    static bool ReapDead();
+
     // Sleep the current process for the given number of milliseconds
     static void Sleep(size_t Count);
 
     // Sleep the given process for the given number of milliseconds
     void Sleep(size_t Count, size_t PID);
 
-    // Called from an interrupt timer handler. Forces task scheduling to switch.
-    size_t SchedulerInterrupt(INTERRUPT_FRAME* CurrentFrame, bool ForceSwitch);
+    // Sleep the current process until the given tick.
+    static void SleepUntil(size_t Deadline);
+
+    // Switch away until the current process, which has already been blocked, is woken.
+    static void WaitForWake(Process* Current);
+
+    // Called from an interrupt timer handler. Forces task scheduling to switch. Yield gives the core up to anything of the same class and priority.
+    size_t SchedulerInterrupt(INTERRUPT_FRAME* CurrentFrame, bool ForceSwitch, bool Yield = false);
+
+    // Get the next process to run on this core: the most urgent realtime process, else the fair one that has had least time, else an idle one.
+    Process* GetNextToRun(bool Yield);
 
-    // Get the next process to run. If current is the ID of the current process, this will emulate round-robin scheduling.
-    Process* GetNextToRun(size_t current);
+    // Change the scheduling class and priority of a process. Returns false if there is no such process.
+    bool SetScheduling(size_t PID, Process::SchedulingClass Class, uint8_t Priority);
+
+    // Copy up to MESSAGE_INLINE bytes into the process' mailbox. Returns false if it doesn't exist, or its mailbox is full.
+    static bool SendMessage(size_t PID, uint32_t Type, const void* Data, size_t Length);
+
+    // Hand pages from AllocateMessagePages to the process. On success they're the receiver's, and the sender must not touch them again.
+    static bool SendPages(size_t PID, uint32_t Type, void* Pages, size_t Length);
+
+    // Take the oldest message for the current process, if there is one.
+    static bool PollMessage(Process::ProcessMessage* Message);
+
+    // Take the oldest message for the current process, blocking until one arrives.
+    static void ReceiveMessage(Process::ProcessMessage* Message);
+
+    // Pages that can be sent without copying them. The receiver frees them.
+    static void* AllocateMessagePages(size_t Length);
+
+    static void FreeMessagePages(void* Pages, size_t Length);
 
     // Create a Process instance for the given data
     Process* CreateProcessInternal(const char* name, function_t entry, bool userspace);
@@ -290,11 +447,253 @@ public:
     // Set up paging for a new process
     void InitProcessPagetable(Process* proc, bool Userspace);
 
+    // Give a new process a kernel stack, ready for its first switch.
+    void InitProcessStack(Process* proc);
+
     // Set up architecture-specific data for a process. AARCH64 maybe?
     void InitProcessArch(Process* proc);
 
     // Deal with current CPU / CPU load balancing
     size_t HandleRequest(size_t CPU);
 
+    // Run the idle loop on this core: halt until there's something to do. Never returns.
+    [[noreturn]] static void Idle();
+
     inline static void yield() { __asm __volatile("int $100"); }
-};
\ No newline at end of file
+};
+
+// Save the callee-saved registers and stack pointer into *SaveRSP, and resume the thread whose stack is at NewRSP.
+extern "C" void SwitchStacks(size_t* SaveRSP, size_t NewRSP);
+
+// Time yields, context switches, wakeups and messages on this core, and print the results over serial. Run it from a process.
+void SchedulerBenchmark();
+
+#ifdef CHROMA_SCHED_BENCHMARK
+// Called by FinishSwitch with the cycles spent in SwitchContext, and in the whole scheduler pass that led to it.
+void BenchmarkRecordSwitch(size_t CoreID, size_t SwitchCycles, size_t ScheduleCycles);
+#endif
+
+/**
+ * The processes that are ready to run on one core, and nothing else.
+ * There is one list per realtime priority, one for the fair class and one for the idle class,
+ *  and a bitmap of which lists have anything in them.
+ * The fair list is kept in order of virtual runtime; the rest are first in, first out.
+ * Removing and picking the next process are constant time, and so is adding, except to the fair list.
+ *
+ * Processes are linked in through their own Queue fields, so queueing never allocates.
+ * Only Process::Requeue should add or remove them, apart from the scheduler taking one out to run it;
+ *  everything else changes a process' state and lets it follow.
+ * A zeroed RunQueue is empty and ready to use.
+ */
+class RunQueue {
+    ticketlock_t Lock;
+    Process* Heads[QUEUE_LEVELS];
+    Process* Tails[QUEUE_LEVELS];
+    uint32_t Occupied;          // Bit n is set if Heads[n] is not null.
+    volatile size_t Count;
+
+    size_t MinVirtualRuntime;   // Never goes backwards. Fair processes that have been away are brought up to near it.
+    volatile uint8_t Running;   // The list the process running on this core came from, or QUEUE_LEVELS if it's idle.
+
+    size_t Steals;              // Processes this core has taken from others.
+    size_t Stolen;              // Processes other cores have taken from this one.
+
+    void Unlink(Process* Target);
+
+    // Take a process out of this queue to be switched to.
+    void Claim(Process* Target);
+
+    // Whether GiveUp would find a process for the given core.
+    bool HasWorkFor(size_t Thief);
+
+    // Give up a process that is allowed to run on the given core, for it to run there instead.
+    Process* GiveUp(size_t Thief);
+
+    // Wake a halted core to run, or steal, a process just queued on the given core.
+    static void WakeIdleCore(size_t Owner);
+
+    // Interrupt the given busy core, whose queue was empty until now, so that it arms its slice timer.
+    static void Kick(size_t Owner);
+
+    // Interrupt the given core if the process just queued there should run instead of what it's running.
+    static void Preempt(size_t Owner, uint8_t Level);
+
+    // Whether Next should take the core from Current, which is still running. Called with the lock held.
+    bool ShouldPreempt(Process* Current, Process* Next, bool Yield);
+
+public:
+    static RunQueue* ForCore(size_t CoreID);
+
+    // Add a process to the back of its priority's list.
+    void Enqueue(Process* Target);
+
+    // Take a process out, if it is in this queue.
+    void Remove(Process* Target);
+
+    // The process that should run next, left in the queue.
+    Process* Peek();
+
+    /* Take the process that should run next, if it should replace Current. A null Current is replaced by anything.
+     * It comes out already marked running, so that a wakeup meanwhile can't queue it again before the switch. */
+    Process* Dequeue(Process* Current, bool Yield);
+
+    // Charge the process running on this queue's core for its time since it was last charged.
+    void Account(Process* Current);
+
+    // Note that this queue's core is switching to the given process, or to its idle loop if it's null.
+    void SetRunning(Process* Next);
+
+    // Take a process from the longest queue of another core, for the given core to run.
+    static Process* Steal(size_t Thief);
+
+    // Whether the given core has a process waiting, or could steal one. An idle core uses this to decide whether to halt.
+    static bool WorkAvailable(size_t CoreID);
+
+    // Print every core's queue length and steal counters.
+    static void PrintStats();
+
+    // Mark a core as halted in its idle loop, or not. Queueing work wakes idle cores.
+    static void SetIdle(size_t CoreID, bool Idle);
+
+    size_t Size() const { return Count; };
+
+    size_t GetSteals() const { return Steals; };
+
+    size_t GetStolen() const { return Stolen; };
+};
+/**
+ * Somewhere for processes to block until something happens.
+ * Waiters are woken in the order they arrived. They're linked in through their own Wait fields, so waiting never allocates.
+ *
+ * To wait for a condition without missing the wakeup that goes with it, take a ticket with Prepare, check the condition,
+ *  then Wait with the ticket: if anyone has woken the queue since the ticket was taken, Wait returns at once.
+ * WaitFor does all of that. Whoever makes the condition true must do so before they call WakeOne or WakeAll.
+ *
+ * A zeroed WaitQueue is empty and ready to use.
+ */
+class WaitQueue {
+    ticketlock_t Lock;
+    Process* Head;
+    Process* Tail;
+    volatile size_t Generation;     // Goes up by one on every wakeup.
+
+    void Unlink(Process* Target);
+    void Enqueue(Process* Target, size_t Key);
+
+public:
+    size_t Prepare() const { return __atomic_load_n(&Generation, __ATOMIC_ACQUIRE); };
+
+    // Block the current process until it is woken, unless the queue has been woken since Prepare gave out Ticket.
+    void Wait(size_t Ticket);
+
+    // Wait until Ready() returns true.
+    template<typename Condition>
+    void WaitFor(Condition Ready) {
+        while (true) {
+            size_t Ticket = Prepare();
+            if (Ready())
+                return;
+            Wait(Ticket);
+        }
+    };
+
+    // Block the current process under the address, if it still holds Expected once the queue is locked. Returns false if it didn't.
+    bool WaitIfEqual(volatile uint32_t* Address, uint32_t Expected);
+
+    // Wake the process that has waited longest. Returns false if nobody was waiting.
+    bool WakeOne();
+
+    // Wake up to Count of the processes waiting under the address, oldest first. Returns how many were woken.
+    size_t WakeAddress(volatile uint32_t* Address, size_t Count);
+
+    void WakeAll();
+
+    // Take a process off the queue without waking it, if it's on it. For when it's being destroyed.
+    void Remove(Process* Target);
+};
+
+/**
+ * Every process there is, found by slot, PID or name in constant time.
+ * Slots are the processes' kernel PIDs. Freed slots go on a stack to be handed out again, and when there are none left, the table doubles.
+ * The PID and name indexes are hash tables chained through the processes themselves, and also double as they fill.
+ *
+ * Slot 0 is handed out first, and never again: a kernel PID of 0 marks a process that is never scheduled.
+ */
+class ProcessTable {
+    static void LinkPID(Process* Target);
+    static void LinkName(Process* Target);
+    static void UnlinkPID(Process* Target);
+    static void UnlinkName(Process* Target);
+
+    // Double the buckets of both indexes, and spread every process over them again.
+    static bool GrowBuckets();
+
+    // FromPID, for when the table is already read-locked.
+    static Process* FindPID(size_t PID);
+
+    static size_t ReadLock();
+    static void ReadUnlock(size_t Cookie);
+
+public:
+    static void Init();
+
+    // Take a free slot, growing the table if there isn't one. Returns -1 if there's no memory to grow it.
+    static int64_t Reserve();
+
+    // Put the process in the slot it was reserved, and index it by PID and name.
+    static void Insert(Process* Target);
+
+    // Take the process out of its slot and the indexes, and free the slot.
+    static void Remove(Process* Target);
+
+    static Process* FromPID(size_t PID);
+
+    /* Call Action with the process with this PID, with the table read-locked throughout.
+     * Removing a process waits for the write lock, so the process can't be destroyed and freed while Action uses it.
+     * Action mustn't block, or create or remove processes. Returns what it returned, or false if there's no such process. */
+    template<typename Callback>
+    static bool WithPID(size_t PID, Callback Action) {
+        size_t Cookie = ReadLock();
+        Process* Found = FindPID(PID);
+        bool Result = Found != nullptr && Action(Found);
+        ReadUnlock(Cookie);
+        return Result;
+    }
+
+    // The most recently created process with this name.
+    static Process* FromName(const char* Name);
+
+    static void Rename(Process* Target, const char* NewName);
+
+    static size_t Count();
+};
+
+/**
+ * A bounded ring of messages for one process. Any number of processes can send at once, without a lock;
+ *  only the owner receives.
+ *
+ * Each slot's Sequence says whose turn it is: a slot is free for the sender that claims position N when it reads N,
+ *  and holds that sender's message once it reads N + 1. Taking the message sets it to N + MAILBOX_SLOTS, ready for the next pass.
+ */
+class Mailbox {
+    Process::ProcessMessage Slots[MAILBOX_SLOTS];
+
+    volatile size_t Head;               // Positions claimed by senders, ever.
+    size_t Tail;                        // Positions taken by the owner, ever.
+
+    WaitQueue Arrivals;                 // The owner, when it's waiting for a message.
+
+public:
+    Mailbox();
+
+    // Claim a slot and fill it in. Returns false if the mailbox is full.
+    bool Post(size_t Source, uint32_t Type, uint32_t Flags, const void* Data, size_t Length, size_t Content);
+
+    // Only the owner may take messages.
+    bool TryTake(Process::ProcessMessage* Message);
+
+    void Take(Process::ProcessMessage* Message);
+
+    // Free the pages of any transfers that were never taken. For when the owner is being destroyed.
+    void Discard();
+};
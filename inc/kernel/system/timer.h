@@ -0,0 +1,86 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/************************
+ *** Team Kitty, 2021 ***
+ ***     Chroma       ***
+ ***********************/
+
+/* This file contains the kernel's time base, and timers.
+ * Time is read from the TSC, so it keeps counting whether or not any interrupt arrives.
+ * It's counted in ticks of 1/CHROMA_TICK_HZ seconds, which is also the scheduler's time slice.
+ *
+ * Every core keeps its own timer wheel, and runs its local APIC timer in one-shot mode:
+ *  it's set for the next timer due on that core, or the end of the current slice if something is waiting to run.
+ * A core with neither doesn't get interrupted at all.
+ */
+
+// How many ticks there are in a second. Override with -DCHROMA_TICK_HZ=...
+#ifndef CHROMA_TICK_HZ
+#define CHROMA_TICK_HZ 100
+#endif
+
+// The interrupt vector of the local APIC timer.
+#define TIMER_VECTOR 252
+
+// A deadline that never comes.
+#define TIMER_NEVER ((size_t) -1)
+
+typedef void (* timer_callback_t)(void* Argument);
+
+/**
+ * Something that should happen at a point in time.
+ * The caller owns the memory; the wheel links it in through Next and Prev, so arming a timer never allocates.
+ * A zeroed timer_event_t is disarmed.
+ */
+typedef struct timer_event {
+    size_t Deadline;            // In ticks since boot.
+    timer_callback_t Callback;  // Called from the timer interrupt, with interrupts disabled.
+    void* Argument;
+
+    struct timer_event* Next;
+    struct timer_event* Prev;
+    void* Wheel;                // The wheel this timer is armed on, or null.
+    size_t Position;            // Which of the wheel's lists it is in.
+} timer_event_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Measure the local APIC timer and the TSC against the PIT. Must run once, on the bootstrap core, before any StartCoreTimer.
+void CalibrateTimer();
+
+// Put the calling core's timer in one-shot mode and start its wheel.
+void StartCoreTimer();
+
+// Ticks since the timer was calibrated.
+size_t GetTicks();
+
+// Milliseconds since the timer was calibrated.
+size_t GetUptimeMilliseconds();
+
+size_t MillisecondsToTicks(size_t Milliseconds);
+
+// The TSC's rate, in cycles per millisecond.
+size_t GetTSCFrequency();
+
+// The TSC value at which the given tick begins.
+size_t GetTickTSC(size_t Tick);
+
+// Call Callback(Argument) from this core's timer interrupt, once Deadline has passed.
+void TimerArm(timer_event_t* Timer, size_t Deadline, timer_callback_t Callback, void* Argument);
+
+// Disarm a timer. Returns false if it wasn't armed, or has already fired.
+bool TimerCancel(timer_event_t* Timer);
+
+// Run every timer that is due on this core. Called from the timer interrupt.
+void TimerInterrupt();
+
+// Set this core's timer for the next thing it needs to wake up for. NeedSlice asks for the end of the current time slice too.
+void ProgramNextTimer(bool NeedSlice);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,68 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/************************
+ *** Team Kitty, 2021 ***
+ ***     Chroma       ***
+ ***********************/
+
+/* This file contains the kernel's event tracer.
+ * Hot paths - the scheduler, interrupt handlers, the allocator - can't afford to print to serial,
+ *  so they record small binary events instead, stamped with the TSC.
+ *
+ * Every core has its own ring of records. A write claims a slot with one atomic add, then fills it in, with no lock,
+ *  so a trace point is safe anywhere: with interrupts off, inside an interrupt, or inside another trace point.
+ * When a ring is full, the oldest records are overwritten.
+ *
+ * The "tracer" kernel thread drains the rings to serial at the lowest priority, and TraceDump prints whatever is left on a panic.
+ */
+
+// How many records each core keeps. Must be a power of two. Override with -DCHROMA_TRACE_RECORDS=...
+#ifndef CHROMA_TRACE_RECORDS
+#define CHROMA_TRACE_RECORDS 512
+#endif
+
+// Stands in for a PID when a core is running its idle loop.
+#define TRACE_IDLE ((size_t) -1)
+
+typedef enum {
+    TRACE_SCHEDULE,     // The scheduler ran.                   A: the current PID, or TRACE_IDLE. B: 1 if forced.
+    TRACE_SWITCH,       // A context switch.                    A: the previous PID.                B: the next PID.
+    TRACE_IRQ,          // An interrupt arrived.                A: the vector.                      B: 0.
+    TRACE_WAKE,         // A sleeping process was woken.        A: its PID.                         B: 0.
+    TRACE_ALLOC,        // kmalloc, kcalloc or krealloc.        A: the address.                     B: the size.
+    TRACE_FREE,         // kfree.                               A: the address.                     B: 0.
+    TRACE_EVENT_COUNT
+} trace_event_t;
+
+typedef struct {
+    volatile size_t Sequence;   // Which write this is, plus one. Zero while it's being written.
+    size_t Timestamp;           // The TSC when it was recorded.
+    uint32_t Event;             // A trace_event_t.
+    uint32_t Reserved;
+    size_t Arguments[2];
+} trace_record_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Allocate every core's ring. Nothing is recorded until this has run, once the heap is up.
+void TraceInit();
+
+// Record an event on the calling core.
+void Trace(trace_event_t Event, size_t A, size_t B);
+
+// Print every record that hasn't been printed yet, on every core. Returns how many were printed.
+size_t TraceDrain();
+
+// Print the last records of every core, whether they were drained or not. For when the kernel is about to stop.
+void TraceDump();
+
+// The body of the "tracer" kernel thread.
+void TraceThread();
+
+#ifdef __cplusplus
+}
+#endif
@@ -38,6 +38,9 @@ typedef struct {
 
 extern PRINTINFO PrintInfo;
 
+// Copy out PrintInfo as it was between two writes to it.
+void GetPrintInfo(PRINTINFO* Snapshot);
+
 void DrawPixel(size_t x, size_t y);
 void FillScreen(uint32_t color);
 
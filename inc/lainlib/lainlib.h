@@ -15,6 +15,8 @@
 
 #include <lainlib/mutex/spinlock.h>
 #include <lainlib/mutex/ticketlock.h>
+#include <lainlib/mutex/rwlock.h>
+#include <lainlib/mutex/seqlock.h>
 
 #include <lainlib/string/str.h>
 
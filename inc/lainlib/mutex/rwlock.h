@@ -0,0 +1,60 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <lainlib/mutex/ticketlock.h>
+
+/************************
+ *** Team Kitty, 2021 ***
+ ***     Chroma       ***
+ ***********************/
+
+/* This file provides a reader-writer lock, for tables that are looked at far more often than they are changed.
+ *
+ * Readers don't share a counter. Each core counts its readers in its own cache line,
+ *  so readers on different cores never touch the same memory, and never bounce it between them.
+ * A writer pays for that instead: it has to look at every core's count before it can go ahead.
+ *
+ * Writers are preferred. Once a writer has announced itself, new readers hold back until it's done,
+ *  so a steady stream of readers can't keep it out forever.
+ *
+ * Both sides disable interrupts while they hold the lock. Under writer preference, an interrupt that reads
+ *  on a core that is already reading would wait on a writer that is waiting on the reader it interrupted.
+ *
+ * Create a new lock with NEW_RWLOCK().
+ * Read with RWReadLockIRQSave(), and hand what it returns to RWReadUnlockIRQRestore().
+ * Write with RWWriteLockIRQSave() and RWWriteUnlockIRQRestore().
+ */
+
+// How many reader counts a lock keeps. Cores beyond this share, which is still correct, only slower.
+#define RWLOCK_SLOTS    16
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    volatile size_t Readers;
+} __attribute__((aligned(64))) rwlock_slot_t;
+
+typedef struct {
+    rwlock_slot_t Slots[RWLOCK_SLOTS];
+    volatile size_t Writing;    // Set while a writer holds the lock, or waits for the readers to leave.
+    ticketlock_t WriterLock;    // Queues writers behind each other.
+} rwlock_t;
+
+#define NEW_RWLOCK()  (rwlock_t{})
+
+/**
+ * @return The interrupt state and the reader count that was used. Only good for RWReadUnlockIRQRestore.
+ */
+size_t RWReadLockIRQSave(rwlock_t* Lock);
+
+void RWReadUnlockIRQRestore(rwlock_t* Lock, size_t Cookie);
+
+size_t RWWriteLockIRQSave(rwlock_t* Lock);
+
+void RWWriteUnlockIRQRestore(rwlock_t* Lock, size_t Flags);
+
+#ifdef __cplusplus
+}
+#endif
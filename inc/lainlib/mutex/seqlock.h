@@ -0,0 +1,50 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <lainlib/mutex/ticketlock.h>
+
+/************************
+ *** Team Kitty, 2021 ***
+ ***     Chroma       ***
+ ***********************/
+
+/* This file provides a sequence lock, for small structures that are read often and written rarely.
+ *
+ * Readers don't write anything at all. They note the sequence number, copy out what they want,
+ *  and copy it again if the number changed meanwhile. The number is odd while a writer is busy.
+ * Writers queue up on an ordinary ticketlock, with interrupts disabled.
+ *
+ * Only plain data can be read this way: a reader may see a half-written copy before it retries,
+ *  so it mustn't follow pointers or act on anything it read until SeqReadRetry says it's good.
+ *
+ * Create a new lock with NEW_SEQLOCK(). A read looks like this:
+ *
+ *  size_t Sequence;
+ *  do {
+ *      Sequence = SeqReadBegin(&Lock);
+ *      Copy = Shared;
+ *  } while (SeqReadRetry(&Lock, Sequence));
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    volatile size_t Sequence;
+    ticketlock_t WriterLock;
+} seqlock_t;
+
+#define NEW_SEQLOCK()  (seqlock_t{})
+
+size_t SeqReadBegin(seqlock_t* Lock);
+
+bool SeqReadRetry(seqlock_t* Lock, size_t Sequence);
+
+size_t SeqWriteLockIRQSave(seqlock_t* Lock);
+
+void SeqWriteUnlockIRQRestore(seqlock_t* Lock, size_t Flags);
+
+#ifdef __cplusplus
+}
+#endif
@@ -8,22 +8,40 @@
  ***********************/
 
 /* This file provides a simple implementation of a ticket-based locking system.
- * You should probably prefer Spinlock over Ticketlock.
+ * You should probably prefer Ticketlock over Spinlock; it is fair, and it actually blocks.
  *
  * Create a new lock with NEW_TICKETLOCK(),
  *  lock a resource with TicketLock().
  *
  * Use TicketUnlock() to free the resource after you are done.
  *
+ * Anything that can also be taken from an interrupt handler must use
+ *  TicketLockIRQSave() and TicketUnlockIRQRestore() instead, so that the handler cannot
+ *  spin forever on a lock held by the code it interrupted.
+ *
+ * When the kernel is built with CHROMA_LOCK_STATS, each lock also counts how often it was contended,
+ *  how long waiters spun, and how many TSC cycles it was held for.
  */
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+typedef struct {
+    size_t Acquisitions;
+    size_t Contended;           // Acquisitions that had to wait for another holder.
+    size_t Spins;               // Times a waiter went around the pause loop.
+    size_t HoldCycles;          // Total TSC cycles spent holding the lock.
+    size_t MaxHoldCycles;
+    size_t AcquiredAt;          // TSC at the most recent acquisition.
+} ticketlock_stats_t;
+
 typedef struct {
     size_t NowServing;
     size_t NextTicket;
+#ifdef CHROMA_LOCK_STATS
+    ticketlock_stats_t Stats;
+#endif
 } ticketlock_t;
 
 #define NEW_TICKETLOCK()  (ticketlock_t{})
@@ -34,6 +52,25 @@ bool TicketAttemptLock(ticketlock_t* Lock);
 
 void TicketUnlock(ticketlock_t* Lock);
 
+size_t TicketLockIRQSave(ticketlock_t* Lock);
+
+void TicketUnlockIRQRestore(ticketlock_t* Lock, size_t Flags);
+
+bool TicketGetStats(ticketlock_t* Lock, ticketlock_stats_t* Stats);
+
+void TicketPrintStats(const char* Name, ticketlock_t* Lock);
+
+/**
+ * Disable interrupts on this core.
+ * @return The RFLAGS value to hand back to RestoreInterrupts.
+ */
+size_t DisableInterrupts();
+
+/**
+ * Re-enable interrupts, but only if they were enabled when the matching DisableInterrupts was called.
+ */
+void RestoreInterrupts(size_t Flags);
+
 #ifdef __cplusplus
 }
-#endif
\ No newline at end of file
+#endif
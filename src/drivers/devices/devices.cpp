@@ -1,5 +1,6 @@
 #include <driver/generic/device.h>
 #include <kernel/system/io.h>
+#include <lainlib/lainlib.h>
 
 /************************
  *** Team Kitty, 2021 ***
@@ -21,32 +22,57 @@ Device::GenericStorage* StorageDevicesArray[MAX_STORAGE_DEVICES];
 // Internal storage. Index into the above array.
 size_t CurrentStorageDevice = 0;
 
+// Guards both arrays, and their counts. Devices are looked up all the time, and only registered while booting.
+static rwlock_t DevicesLock;
+
 // Internal storage. TODO: Make this not a pain to maintain
 const char* DeviceNames[] = {"Storage", "Internal", "Peripheral", "Networking"};
 
 
 // Add a device pointer to the managed list.
 void Device::RegisterDevice(Device::GenericDevice* Device) {
-    DevicesArray[CurrentDevice] = Device;
-    Device->DeviceID = CurrentDevice;
-    CurrentDevice++;
-    SerialPrintf("[  DEV] Registered device %d called %s of type %s\r\n", CurrentDevice - 1, Device->GetName(),
+    size_t Flags = RWWriteLockIRQSave(&DevicesLock);
+    size_t ID = CurrentDevice;
+    if (ID < MAX_DEVICES) {
+        DevicesArray[ID] = Device;
+        Device->DeviceID = ID;
+        CurrentDevice++;
+    }
+    RWWriteUnlockIRQRestore(&DevicesLock, Flags);
+
+    if (ID >= MAX_DEVICES) {
+        SerialPrintf("[  DEV] No room to register %s.\r\n", Device->GetName());
+        return;
+    }
+
+    SerialPrintf("[  DEV] Registered device %d called %s of type %s\r\n", ID, Device->GetName(),
                  DeviceNames[Device->GetType()]);
 }
 
 // Retrieve a device pointer from the managed list.
 Device::GenericDevice* Device::GetDevice(size_t ID) {
-    return DevicesArray[ID];
+    size_t Cookie = RWReadLockIRQSave(&DevicesLock);
+    Device::GenericDevice* Found = ID < CurrentDevice ? DevicesArray[ID] : nullptr;
+    RWReadUnlockIRQRestore(&DevicesLock, Cookie);
+    return Found;
 }
 
 void Device::RegisterStorageDevice(Device::GenericStorage* Device) {
     RegisterDevice(Device);
-    StorageDevicesArray[CurrentStorageDevice] = Device;
-    CurrentStorageDevice++;
+
+    size_t Flags = RWWriteLockIRQSave(&DevicesLock);
+    if (CurrentStorageDevice < MAX_STORAGE_DEVICES) {
+        StorageDevicesArray[CurrentStorageDevice] = Device;
+        CurrentStorageDevice++;
+    }
+    RWWriteUnlockIRQRestore(&DevicesLock, Flags);
 }
 
 Device::GenericStorage* Device::GetStorageDevice(size_t ID) {
-    return StorageDevicesArray[ID];
+    size_t Cookie = RWReadLockIRQSave(&DevicesLock);
+    Device::GenericStorage* Found = ID < CurrentStorageDevice ? StorageDevicesArray[ID] : nullptr;
+    RWReadUnlockIRQRestore(&DevicesLock, Cookie);
+    return Found;
 }
 
 // Get the count of registered devices.
@@ -55,12 +81,17 @@ size_t Device::GetTotalDevices() { return CurrentDevice; }
 template <typename T>
 // Get the first registered instance of a specific type of device
 T* Device::FindDevice() {
-    for (size_t i = 0; i < CurrentDevice; i++)
+    T* Found = nullptr;
+
+    size_t Cookie = RWReadLockIRQSave(&DevicesLock);
+    for (size_t i = 0; i < CurrentDevice && Found == nullptr; i++)
         if (DevicesArray[i]->GetType() == T::GetRootType())
-            return static_cast<T*>(DevicesArray[i]);
+            Found = static_cast<T*>(DevicesArray[i]);
+    RWReadUnlockIRQRestore(&DevicesLock, Cookie);
 
-    SerialPrintf("[DEVICE] Warning: Unable to find a %s device.\r\n", DeviceNames[T::GetRootType()]);
-    return static_cast<T*>(nullptr);
+    if (Found == nullptr)
+        SerialPrintf("[DEVICE] Warning: Unable to find a %s device.\r\n", DeviceNames[T::GetRootType()]);
+    return Found;
 }
 
 // Get the first registered instance of a Storage device
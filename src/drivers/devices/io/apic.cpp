@@ -39,12 +39,13 @@ uint32_t APIC::ReadIO(size_t Base, uint32_t Register) {
     return *((volatile uint32_t*) (Base + 16));
 }
 
+// Registers are given as byte offsets from the base of the APIC.
 uint32_t APIC::ReadRegister(uint32_t Register) {
-    return *((volatile uint32_t*) ((size_t*) Address + Register));
+    return *((volatile uint32_t*) ((size_t) Address + Register));
 }
 
 void APIC::WriteRegister(uint32_t Register, uint32_t Data) {
-    *((volatile uint32_t*) ((size_t*) Address + Register)) = Data;
+    *((volatile uint32_t*) ((size_t) Address + Register)) = Data;
 }
 
 void APIC::Enable() {
@@ -65,10 +66,6 @@ void APIC::Init() {
 
     SerialPrintf("[ ACPI] Enabling APICs...\r\n");
 
-    for (int i = 0; i < 3; i++) {
-        MapVirtualPage(&KernelAddressSpace, (size_t) Address + i * PAGE_SIZE, (size_t) Address + i * PAGE_SIZE, 3);
-    }
-
     Address = (void*) ACPI::MADT::instance->LocalAPICBase;
     SerialPrintf("[ MADT] The APIC of this core is at 0x%p\r\n", (size_t) Address);
 
@@ -77,6 +74,8 @@ void APIC::Init() {
         for (;;) { }
     }
 
+    MapVirtualRange(&KernelAddressSpace, (size_t) Address, (size_t) Address, 3 * PAGE_SIZE, 3, nullptr);
+
     // Write "Local APIC Enabled" to the APIC Control Register.
     WriteModelSpecificRegister(0x1B, (ReadModelSpecificRegister(0x1B) | 0x800) & ~(1 << 10));
     Enable();
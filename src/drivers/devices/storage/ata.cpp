@@ -73,7 +73,7 @@ bool ATADevice::HasATA() {
 }
 
 void ATADevice::ReadData(size_t Address, size_t Length, uint8_t* Buffer) {
-    TicketAttemptLock(&ATALock);
+    TicketLock(&ATALock);
     IRQWaiting = true;
 
     ATACommandWrite(true, SELECTOR, 0x40 | 0xE0);
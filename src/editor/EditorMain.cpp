@@ -14,8 +14,10 @@
 void Editor::StartEditor(int callbackID) {
     UNUSED(callbackID);
     EditorLayout layout;
-    layout.ScreenHeight = PrintInfo.screenHeight;
-    layout.ScreenWidth = PrintInfo.screenWidth;
+    PRINTINFO Info;
+    GetPrintInfo(&Info);
+    layout.ScreenHeight = Info.screenHeight;
+    layout.ScreenWidth = Info.screenWidth;
     layout.HeaderHeight = layout.ScreenHeight / 100 * 3;
 
     layout.TextBoxHeight = ((layout.ScreenHeight - layout.HeaderHeight) / 100) * 95;
@@ -28,7 +30,7 @@ void Editor::StartEditor(int callbackID) {
     FillScreen(0x000084);
 
     SetForegroundColor(0x00BBBBBB);
-    DrawFilledRect(0, 0, PrintInfo.screenWidth, layout.HeaderHeight);
+    DrawFilledRect(0, 0, Info.screenWidth, layout.HeaderHeight);
     DrawFilledRect(layout.TextBoxX, layout.TextBoxY, layout.TextBoxWidth, layout.TextBoxHeight);
 
     for(;;) {}
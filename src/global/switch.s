@@ -0,0 +1,32 @@
+# Switch kernel stacks between two threads.
+#
+# void SwitchStacks(size_t* SaveRSP, size_t NewRSP)
+#
+# Pushes the registers the SysV ABI says a call preserves, stores the stack pointer in *SaveRSP,
+#  then loads NewRSP and pops the same registers back off the other thread's stack.
+# The ret then returns into wherever that thread called SwitchStacks from.
+# Everything else was already saved by the caller, or by the interrupt that led here.
+#
+# A new thread's stack is built to look like it called SwitchStacks itself: six zeroed registers, then its start address.
+
+.section .text
+.global SwitchStacks
+.type SwitchStacks, @function
+SwitchStacks:
+    push %rbp
+    push %rbx
+    push %r12
+    push %r13
+    push %r14
+    push %r15
+
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+
+    pop %r15
+    pop %r14
+    pop %r13
+    pop %r12
+    pop %rbx
+    pop %rbp
+    ret
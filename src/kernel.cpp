@@ -6,6 +6,7 @@
 #include "driver/io/apic.h"
 #include "driver/io/ps2_keyboard.h"
 #include "kernel/system/process/process.h"
+#include "kernel/system/trace.h"
 
 /************************
  *** Team Kitty, 2020 ***
@@ -51,6 +52,8 @@ extern "C" int Main(void) {
     PrepareCPU();
     InitMemoryManager();
     InitPaging();
+    InitKernelStacks();
+    TraceInit();
 
     Device::APIC::driver = new Device::APIC();
     Device::PS2Keyboard::driver = new Device::PS2Keyboard();
@@ -63,22 +66,41 @@ extern "C" int Main(void) {
 
     Device::APIC::driver->Init();
     Device::PS2Keyboard::driver->Init();
+    InitSerialInterrupts();
+
+    CalibrateTimer();
+    Core::InitExtraRegisters();
 
     Core::Init();
 
+#ifdef CHROMA_SWITCH_BENCHMARK
+    TLBSwitchBenchmark();
+#endif
+
     ProcessManager::instance->InitKernelProcess(mainThread);
 
-    for(;;) { ProcessManager::yield(); }
+#ifdef CHROMA_ALLOC_PROFILE
+    AllocProfileDump();
+#endif
+
+    // Nothing is preempted until the timer starts, so the rest of boot finishes first.
+    StartCoreTimer();
+    ProcessManager::Idle();
 }
 
 extern "C" void mainThread() {
     SerialPrintf("Kernel thread, woooo\r\n");
+#ifdef CHROMA_SCHED_BENCHMARK
+    SchedulerBenchmark();
+#endif
     for(;;) {};
 }
 
 
 extern "C" void SomethingWentWrong(const char* Message) {
+    SerialPanic();
     SerialPrintf("Assertion failed! %s\r\n", Message);
+    TraceDump();
     for(;;){}
 }
 
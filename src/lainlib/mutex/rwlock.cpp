@@ -0,0 +1,65 @@
+#include <lainlib/mutex/rwlock.h>
+#include <kernel/system/io.h>
+
+/************************
+ *** Team Kitty, 2021 ***
+ ***     Chroma       ***
+ ***********************/
+
+/* A reader counts itself in, then looks for a writer; a writer announces itself, then looks for readers.
+ * Both are sequentially consistent, so at least one of the two always sees the other, and backs off.
+ * The reader is the one that backs off if both do, which is the writer preference.
+ */
+
+#define RFLAGS_IF   (1 << 9)
+#define SLOT_MASK   (RWLOCK_SLOTS - 1)
+
+extern "C" {
+
+size_t GetCurrentCoreID();
+
+size_t RWReadLockIRQSave(rwlock_t* Lock) {
+    size_t Flags = DisableInterrupts();
+    size_t Slot = GetCurrentCoreID() & SLOT_MASK;
+    volatile size_t* Readers = &Lock->Slots[Slot].Readers;
+
+    while (true) {
+        while (__atomic_load_n(&Lock->Writing, __ATOMIC_RELAXED))
+            PAUSE;
+
+        __atomic_add_fetch(Readers, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&Lock->Writing, __ATOMIC_SEQ_CST))
+            break;
+
+        __atomic_sub_fetch(Readers, 1, __ATOMIC_RELEASE);
+    }
+
+    return (Flags & RFLAGS_IF) | Slot;
+}
+
+/**
+ * The count to take back out is the one that was put in, which isn't necessarily this core's,
+ *  in case the lock was shared by more cores than it has counts.
+ */
+void RWReadUnlockIRQRestore(rwlock_t* Lock, size_t Cookie) {
+    __atomic_sub_fetch(&Lock->Slots[Cookie & SLOT_MASK].Readers, 1, __ATOMIC_RELEASE);
+    RestoreInterrupts(Cookie & RFLAGS_IF);
+}
+
+size_t RWWriteLockIRQSave(rwlock_t* Lock) {
+    size_t Flags = TicketLockIRQSave(&Lock->WriterLock);
+    __atomic_store_n(&Lock->Writing, 1, __ATOMIC_SEQ_CST);
+
+    for (size_t i = 0; i < RWLOCK_SLOTS; i++)
+        while (__atomic_load_n(&Lock->Slots[i].Readers, __ATOMIC_SEQ_CST) != 0)
+            PAUSE;
+
+    return Flags;
+}
+
+void RWWriteUnlockIRQRestore(rwlock_t* Lock, size_t Flags) {
+    __atomic_store_n(&Lock->Writing, 0, __ATOMIC_RELEASE);
+    TicketUnlockIRQRestore(&Lock->WriterLock, Flags);
+}
+
+}
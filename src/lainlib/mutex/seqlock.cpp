@@ -0,0 +1,49 @@
+#include <lainlib/mutex/seqlock.h>
+#include <kernel/system/io.h>
+
+/************************
+ *** Team Kitty, 2021 ***
+ ***     Chroma       ***
+ ***********************/
+
+extern "C" {
+
+/**
+ * There's no point starting to read while a writer is busy, so wait for it here.
+ * @return The sequence number to hand to SeqReadRetry.
+ */
+size_t SeqReadBegin(seqlock_t* Lock) {
+    size_t Sequence;
+    while ((Sequence = __atomic_load_n(&Lock->Sequence, __ATOMIC_ACQUIRE)) & 1)
+        PAUSE;
+
+    return Sequence;
+}
+
+/**
+ * The fence keeps the reads of the data from moving after the second look at the number.
+ * @return Whether a writer got in since SeqReadBegin, so that what was read must be thrown away.
+ */
+bool SeqReadRetry(seqlock_t* Lock, size_t Sequence) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&Lock->Sequence, __ATOMIC_RELAXED) != Sequence;
+}
+
+/**
+ * The fence keeps the writes to the data from moving before the number goes odd.
+ */
+size_t SeqWriteLockIRQSave(seqlock_t* Lock) {
+    size_t Flags = TicketLockIRQSave(&Lock->WriterLock);
+
+    __atomic_store_n(&Lock->Sequence, Lock->Sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    return Flags;
+}
+
+void SeqWriteUnlockIRQRestore(seqlock_t* Lock, size_t Flags) {
+    __atomic_store_n(&Lock->Sequence, Lock->Sequence + 1, __ATOMIC_RELEASE);
+    TicketUnlockIRQRestore(&Lock->WriterLock, Flags);
+}
+
+}
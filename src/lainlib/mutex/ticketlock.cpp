@@ -1,28 +1,117 @@
 #include <lainlib/mutex/ticketlock.h>
+#include <stdint.h>
+#include <kernel/system/io.h>
 
 #define PAUSE   __asm__ __volatile__("pause")
 
+#define RFLAGS_IF   (1 << 9)
+
 extern "C" {
 
+#ifdef CHROMA_LOCK_STATS
+static inline size_t ReadTimestamp() {
+    uint32_t Low, High;
+    __asm__ __volatile__("rdtsc" : "=a"(Low), "=d"(High));
+    return ((size_t) High << 32) | Low;
+}
+#endif
+
+size_t DisableInterrupts() {
+    size_t Flags;
+    __asm__ __volatile__("pushfq\n\t" "popq %[flags]\n\t" "cli" : [flags] "=r"(Flags) : : "memory");
+    return Flags;
+}
+
+void RestoreInterrupts(size_t Flags) {
+    if (Flags & RFLAGS_IF)
+        __asm__ __volatile__("sti" : : : "memory");
+}
+
 void TicketLock(ticketlock_t* Lock) {
     size_t Ticket = __atomic_fetch_add(&Lock->NextTicket, 1, __ATOMIC_RELAXED);
-    __sync_synchronize();
-    while (__atomic_load_8(&Lock->NowServing, __ATOMIC_ACQUIRE) != Ticket) {
+    size_t Spins = 0;
+
+    while (__atomic_load_n(&Lock->NowServing, __ATOMIC_ACQUIRE) != Ticket) {
         PAUSE;
+        Spins++;
     }
+
+#ifdef CHROMA_LOCK_STATS
+    Lock->Stats.Acquisitions++;
+    Lock->Stats.Spins += Spins;
+    if (Spins != 0)
+        Lock->Stats.Contended++;
+    Lock->Stats.AcquiredAt = ReadTimestamp();
+#else
+    (void) Spins;
+#endif
 }
 
+/**
+ * Take the lock only if nobody holds it or is queued for it.
+ * @return Whether the lock was taken. If not, the lock is left untouched.
+ */
 bool TicketAttemptLock(ticketlock_t* Lock) {
-    size_t Ticket = __atomic_load_8(&Lock->NowServing, __ATOMIC_RELAXED);
-    __sync_synchronize();
-    return __atomic_compare_exchange_8(&Lock->NowServing, &Ticket, Ticket + 1, false, __ATOMIC_ACQUIRE,
-                                       __ATOMIC_RELAXED);
+    size_t Ticket = __atomic_load_n(&Lock->NowServing, __ATOMIC_RELAXED);
+
+    // The lock is free exactly when the next ticket to be handed out is the one being served.
+    if (!__atomic_compare_exchange_n(&Lock->NextTicket, &Ticket, Ticket + 1, false, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED))
+        return false;
+
+#ifdef CHROMA_LOCK_STATS
+    Lock->Stats.Acquisitions++;
+    Lock->Stats.AcquiredAt = ReadTimestamp();
+#endif
+    return true;
 }
 
 void TicketUnlock(ticketlock_t* Lock) {
-    size_t NextTicket = __atomic_load_8(&Lock->NowServing, __ATOMIC_RELAXED) + 1;
-    __sync_synchronize();
-    __atomic_store_8(&Lock->NowServing, NextTicket, __ATOMIC_RELEASE);
+#ifdef CHROMA_LOCK_STATS
+    size_t Held = ReadTimestamp() - Lock->Stats.AcquiredAt;
+    Lock->Stats.HoldCycles += Held;
+    if (Held > Lock->Stats.MaxHoldCycles)
+        Lock->Stats.MaxHoldCycles = Held;
+#endif
+
+    // Only the holder ever writes NowServing, so this needn't be atomic with respect to the load.
+    size_t NextTicket = __atomic_load_n(&Lock->NowServing, __ATOMIC_RELAXED) + 1;
+    __atomic_store_n(&Lock->NowServing, NextTicket, __ATOMIC_RELEASE);
+}
+
+size_t TicketLockIRQSave(ticketlock_t* Lock) {
+    size_t Flags = DisableInterrupts();
+    TicketLock(Lock);
+    return Flags;
 }
 
-}
\ No newline at end of file
+void TicketUnlockIRQRestore(ticketlock_t* Lock, size_t Flags) {
+    TicketUnlock(Lock);
+    RestoreInterrupts(Flags);
+}
+
+/**
+ * Copy out the contention counters of a lock.
+ * @return false if the kernel was built without CHROMA_LOCK_STATS, in which case Stats is zeroed.
+ */
+bool TicketGetStats(ticketlock_t* Lock, ticketlock_stats_t* Stats) {
+#ifdef CHROMA_LOCK_STATS
+    *Stats = Lock->Stats;
+    return true;
+#else
+    (void) Lock;
+    *Stats = ticketlock_stats_t{};
+    return false;
+#endif
+}
+
+void TicketPrintStats(const char* Name, ticketlock_t* Lock) {
+    ticketlock_stats_t Stats;
+    if (!TicketGetStats(Lock, &Stats))
+        return;
+
+    SerialPrintf("[ Lock] %s: %u acquisitions, %u contended, %u spins, %u cycles held (max %u)\r\n", Name,
+                 Stats.Acquisitions, Stats.Contended, Stats.Spins, Stats.HoldCycles, Stats.MaxHoldCycles);
+}
+
+}
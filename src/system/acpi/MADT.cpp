@@ -40,7 +40,7 @@ MADT::IOAPICEntry** MADT::GetIOApicEntries() {
 
         if (table->Type == MADT::Type::IOAPIC) {
             MADT::IOAPICEntry* io_apic = reinterpret_cast<MADT::IOAPICEntry*>(table);
-            MapVirtualPage(&KernelAddressSpace, io_apic->Address, io_apic->Address, 3);
+            MapVirtualRange(&KernelAddressSpace, io_apic->Address, io_apic->Address, PAGE_SIZE, 3, nullptr);
             entries[count] = (MADT::IOAPICEntry*) ((size_t) io_apic);
             count++;
         }
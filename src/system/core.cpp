@@ -1,5 +1,6 @@
 #include <kernel/chroma.h>
 #include <kernel/system/acpi/madt.h>
+#include <kernel/system/process/process.h>
 #include <driver/io/apic.h>
 
 /************************
@@ -7,6 +8,45 @@
  ***     Chroma       ***
  ***********************/
 
+/* This file also contains the extended register switching.
+ * Each process has its own save area for the FPU, SSE and AVX registers, sized from CPUID leaf 0xD.
+ * Switching is lazy: switching a process in sets CR0.TS, and its state is only loaded with XRSTOR when it first
+ *  touches those registers and takes a Device Not Available fault. Switching it out saves with XSAVEOPT, which skips
+ *  anything unchanged, and only if it took that fault; a process that never uses SSE costs nothing either way.
+ * If a process comes back to the core whose registers still hold its state, even the fault is skipped.
+ */
+
+#define CR0_MP          (1 << 1)
+#define CR0_EM          (1 << 2)
+#define CR0_TS          (1 << 3)
+
+#define CR4_OSFXSR      (1 << 9)
+#define CR4_OSXMMEXCPT  (1 << 10)
+#define CR4_OSXSAVE     (1 << 18)
+
+#define XCR0_X87        (1 << 0)
+#define XCR0_SSE        (1 << 1)
+#define XCR0_AVX        (1 << 2)
+#define XCR0_AVX512     (7 << 5)    // Opmask, and the upper halves of all 32 ZMM registers. All or none.
+
+// Offsets into the legacy region of a save area.
+#define AREA_FCW        0
+#define AREA_MXCSR      24
+
+#define DEFAULT_FCW     0x037F
+#define DEFAULT_MXCSR   0x1F80
+
+// Kept just before each save area.
+struct ExtraRegistersHeader {
+    void* Allocation;
+    volatile size_t LastCore;   // The core whose registers last had this state loaded, or -1.
+};
+
+static size_t ExtendedStateSize = 0;
+static size_t ExtendedFeatures = 0;     // What goes in XCR0.
+static bool XSaveSupported = false;
+static bool XSaveOptSupported = false;
+
 int Cores = 0;
 volatile bool Ready = false;
 
@@ -14,6 +54,17 @@ Core* Core::Processors[Constants::Core::MAX_CORES];
 TSS64 Tasks[Constants::Core::MAX_CORES];
 ACPI::MADT::LAPICEntry* LAPICs[Constants::Core::MAX_CORES];
 
+/**
+ * C-accessible way to find which core we're running on.
+ * Before the APIC driver is ready, only the bootstrap core can be running, so that's what we report.
+ */
+extern "C" size_t GetCurrentCoreID() {
+    if (Device::APIC::driver == nullptr || !Device::APIC::driver->IsReady())
+        return 0;
+
+    return Device::APIC::driver->GetCurrentCore();
+}
+
 extern "C" [[noreturn]] void initcpu() {
     // Init APIC
     WriteModelSpecificRegister(0x1B, (ReadModelSpecificRegister(0x1B) | 0x800) & ~(1 << 10));
@@ -22,16 +73,26 @@ extern "C" [[noreturn]] void initcpu() {
     __asm__ __volatile__("mov %%fs, %0" : : "r" (Device::APIC::driver->GetCurrentCore()) : );
 
     SerialPrintf("[CORE] Core %d ready.\r\n", Device::APIC::driver->GetCurrentCore());
+    TLBCoreOnline(nullptr);
+    Core::InitExtraRegisters();
+    StartCoreTimer();
     __asm__ __volatile__("cli");
     Ready = true;
     __asm__ __volatile__("sti");
 
-    for (;;) { }
+    // Halt until some other core has more work than it can handle, then go and take some.
+    ProcessManager::Idle();
 }
 
+/**
+ * The new core looks itself up as soon as it starts, so this has to be in the table before it's woken.
+ */
 Core::Core(size_t APIC, size_t ID) {
+    this->ID = ID;
+    LocalAPIC = APIC;
+    __atomic_store_n(&Processors[ID], this, __ATOMIC_RELEASE);
+
     Device::APIC::driver->PreinitializeCore(APIC);
-    GetCore(ID)->LocalAPIC = APIC;
 
     Bootstrap();
     //SetupData(ID);
@@ -47,10 +108,11 @@ Core::Core(size_t APIC, size_t ID) {
 
 void Core::PreInit() {
     for (size_t i = 0; i < Constants::Core::MAX_CORES; i++) {
-        Processors[i] = new Core();
+        Core* Placeholder = new Core();
+        if (i == 0)
+            Placeholder->AddressSpace = &KernelAddressSpace;
+        __atomic_store_n(&Processors[i], Placeholder, __ATOMIC_RELEASE);
     }
-
-    Processors[0]->AddressSpace = &KernelAddressSpace;
 }
 
 void Core::Init() {
@@ -95,9 +157,10 @@ void Core::Init() {
 
         if (Device::APIC::driver->GetCurrentCore() != LAPICs[i]->Core) {
             SerialPrintf("[ CORE] Enabling core %d.\r\n", i);
-            delete Processors[i];
-            Core* c = new Core(LAPICs[i]->APIC, LAPICs[i]->Core);
-            Processors[i] = c;
+            // The new Core replaces the placeholder itself. Nothing else looks at a core before it's running.
+            Core* Placeholder = GetCore(LAPICs[i]->Core);
+            new Core(LAPICs[i]->APIC, LAPICs[i]->Core);
+            delete Placeholder;
         }
     }
 }
@@ -117,3 +180,144 @@ void Core::StackTrace(size_t Cycles) {
     }
     SerialPrintf("[Trace] Stack trace over.\r\n");
 }
+
+static ExtraRegistersHeader* HeaderOf(uint8_t* Data) {
+    return reinterpret_cast<ExtraRegistersHeader*>(Data) - 1;
+}
+
+static void SaveArea(uint8_t* Data) {
+    if (XSaveOptSupported)
+        __asm__ __volatile__("xsaveopt64 (%0)" : : "r"(Data), "a"(0xFFFFFFFF), "d"(0xFFFFFFFF) : "memory");
+    else if (XSaveSupported)
+        __asm__ __volatile__("xsave64 (%0)" : : "r"(Data), "a"(0xFFFFFFFF), "d"(0xFFFFFFFF) : "memory");
+    else
+        __asm__ __volatile__("fxsave64 (%0)" : : "r"(Data) : "memory");
+}
+
+static void RestoreArea(uint8_t* Data) {
+    if (XSaveSupported)
+        __asm__ __volatile__("xrstor64 (%0)" : : "r"(Data), "a"(0xFFFFFFFF), "d"(0xFFFFFFFF) : "memory");
+    else
+        __asm__ __volatile__("fxrstor64 (%0)" : : "r"(Data) : "memory");
+}
+
+void Core::InitExtraRegisters() {
+    uint32_t Eax = 1, Ebx, Ecx = 0, Edx;
+    bool First = ExtendedStateSize == 0;
+
+    if (First) {
+        __asm__ __volatile__("cpuid" : "+a"(Eax), "=b"(Ebx), "+c"(Ecx), "=d"(Edx));
+        XSaveSupported = Ecx & (1 << 26);
+    }
+
+    WriteControlRegister(0, (ReadControlRegister(0) & ~(CR0_EM | CR0_TS)) | CR0_MP);
+    WriteControlRegister(4, ReadControlRegister(4) | CR4_OSFXSR | CR4_OSXMMEXCPT | (XSaveSupported ? CR4_OSXSAVE : 0));
+
+    if (!First) {
+        if (XSaveSupported)
+            WriteExtendedControlRegister(0, ExtendedFeatures);
+        return;
+    }
+
+    if (XSaveSupported) {
+        Eax = 0xD; Ecx = 0;
+        __asm__ __volatile__("cpuid" : "+a"(Eax), "=b"(Ebx), "+c"(Ecx), "=d"(Edx));
+
+        ExtendedFeatures = Eax & (XCR0_X87 | XCR0_SSE | XCR0_AVX);
+        if ((Eax & XCR0_AVX512) == XCR0_AVX512)
+            ExtendedFeatures |= XCR0_AVX512;
+        WriteExtendedControlRegister(0, ExtendedFeatures);
+
+        // EBX is the size needed for what's enabled in XCR0 right now.
+        Eax = 0xD; Ecx = 0;
+        __asm__ __volatile__("cpuid" : "+a"(Eax), "=b"(Ebx), "+c"(Ecx), "=d"(Edx));
+        ExtendedStateSize = Ebx;
+
+        Eax = 0xD; Ecx = 1;
+        __asm__ __volatile__("cpuid" : "+a"(Eax), "=b"(Ebx), "+c"(Ecx), "=d"(Edx));
+        XSaveOptSupported = Eax & 1;
+    } else {
+        ExtendedStateSize = 512;
+    }
+
+    SerialPrintf("[ CORE] Extended state: %u bytes, XCR0 0x%x, saved with %s.\r\n", ExtendedStateSize, ExtendedFeatures,
+                 XSaveOptSupported ? "XSAVEOPT" : XSaveSupported ? "XSAVE" : "FXSAVE");
+}
+
+/**
+ * A zeroed XSAVE header means every component is in its initial state, so XRSTOR ignores the rest of the area,
+ *  except for MXCSR, which it always loads; that and the x87 control word get the values the CPU resets them to.
+ */
+uint8_t* Core::AllocateExtraRegisters() {
+    if (ExtendedStateSize == 0)
+        return nullptr;
+
+    uint8_t* Allocation = (uint8_t*) kmalloc(ExtendedStateSize + sizeof(ExtraRegistersHeader) + 63);
+    if (Allocation == nullptr)
+        return nullptr;
+
+    uint8_t* Data = (uint8_t*) (((size_t) Allocation + sizeof(ExtraRegistersHeader) + 63) & ~(size_t) 63);
+    memset(Data, 0, ExtendedStateSize);
+    *(uint16_t*) (Data + AREA_FCW) = DEFAULT_FCW;
+    *(uint32_t*) (Data + AREA_MXCSR) = DEFAULT_MXCSR;
+
+    HeaderOf(Data)->Allocation = Allocation;
+    HeaderOf(Data)->LastCore = (size_t) -1;
+    return Data;
+}
+
+void Core::FreeExtraRegisters(uint8_t* Data) {
+    if (Data != nullptr)
+        kfree(HeaderOf(Data)->Allocation);
+}
+
+/**
+ * The idle loop and the interrupts it takes use the registers too, without trapping, so a switch to idle gives up ownership.
+ * Whatever was in them was saved when its process was switched out.
+ */
+void Core::LoadExtraRegisters(uint8_t* Data) {
+    if (ExtendedStateSize == 0)
+        return;
+
+    ExtendedPending = Data;
+
+    if (Data == nullptr) {
+        ExtendedOwner = nullptr;
+        __asm__ __volatile__("clts");
+        return;
+    }
+
+    if (ExtendedOwner == Data && HeaderOf(Data)->LastCore == GetCurrentCoreID())
+        __asm__ __volatile__("clts");
+    else
+        WriteControlRegister(0, ReadControlRegister(0) | CR0_TS);
+}
+
+/**
+ * If TS is still set, the process hasn't touched the registers since it was switched in, so what's in memory is current.
+ */
+void Core::SaveExtraRegisters(uint8_t* Data) {
+    if (Data == nullptr || ExtendedOwner != Data || (ReadControlRegister(0) & CR0_TS))
+        return;
+
+    SaveArea(Data);
+}
+
+/**
+ * Whatever the registers held before was saved when its process was switched out, so it can be overwritten.
+ */
+bool Core::ExtraRegistersTrap() {
+    if (ExtendedPending == nullptr || !(ReadControlRegister(0) & CR0_TS))
+        return false;
+
+    __asm__ __volatile__("clts");
+
+    size_t CoreID = GetCurrentCoreID();
+    if (ExtendedOwner != ExtendedPending || HeaderOf(ExtendedPending)->LastCore != CoreID) {
+        RestoreArea(ExtendedPending);
+        HeaderOf(ExtendedPending)->LastCore = CoreID;
+        ExtendedOwner = ExtendedPending;
+    }
+
+    return true;
+}
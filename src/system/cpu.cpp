@@ -1,5 +1,6 @@
 #include <kernel/chroma.h>
 #include <kernel/system/interrupts.h>
+#include <kernel/system/process/process.h>
 #include "driver/io/apic.h"
 
 /************************
@@ -25,7 +26,20 @@
 #define BP_STACK 4096
 
 void InvalidatePage(size_t Page) {
-    __asm__ __volatile__("invlpg (%%eax)" : : "a" (Page));
+    __asm__ __volatile__("invlpg (%0)" : : "r" (Page) : "memory");
+}
+
+/**
+ * Type 0 invalidates one page in the given PCID, 1 the whole PCID, 2 everything including global pages,
+ *  and 3 everything except global pages.
+ */
+void InvalidatePCID(size_t Type, size_t PCID, size_t Page) {
+    struct {
+        size_t PCID;
+        size_t Page;
+    } Descriptor = { PCID, Page };
+
+    __asm__ __volatile__("invpcid %0, %1" : : "m" (Descriptor), "r" (Type) : "memory");
 }
 
 __attribute__((aligned(64))) static volatile unsigned char NMIStack[NMI_STACK] = {0};
@@ -228,6 +242,9 @@ void SetupIDT() {
 
     SetISR(100, (size_t) IRQ100Handler);
     SetISR(127, (size_t) IRQ127Handler);
+    SetISR(RESCHEDULE_VECTOR, (size_t) IRQ251Handler);
+    SetISR(TIMER_VECTOR, (size_t) IRQ252Handler);
+    SetISR(TLB_SHOOTDOWN_VECTOR, (size_t) IRQ253Handler);
 
     for (size_t i = 0; i < 32; i++) {
         IRQHandlers[i] = {{}, 0 };
@@ -1,6 +1,7 @@
 #include <kernel/chroma.h>
 #include <kernel/video/draw.h>
 #include <kernel/system/interrupts.h>
+#include <kernel/system/trace.h>
 #include <stdbool.h>
 #include "driver/io/apic.h"
 #include "kernel/system/process/process.h"
@@ -79,6 +80,8 @@ const char* ExceptionStrings[] = {
 };
 
 IRQHandlerData IRQHandlers[32];
+// Every interrupt reads the table, and only drivers setting up ever write it.
+static rwlock_t IRQHandlersLock;
 
 /* All of the ISR routines call this function for now.
    ! This function is NOT leaf, and it might clobber the stack.
@@ -104,10 +107,12 @@ void ISR_Error_Common(INTERRUPT_FRAME* Frame, size_t ErrorCode, size_t Exception
     UNUSED(Frame);
 
     if (Exception < 32) {
+        SerialPanic();
         SetForegroundColor(0x0000FF00);
         FillScreen(0x0000FF00);
         SerialPrintf("[  ISR] ISR Error %d raised, EC %d!\r\n", Exception, ErrorCode);
         SerialPrintf("[  ISR] %s exception!\r\n", ExceptionStrings[Exception]);
+        TraceDump();
         while (true) { }
 
     }
@@ -120,15 +125,18 @@ void IRQ_Common(INTERRUPT_FRAME* Frame, size_t Interrupt) {
     // First we need to define a function pointer..
     IRQHandlerData handler;
 
+    Trace(TRACE_IRQ, Interrupt + 32, 0);
+
     /* We set all uninitialized routines to 0, so the if(handler) check here allows us to
-        safely tell whether we've actually got something for this IRQ. */
+        safely tell whether we've actually got something for this IRQ.
+       The handlers are copied out and called after the lock is dropped, so that one can install another. */
+    size_t Cookie = RWReadLockIRQSave(&IRQHandlersLock);
     handler = IRQHandlers[Interrupt];
-    if (handler.numHandlers > 0) {
-        //SerialPrintf("[  IRQ] IRQ %d raised!\r\n", Interrupt);
-        // Call the handlers
-        for (size_t i = 0; i < handler.numHandlers; i++)
+    RWReadUnlockIRQRestore(&IRQHandlersLock, Cookie);
+
+    for (size_t i = 0; i < handler.numHandlers; i++)
+        if (handler.handlers[i] != NULL)
             handler.handlers[i](Frame);
-    }
 
     Device::APIC::driver->SendEOI();
 }
@@ -178,12 +186,16 @@ size_t InstallIRQ(int IRQ, IRQHandler Handler) {
     if (IRQ <= 32) {
         Device::APIC::driver->Set(Core::GetCurrent()->ID, IRQ, 1);
 
+        size_t Flags = RWWriteLockIRQSave(&IRQHandlersLock);
         IRQHandlerData* target = &IRQHandlers[IRQ];
+        size_t ID = 0;
         if (target->numHandlers < 7) {
             target->handlers[target->numHandlers] = Handler;
             target->numHandlers++;
-            return target->numHandlers;
+            ID = target->numHandlers;
         }
+        RWWriteUnlockIRQRestore(&IRQHandlersLock, Flags);
+        return ID;
     }
 
     return 0;
@@ -191,8 +203,10 @@ size_t InstallIRQ(int IRQ, IRQHandler Handler) {
 
 /* A simple wrapper that unlinks a function pointer, rendering the IRQ unused. */
 void UninstallIRQHandler(int IRQ, size_t ID) {
+    size_t Flags = RWWriteLockIRQSave(&IRQHandlersLock);
     IRQHandlers[IRQ].handlers[ID] = NULL; // 0 is used in the common check to make sure that the function is callable.
     // This removes this IRQ from that check, ergo the function will no longer be called.
+    RWWriteUnlockIRQRestore(&IRQHandlersLock, Flags);
 }
 
 void InitInterrupts() {
@@ -274,10 +288,22 @@ __attribute__((interrupt)) void ISR6Handler(INTERRUPT_FRAME* Frame) {
 }
 
 __attribute__((interrupt)) void ISR7Handler(INTERRUPT_FRAME* Frame) {
+    // Most of these are the first SSE instruction of a process since it was switched in.
+    if (Core::GetCore(GetCurrentCoreID())->ExtraRegistersTrap())
+        return;
+
     ISR_Common(Frame, 7);
 }
 
+/**
+ * A kernel stack overflow faults on the guard page, and the page fault can't push its frame onto that same stack,
+ *  so it arrives here as a double fault, on the double fault's own stack.
+ */
 __attribute__((interrupt)) void ISR8Handler(INTERRUPT_FRAME* Frame, size_t ErrorCode) {
+    size_t FaultAddr = ReadControlRegister(2);
+    if (IsKernelStackGuard(FaultAddr))
+        SerialPrintf("[STACK] Kernel stack overflow at 0x%p, RSP 0x%p\r\n", FaultAddr, Frame->rsp);
+
     ISR_Error_Common(Frame, ErrorCode, 8);
 }
 
@@ -325,6 +351,8 @@ __attribute__((interrupt)) void ISR14Handler(INTERRUPT_FRAME* Frame, size_t Erro
     if (FaultInst) SerialPrintf("[FAULT] \"Instruction Fetch\"");
 
     SerialPrintf("[FAULT] } at address\n[FAULT] 0x%p\r\n\n", ReadControlRegister(2));
+    if (IsKernelStackGuard(ReadControlRegister(2)))
+        SerialPrintf("[STACK] That is a kernel stack's guard page; the stack overflowed.\r\n");
 
     Core::GetCurrent()->StackTrace(10);
     ISR_Error_Common(Frame, ErrorCode, 14); // Page Fault
@@ -469,13 +497,32 @@ __attribute__((interrupt)) void IRQ15Handler(INTERRUPT_FRAME* Frame) {
 }
 
 __attribute__((interrupt)) void IRQ100Handler(INTERRUPT_FRAME* Frame) {
-    ProcessManager::instance->SchedulerInterrupt(Frame, false);
+    ProcessManager::instance->SchedulerInterrupt(Frame, false, true);
 }
 
 __attribute__((interrupt)) void IRQ127Handler(INTERRUPT_FRAME* Frame) {
     ProcessManager::instance->SchedulerInterrupt(Frame, true);
 }
 
+__attribute__((interrupt)) void IRQ251Handler(INTERRUPT_FRAME* Frame) {
+    Trace(TRACE_IRQ, RESCHEDULE_VECTOR, 0);
+    Device::APIC::driver->SendEOI();
+    ProcessManager::instance->SchedulerInterrupt(Frame, false);
+}
+
+__attribute__((interrupt)) void IRQ252Handler(INTERRUPT_FRAME* Frame) {
+    Trace(TRACE_IRQ, TIMER_VECTOR, 0);
+    Device::APIC::driver->SendEOI();
+    TimerInterrupt();
+    ProcessManager::instance->SchedulerInterrupt(Frame, false);
+}
+
+__attribute__((interrupt)) void IRQ253Handler(INTERRUPT_FRAME* Frame) {
+    UNUSED(Frame);
+    TLBShootdownInterrupt();
+    Device::APIC::driver->SendEOI();
+}
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
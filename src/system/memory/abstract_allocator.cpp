@@ -21,8 +21,6 @@
 #define BLOCK_MIN_SIZE  (sizeof(block_header_t) - sizeof(block_header_t*))
 #define BLOCK_MAX_SIZE  (CAST(size_t, 1) << FL_LIMIT)
 
-#define static_assert _Static_assert
-
 extern void SomethingWentWrong(const char* Message);
 
 //#define ASSERT(X) _Static_assert(X)
@@ -78,16 +76,29 @@ alloc_decl int Alloc_FindLastOne_64(size_t size) {
 *      T Y P E   D E F I N I T I O N S
 **********************************************/
 
+/*
+ * The index counts can be tuned at build time.
+ * ALLOCATOR_SL_LIMIT_LN sets how many second-level lists (2^n) each first-level size class is split into.
+ * ALLOCATOR_FL_LIMIT sets the largest block the allocator can manage (2^n bytes).
+ */
+#ifndef ALLOCATOR_SL_LIMIT_LN
+#define ALLOCATOR_SL_LIMIT_LN 5
+#endif
+
+#ifndef ALLOCATOR_FL_LIMIT
+#define ALLOCATOR_FL_LIMIT 32
+#endif
+
 enum Alloc_Public {
 
-    SL_LIMIT_LN = 5,
+    SL_LIMIT_LN = ALLOCATOR_SL_LIMIT_LN,
 };
 
 enum Alloc_Private {
     ALIGN_SIZE_LN = 3,
     ALIGN_SIZE = (1 << ALIGN_SIZE_LN),
 
-    FL_LIMIT = 32,
+    FL_LIMIT = ALLOCATOR_FL_LIMIT,
 
     SL_INDEX_COUNT = (1 << SL_LIMIT_LN),
 
@@ -98,6 +109,10 @@ enum Alloc_Private {
 
 };
 
+// Both levels of bitmap are held in an unsigned int.
+static_assert(SL_INDEX_COUNT <= sizeof(unsigned int) * __CHAR_BIT__, "Too many second level lists");
+static_assert(FL_INDEX_COUNT <= sizeof(unsigned int) * __CHAR_BIT__, "Too many first level lists");
+
 
 typedef struct block_header_t {
     struct block_header_t* LastBlock;
@@ -634,6 +649,122 @@ mempool_t GetPoolFromAllocator(allocator_t Allocator) {
     return CAST(mempool_t, (char*) Allocator + AllocatorSize());
 }
 
+/***********************************************************************************
+*                 H E A P       C O N S I S T E N C Y       C H E C K S
+************************************************************************************/
+
+#define HEAP_CHECK(Condition, Message) \
+    do { \
+        if (!(Condition)) { \
+            SerialPrintf("Memory manager error at [%s:%x]: %s.\r\n", __FILE__, __LINE__, Message); \
+            Errors++; \
+        } \
+    } while (0)
+
+/*
+ * Walk every free list, making sure that the bitmaps agree with the lists,
+ *  and that every listed block is free, fully coalesced, and filed under the right size class.
+ *
+ * Returns the number of problems found; 0 means the allocator is consistent.
+ */
+int AllocatorCheckHeap(allocator_t Allocator) {
+    allocator_control_t* Controller = CAST(allocator_control_t*, Allocator);
+    int Errors = 0;
+
+    for (int FirstLevel = 0; FirstLevel < FL_INDEX_COUNT; FirstLevel++) {
+        for (int SecondLevel = 0; SecondLevel < SL_INDEX_COUNT; SecondLevel++) {
+            const unsigned int FLMap = Controller->FirstLevel_Bitmap & (1U << FirstLevel);
+            const unsigned int SLList = Controller->SecondLevel_Bitmap[FirstLevel];
+            const unsigned int SLMap = SLList & (1U << SecondLevel);
+            block_header_t* Block = Controller->Blocks[FirstLevel][SecondLevel];
+
+            if (!FLMap)
+                HEAP_CHECK(!SLMap, "Second level bitmap is set without its first level");
+
+            if (!SLMap) {
+                HEAP_CHECK(Block == &Controller->BlockNull, "Free list is populated, but its bitmap is clear");
+                continue;
+            }
+
+            HEAP_CHECK(FLMap, "First level bitmap is clear, but its second level is set");
+            HEAP_CHECK(Block != &Controller->BlockNull, "Free list is empty, but its bitmap is set");
+
+            while (Block != &Controller->BlockNull) {
+                int BlockFirstLevel, BlockSecondLevel;
+
+                HEAP_CHECK(BlockIsFree(Block), "Block on a free list is not marked free");
+                HEAP_CHECK(!BlockPrevIsFree(Block), "Block should have merged with the previous block");
+                HEAP_CHECK(!BlockIsFree(BlockGetNext(Block)), "Block should have merged with the next block");
+                HEAP_CHECK(BlockPrevIsFree(BlockGetNext(Block)), "Next block does not know this block is free");
+                HEAP_CHECK(BlockSize(Block) >= BLOCK_MIN_SIZE, "Block is smaller than the minimum size");
+
+                InsertMapping(BlockSize(Block), &BlockFirstLevel, &BlockSecondLevel);
+                HEAP_CHECK(BlockFirstLevel == FirstLevel && BlockSecondLevel == SecondLevel, "Block is on the wrong free list");
+
+                Block = Block->NextFreeBlock;
+            }
+        }
+    }
+
+    return Errors;
+}
+
+/*
+ * Walk every block of a pool in address order, making sure that each block's "previous is free" flag
+ *  agrees with the block before it, and that no two free blocks sit side by side.
+ *
+ * Returns the number of problems found; 0 means the pool is consistent.
+ */
+int AllocatorCheckPool(mempool_t Pool) {
+    block_header_t* Block = OffsetToBlock(Pool, -(ptrdiff_t) BLOCK_OVERHEAD);
+    int PreviousFree = 0;
+    int Errors = 0;
+
+    HEAP_CHECK(!BlockPrevIsFree(Block), "First block of the pool thinks it has a free neighbour");
+
+    while (BlockSize(Block) != 0) {
+        block_header_t* NextBlock = BlockGetNext(Block);
+
+        HEAP_CHECK(!(PreviousFree && BlockIsFree(Block)), "Two adjacent blocks are both free");
+        HEAP_CHECK(!BlockIsFree(Block) == !BlockPrevIsFree(NextBlock), "Block's free state does not match its neighbour's flag");
+        HEAP_CHECK(!BlockIsFree(Block) || NextBlock->LastBlock == Block, "Free block is not linked to its neighbour");
+
+        PreviousFree = BlockIsFree(Block);
+        Block = NextBlock;
+    }
+
+    HEAP_CHECK(!BlockIsFree(Block), "Pool sentinel is marked free");
+
+    return Errors;
+}
+
+#undef HEAP_CHECK
+
+/*
+ * Tally up how much of a pool is used, how much is free, and the largest block that could currently be handed out.
+ * Fragmentation can be estimated as 1 - (LargestFreeBlock / FreeBytes).
+ */
+void AllocatorGetPoolStats(mempool_t Pool, allocator_stats_t* Stats) {
+    block_header_t* Block = OffsetToBlock(Pool, -(ptrdiff_t) BLOCK_OVERHEAD);
+
+    *Stats = allocator_stats_t {};
+
+    while (BlockSize(Block) != 0) {
+        const size_t Size = BlockSize(Block);
+
+        if (BlockIsFree(Block)) {
+            Stats->FreeBlocks++;
+            Stats->FreeBytes += Size;
+            Stats->LargestFreeBlock = MAX(Stats->LargestFreeBlock, Size);
+        } else {
+            Stats->UsedBlocks++;
+            Stats->UsedBytes += Size;
+        }
+
+        Block = BlockGetNext(Block);
+    }
+}
+
 /***********************************************************************************
 *             S T D L I B         A L L O C A T E          F U N C T I O N S
 ************************************************************************************/
@@ -665,7 +796,7 @@ void* AllocatorMalign(allocator_t Allocator, size_t Alignment, size_t Size) {
         size_t Gap = CAST(size_t, CAST(ptrdiff_t, AlignedAddress) - CAST(ptrdiff_t, Address));
 
         if (Gap) {
-            if (Gap << MinimumGap) {
+            if (Gap < MinimumGap) {
                 const size_t GapRemaining = MinimumGap - Gap;
                 const size_t Offset = MAX(GapRemaining, Alignment);
                 const void* NextAlignedAddress = CAST(void*, CAST(ptrdiff_t, AlignedAddress) + Offset);
@@ -720,7 +851,7 @@ void* AllocatorRealloc(allocator_t Allocator, void* Address, size_t NewSize) {
         AllocatorFree(Allocator, Address);
 
     else if (!Address)  // Invalid address; alloc
-        AllocatorMalloc(Allocator, NewSize);
+        Pointer = AllocatorMalloc(Allocator, NewSize);
 
     else {
         block_header_t* Block = WhichBlock(Address);
@@ -0,0 +1,261 @@
+#include <kernel/chroma.h>
+
+/************************
+ *** Team Kitty, 2021 ***
+ ***     Chroma       ***
+ ***********************/
+
+/* This file contains the allocation profiler.
+ * When the kernel is built with CHROMA_ALLOC_PROFILE, the kmalloc family reports every allocation and free here,
+ *  tagged with the return address of whoever called it.
+ *
+ * Everything lives in fixed tables, since the profiler cannot very well allocate memory itself:
+ *  - Sites holds the running totals for each distinct caller.
+ *  - Live maps every outstanding pointer back to its site and size, so that a free can be charged correctly.
+ * Both are open-addressed. If either fills up, further events are counted as dropped rather than recorded.
+ */
+
+#ifdef CHROMA_ALLOC_PROFILE
+
+#define PROFILE_SITES       1024        // Must be a power of two.
+#define PROFILE_LIVE        8192        // Must be a power of two.
+#define PROFILE_REPORT      32          // How many sites the dump prints.
+
+typedef struct {
+    void* Caller;
+    size_t Calls;                       // Allocations made from here.
+    size_t Bytes;                       // Bytes requested from here, in total.
+    size_t LiveObjects;                 // Allocations from here not yet freed.
+    size_t LiveBytes;
+    size_t PeakBytes;                   // Highest LiveBytes ever got.
+} alloc_site_t;
+
+typedef struct {
+    void* Pointer;
+    size_t Size;
+    size_t Site;
+} alloc_live_t;
+
+static alloc_site_t Sites[PROFILE_SITES];
+static alloc_live_t Live[PROFILE_LIVE];
+static size_t SiteCount = 0;
+static size_t LiveCount = 0;
+static size_t TotalLiveBytes = 0;
+static size_t PeakLiveBytes = 0;
+static size_t Dropped = 0;
+static ticketlock_t ProfileLock = NEW_TICKETLOCK();
+
+static inline size_t HashPointer(void* Pointer) {
+    return (((size_t) Pointer >> 4) * 0x9E3779B97F4A7C15ull) >> 32;
+}
+
+/**
+ * @return The index of the site for this caller, creating it if need be, or PROFILE_SITES if the table is full.
+ */
+static size_t FindSite(void* Caller) {
+    size_t Index = HashPointer(Caller) & (PROFILE_SITES - 1);
+
+    for (size_t i = 0; i < PROFILE_SITES; i++) {
+        alloc_site_t* Site = &Sites[Index];
+        if (Site->Caller == Caller)
+            return Index;
+
+        if (Site->Caller == NULL) {
+            // Keep a quarter of the table empty so that probes stay short.
+            if (SiteCount >= PROFILE_SITES - PROFILE_SITES / 4)
+                return PROFILE_SITES;
+            Site->Caller = Caller;
+            SiteCount++;
+            return Index;
+        }
+
+        Index = (Index + 1) & (PROFILE_SITES - 1);
+    }
+
+    return PROFILE_SITES;
+}
+
+static size_t FindLive(void* Pointer) {
+    size_t Index = HashPointer(Pointer) & (PROFILE_LIVE - 1);
+
+    while (Live[Index].Pointer != NULL) {
+        if (Live[Index].Pointer == Pointer)
+            return Index;
+        Index = (Index + 1) & (PROFILE_LIVE - 1);
+    }
+
+    return PROFILE_LIVE;
+}
+
+/**
+ * Remove an entry from the live table, shifting the rest of its probe run back so that no tombstones are needed.
+ */
+static void RemoveLive(size_t Hole) {
+    size_t Index = Hole;
+
+    Live[Hole].Pointer = NULL;
+    LiveCount--;
+    for (;;) {
+        Index = (Index + 1) & (PROFILE_LIVE - 1);
+        if (Live[Index].Pointer == NULL)
+            return;
+
+        size_t Home = HashPointer(Live[Index].Pointer) & (PROFILE_LIVE - 1);
+        // Only move the entry back if its home slot is not between the hole and where it sits now.
+        if (((Index - Home) & (PROFILE_LIVE - 1)) >= ((Index - Hole) & (PROFILE_LIVE - 1))) {
+            Live[Hole] = Live[Index];
+            Live[Index].Pointer = NULL;
+            Hole = Index;
+        }
+    }
+}
+
+static void Charge(size_t SiteIndex, size_t Size) {
+    alloc_site_t* Site = &Sites[SiteIndex];
+
+    Site->Calls++;
+    Site->Bytes += Size;
+    Site->LiveObjects++;
+    Site->LiveBytes += Size;
+    if (Site->LiveBytes > Site->PeakBytes)
+        Site->PeakBytes = Site->LiveBytes;
+
+    TotalLiveBytes += Size;
+    if (TotalLiveBytes > PeakLiveBytes)
+        PeakLiveBytes = TotalLiveBytes;
+}
+
+static void Release(size_t SiteIndex, size_t Size) {
+    alloc_site_t* Site = &Sites[SiteIndex];
+
+    Site->LiveObjects--;
+    Site->LiveBytes -= Size;
+    TotalLiveBytes -= Size;
+}
+
+static void RecordLocked(void* Pointer, size_t Size, void* Caller) {
+    size_t SiteIndex = FindSite(Caller);
+    if (SiteIndex == PROFILE_SITES || LiveCount >= PROFILE_LIVE - PROFILE_LIVE / 4) {
+        Dropped++;
+        return;
+    }
+
+    size_t Index = HashPointer(Pointer) & (PROFILE_LIVE - 1);
+    while (Live[Index].Pointer != NULL)
+        Index = (Index + 1) & (PROFILE_LIVE - 1);
+
+    Live[Index] = (alloc_live_t) { .Pointer = Pointer, .Size = Size, .Site = SiteIndex };
+    LiveCount++;
+    Charge(SiteIndex, Size);
+}
+
+void AllocProfileRecord(void* Pointer, size_t Size, void* Caller) {
+    if (Pointer == NULL)
+        return;
+
+    size_t Flags = TicketLockIRQSave(&ProfileLock);
+    RecordLocked(Pointer, Size, Caller);
+    TicketUnlockIRQRestore(&ProfileLock, Flags);
+}
+
+void AllocProfileForget(void* Pointer) {
+    if (Pointer == NULL)
+        return;
+
+    size_t Flags = TicketLockIRQSave(&ProfileLock);
+
+    size_t Index = FindLive(Pointer);
+    if (Index != PROFILE_LIVE) {
+        Release(Live[Index].Site, Live[Index].Size);
+        RemoveLive(Index);
+    }
+
+    TicketUnlockIRQRestore(&ProfileLock, Flags);
+}
+
+/**
+ * Move an allocation, and the call that made it, to a different site.
+ * operator new uses this so that objects are charged to the new-expression rather than to operator new itself.
+ */
+void AllocProfileRetag(void* Pointer, void* Caller) {
+    if (Pointer == NULL)
+        return;
+
+    size_t Flags = TicketLockIRQSave(&ProfileLock);
+
+    size_t Index = FindLive(Pointer);
+    if (Index != PROFILE_LIVE) {
+        size_t Size = Live[Index].Size;
+        alloc_site_t* Old = &Sites[Live[Index].Site];
+
+        Release(Live[Index].Site, Size);
+        Old->Calls--;
+        Old->Bytes -= Size;
+        RemoveLive(Index);
+
+        RecordLocked(Pointer, Size, Caller);
+    }
+
+    TicketUnlockIRQRestore(&ProfileLock, Flags);
+}
+
+/**
+ * Print the PROFILE_REPORT call sites that have requested the most bytes, heaviest first.
+ * The table is copied out under the lock, so that printing doesn't hold up every allocation in the kernel.
+ */
+void AllocProfileDump() {
+    static alloc_site_t Snapshot[PROFILE_REPORT];
+    size_t Count = 0;
+
+    size_t Flags = TicketLockIRQSave(&ProfileLock);
+
+    for (size_t i = 0; i < PROFILE_SITES; i++) {
+        if (Sites[i].Caller == NULL)
+            continue;
+
+        // Insertion sort into the snapshot, discarding whatever falls off the end.
+        size_t Position = Count;
+        while (Position > 0 && Snapshot[Position - 1].Bytes < Sites[i].Bytes)
+            Position--;
+        if (Position >= PROFILE_REPORT)
+            continue;
+
+        size_t Last = Count < PROFILE_REPORT ? Count : PROFILE_REPORT - 1;
+        for (size_t j = Last; j > Position; j--)
+            Snapshot[j] = Snapshot[j - 1];
+        Snapshot[Position] = Sites[i];
+        if (Count < PROFILE_REPORT)
+            Count++;
+    }
+
+    size_t LiveBytes = TotalLiveBytes, PeakBytes = PeakLiveBytes, Callers = SiteCount, Lost = Dropped;
+
+    TicketUnlockIRQRestore(&ProfileLock, Flags);
+
+    SerialPrintf("[  Mem] Allocation profile: %d call sites, %d bytes live, %d bytes at peak, %d events dropped.\r\n",
+                 Callers, LiveBytes, PeakBytes, Lost);
+    for (size_t i = 0; i < Count; i++)
+        SerialPrintf("[  Mem] 0x%p: %d calls, %d bytes; %d live, %d bytes live, %d bytes at peak\r\n",
+                     (size_t) Snapshot[i].Caller, Snapshot[i].Calls, Snapshot[i].Bytes,
+                     Snapshot[i].LiveObjects, Snapshot[i].LiveBytes, Snapshot[i].PeakBytes);
+}
+
+#else
+
+void AllocProfileRecord(void* Pointer, size_t Size, void* Caller) {
+    UNUSED(Pointer); UNUSED(Size); UNUSED(Caller);
+}
+
+void AllocProfileForget(void* Pointer) {
+    UNUSED(Pointer);
+}
+
+void AllocProfileRetag(void* Pointer, void* Caller) {
+    UNUSED(Pointer); UNUSED(Caller);
+}
+
+void AllocProfileDump() {
+    SerialPrintf("[  Mem] Allocation profiling is not built in. Configure with -DCHROMA_ALLOC_PROFILE=ON.\r\n");
+}
+
+#endif
@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <kernel/system/memory.h>
+#include <kernel/system/trace.h>
 
 /**  Durand's Amazing Super Duper Memory functions.  */
 
@@ -16,7 +17,10 @@
 #define USE_CASE4
 #define USE_CASE5
 
-extern address_space_t KernelAddressSpace;
+/** The heap has its own lock, rather than borrowing the kernel address space's,
+ * so that heap traffic and page table updates don't serialise on each other. */
+static ticketlock_t l_heapLock;
+static size_t l_heapFlags;        ///< Interrupt state to restore on unlock. Only written by the lock holder.
 
 /** This function is supposed to lock the memory data structures. It
  * could be as simple as disabling interrupts or acquiring a spinlock.
@@ -26,7 +30,9 @@ extern address_space_t KernelAddressSpace;
  * failure.
  */
 static int liballoc_lock() {
-    return TicketAttemptLock(&KernelAddressSpace.Lock) ? 0 : 1;
+    size_t flags = TicketLockIRQSave(&l_heapLock);
+    l_heapFlags = flags;
+    return 0;
 }
 
 /** This function unlocks what was previously locked by the liballoc_lock
@@ -35,7 +41,7 @@ static int liballoc_lock() {
  *
  */
 static void liballoc_unlock() {
-    TicketUnlock(&KernelAddressSpace.Lock);
+    TicketUnlockIRQRestore(&l_heapLock, l_heapFlags);
 }
 
 /** This is the hook into the local system which allocates pages. It
@@ -274,7 +280,7 @@ static struct liballoc_major* allocate_new_page(unsigned int size) {
 }
 
 
-void* PREFIX(malloc)(size_t req_size) {
+static void* liballoc_malloc(size_t req_size) {
     int startedBet = 0;
     unsigned long long bestSize = 0;
     void* p = NULL;
@@ -301,7 +307,7 @@ void* PREFIX(malloc)(size_t req_size) {
         FLUSH();
         #endif
         liballoc_unlock();
-        return PREFIX(malloc)(1);
+        return liballoc_malloc(1);
     }
 
 
@@ -599,7 +605,7 @@ void* PREFIX(malloc)(size_t req_size) {
     return NULL;
 }
 
-void PREFIX(free)(void* ptr) {
+static void liballoc_release(void* ptr) {
     struct liballoc_minor* min;
     struct liballoc_major* maj;
 
@@ -713,33 +719,19 @@ void PREFIX(free)(void* ptr) {
     liballoc_unlock();        // release the lock
 }
 
-void* PREFIX(calloc)(size_t nobj, size_t size) {
-    int real_size;
-    void* p;
-
-    real_size = nobj * size;
-
-    p = PREFIX(malloc)(real_size);
-
-    liballoc_memset(p, 0, real_size);
-
-    return p;
-}
-
-
-void* PREFIX(realloc)(void* p, size_t size) {
+static void* liballoc_realloc(void* p, size_t size) {
     void* ptr;
     struct liballoc_minor* min;
     unsigned int real_size;
 
     // Honour the case of size == 0 => free old and return NULL
     if (size == 0) {
-        PREFIX(free)(p);
+        liballoc_release(p);
         return NULL;
     }
 
     // In the case of a NULL pointer, return a simple malloc.
-    if (p == NULL) return PREFIX(malloc)(size);
+    if (p == NULL) return liballoc_malloc(size);
 
     // Unalign the pointer if required.
     ptr = p;
@@ -803,17 +795,46 @@ void* PREFIX(realloc)(void* p, size_t size) {
     liballoc_unlock();
 
     // If we got here then we're reallocating to a block bigger than us.
-    ptr = PREFIX(malloc)(size);                    // We need to allocate new memory
+    ptr = liballoc_malloc(size);                    // We need to allocate new memory
     liballoc_memcpy(ptr, p, real_size);
-    PREFIX(free)(p);
+    liballoc_release(p);
 
     return ptr;
 }
 
-void operator delete(void* addr, unsigned long __attribute__((unused)) size) {
-    PREFIX(free)(addr);
+// The public entry points are thin wrappers, so that the allocation profiler sees the real call site.
+
+void* PREFIX(malloc)(size_t req_size) {
+    void* p = liballoc_malloc(req_size);
+    Trace(TRACE_ALLOC, (size_t) p, req_size);
+    ALLOC_PROFILE_ALLOC(p, req_size);
+    return p;
+}
+
+void PREFIX(free)(void* ptr) {
+    Trace(TRACE_FREE, (size_t) ptr, 0);
+    ALLOC_PROFILE_FREE(ptr);
+    liballoc_release(ptr);
+}
+
+void* PREFIX(calloc)(size_t nobj, size_t size) {
+    int real_size;
+    void* p;
+
+    real_size = nobj * size;
+
+    p = liballoc_malloc(real_size);
+
+    liballoc_memset(p, 0, real_size);
+
+    Trace(TRACE_ALLOC, (size_t) p, real_size);
+    ALLOC_PROFILE_ALLOC(p, real_size);
+    return p;
 }
 
-void operator delete(void* addr) {
-    PREFIX(free)(addr);
+void* PREFIX(realloc)(void* p, size_t size) {
+    void* ptr = liballoc_realloc(p, size);
+    Trace(TRACE_ALLOC, (size_t) ptr, size);
+    ALLOC_PROFILE_REALLOC(p, ptr, size);
+    return ptr;
 }
\ No newline at end of file
@@ -20,8 +20,210 @@
 // Default flags for a new page table. 7 = 1 | 2 | 4 = Present, writeable, accessible from userspace
 #define DEFAULT_PAGE_FLAGS 7
 
+// Set in a PDPT or PD entry, this maps a 1GiB or 2MiB page directly instead of pointing to another table.
+#define LARGE_PAGE_BIT (1 << 7)
+
+// Set in the entry that maps a page, this keeps it in the TLB across CR3 writes.
+// Only safe for the higher half, which is the same in every address space.
+#define GLOBAL_PAGE_BIT (1 << 8)
+
+#define LARGE_PAGE_SIZE (1ull << 21)
+#define HUGE_PAGE_SIZE  (1ull << 30)
+
 size_t KernelLocation;
 
+// Whether the processor can map 1GiB pages. 2MiB pages are always available in long mode.
+static bool HugePagesSupported = false;
+
+static struct {
+    size_t Tables;              // Page table pages allocated.
+    size_t Splits;              // Large pages broken up to make room for a smaller mapping.
+    size_t Pages[3];            // Mappings made with 4KiB, 2MiB and 1GiB pages.
+} PagingStats;
+
+static inline size_t* TableFromEntry(size_t Entry, bool Direct) {
+    size_t Table = Entry & STACK_TOP;
+    return (size_t*) (Direct ? TO_DIRECT(Table) : Table);
+}
+
+static size_t* NewTable(size_t* Entry, bool Direct) {
+    size_t Table = (size_t) PhysAllocateZeroMem(PAGE_SIZE);
+    PagingStats.Tables++;
+    *Entry = Table | DEFAULT_PAGE_FLAGS;
+    return (size_t*) (Direct ? TO_DIRECT(Table) : Table);
+}
+
+/**
+ * Replace a large page with a table of the next size down that maps exactly the same memory.
+ * The table is filled in before it is linked, so the memory never goes unmapped, even in a live address space.
+ */
+static size_t* SplitLargePage(size_t* Entry, size_t EntrySize, bool Direct) {
+    size_t Base = *Entry & STACK_TOP & ~(EntrySize - 1);
+    size_t Flags = *Entry & (PAGE_SIZE - 1) & ~LARGE_PAGE_BIT;
+    size_t ChildSize = EntrySize / 512;
+
+    size_t Table = (size_t) PhysAllocateZeroMem(PAGE_SIZE);
+    size_t* Children = (size_t*) (Direct ? TO_DIRECT(Table) : Table);
+    for (size_t i = 0; i < 512; i++)
+        Children[i] = (Base + i * ChildSize) | Flags | (ChildSize > PAGE_SIZE ? LARGE_PAGE_BIT : 0);
+
+    *Entry = Table | DEFAULT_PAGE_FLAGS;
+    PagingStats.Tables++;
+    PagingStats.Splits++;
+    return Children;
+}
+
+/**
+ * Walk the tables and map a single page of the given size, allocating intermediary tables as required.
+ * If a larger page is in the way, it is split, unless it already maps this address the same way.
+ * The caller must hold the address space's lock.
+ *
+ * @param Direct Whether the tables must be reached through the direct region, or are identity mapped.
+ * @param Leaf If not null, receives the table the entry was written into, or null if nothing was written.
+ * @return The entry that was overwritten.
+ */
+static size_t MapPageOfSize(address_space_t* AddressSpace, size_t Physical, size_t Virtual, size_t PageSize,
+                            size_t PageFlags, bool Direct, size_t** Leaf = nullptr) {
+    size_t* Table = AddressSpace->PML4;
+
+    if (Leaf != nullptr)
+        *Leaf = nullptr;
+
+    for (size_t Shift = 39;; Shift -= 9) {
+        size_t EntrySize = 1ull << Shift;
+        size_t* Entry = &Table[(Virtual >> Shift) & 0x1FF];
+
+        if (EntrySize == PageSize) {
+            size_t Old = *Entry;
+            *Entry = Physical | PageFlags | (PageSize > PAGE_SIZE ? LARGE_PAGE_BIT : 0);
+            PagingStats.Pages[PageSize == PAGE_SIZE ? 0 : PageSize == LARGE_PAGE_SIZE ? 1 : 2]++;
+            if (Leaf != nullptr)
+                *Leaf = Table;
+            return Old;
+        }
+
+        if (!(*Entry & PRESENT_BIT))
+            Table = NewTable(Entry, Direct);
+        else if (*Entry & LARGE_PAGE_BIT) {
+            size_t Base = *Entry & STACK_TOP & ~(EntrySize - 1);
+            size_t Flags = *Entry & (PAGE_SIZE - 1) & ~LARGE_PAGE_BIT;
+            // A global page satisfies a request for the same mapping without it.
+            if (Base + (Virtual & (EntrySize - 1)) == Physical && (Flags & ~GLOBAL_PAGE_BIT) == (PageFlags & ~GLOBAL_PAGE_BIT))
+                return 0;
+            Table = SplitLargePage(Entry, EntrySize, Direct);
+        } else
+            Table = TableFromEntry(*Entry, Direct);
+    }
+}
+
+/**
+ * Find the entry that maps a virtual address, of whatever size it is.
+ *
+ * @param EntrySize Receives the size of the page the entry maps.
+ * @return The entry, or null if the address is not mapped.
+ */
+static size_t* FindPageEntry(address_space_t* AddressSpace, size_t Virtual, bool Direct, size_t* EntrySize) {
+    size_t* Table = AddressSpace->PML4;
+
+    for (size_t Shift = 39;; Shift -= 9) {
+        size_t* Entry = &Table[(Virtual >> Shift) & 0x1FF];
+
+        if (!(*Entry & PRESENT_BIT))
+            return nullptr;
+
+        if (Shift == PAGE_SHIFT || (*Entry & LARGE_PAGE_BIT)) {
+            *EntrySize = 1ull << Shift;
+            return Entry;
+        }
+
+        Table = TableFromEntry(*Entry, Direct);
+    }
+}
+
+/**
+ * Queue the invalidation of a page whose entry was changed.
+ * One INVLPG is enough for a page that was mapped by a single entry; anything that used to be a whole table
+ *  of smaller entries forces the batch to a full flush.
+ */
+static void TLBBatchAdd(tlb_batch_t* Batch, size_t Virtual, size_t OldEntry, size_t PageSize) {
+    if (!(OldEntry & PRESENT_BIT))
+        return;
+
+    if (Virtual >= DIRECT_REGION)
+        Batch->Shared = true;
+
+    if (PageSize > PAGE_SIZE && !(OldEntry & LARGE_PAGE_BIT))
+        Batch->FlushAll = true;
+    else if (Batch->Count < TLB_BATCH_PAGES)
+        Batch->Pages[Batch->Count++] = Virtual;
+    else
+        Batch->FlushAll = true;
+}
+
+/**
+ * Map a physically contiguous range with the largest pages that the alignment of both addresses allows,
+ *  falling back to 4KiB pages at the unaligned edges.
+ * The tables are only walked from the top once per page table: consecutive 4KiB pages are written straight into it.
+ */
+static void MapRange(address_space_t* AddressSpace, size_t Physical, size_t Virtual, size_t Length,
+                     size_t PageFlags, bool Direct, tlb_batch_t* Batch) {
+    size_t Offset = Physical & (PAGE_SIZE - 1);
+    Physical -= Offset;
+    Virtual -= Offset;
+    Length = (Length + Offset + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    size_t* Table = nullptr;        // The last page table written to,
+    size_t TableBase = 0;           //  and the virtual address its first entry maps.
+
+    size_t Flags = TicketLockIRQSave(&AddressSpace->Lock);
+
+    while (Length != 0) {
+        size_t Alignment = Physical | Virtual;
+        size_t Size = PAGE_SIZE;
+        size_t Old;
+
+        if (HugePagesSupported && (Alignment & (HUGE_PAGE_SIZE - 1)) == 0 && Length >= HUGE_PAGE_SIZE)
+            Size = HUGE_PAGE_SIZE;
+        else if ((Alignment & (LARGE_PAGE_SIZE - 1)) == 0 && Length >= LARGE_PAGE_SIZE)
+            Size = LARGE_PAGE_SIZE;
+
+        if (Size == PAGE_SIZE && Table != nullptr && (Virtual & ~(LARGE_PAGE_SIZE - 1)) == TableBase) {
+            size_t* Entry = &Table[(Virtual >> PAGE_SHIFT) & 0x1FF];
+            Old = *Entry;
+            *Entry = Physical | PageFlags;
+            PagingStats.Pages[0]++;
+        } else if (Size == PAGE_SIZE) {
+            Old = MapPageOfSize(AddressSpace, Physical, Virtual, Size, PageFlags, Direct, &Table);
+            TableBase = Virtual & ~(LARGE_PAGE_SIZE - 1);
+        } else
+            Old = MapPageOfSize(AddressSpace, Physical, Virtual, Size, PageFlags, Direct);
+
+        if (Batch != nullptr)
+            TLBBatchAdd(Batch, Virtual, Old, Size);
+
+        Physical += Size;
+        Virtual += Size;
+        Length -= Size;
+    }
+
+    TicketUnlockIRQRestore(&AddressSpace->Lock, Flags);
+}
+
+/**
+ * Map a range during boot, before the Direct region exists.
+ * The address space isn't loaded yet, so there is nothing to invalidate.
+ */
+static void MapLargeRangeNoDirect(address_space_t* AddressSpace, size_t Physical, size_t Virtual, size_t Length,
+                                  size_t PageFlags) {
+    MapRange(AddressSpace, Physical, Virtual, Length, PageFlags, false, nullptr);
+}
+
+static bool CheckHugePages() {
+    uint32_t Eax = 0x80000001, Ebx, Ecx = 0, Edx;
+    __asm__ __volatile__("cpuid" : "+a"(Eax), "=b"(Ebx), "+c"(Ecx), "=d"(Edx));
+    return Edx & (1 << 26);
+}
+
 /**
  * Bootstrap the paging process.
  * Seeds the page tables, maps the kernel and framebuffer, etc.
@@ -30,13 +232,15 @@ size_t KernelLocation;
 void InitPaging() {
 
     KernelAddressSpace = (address_space_t) {
-            .Lock = {.NowServing = 0, .NextTicket = 0},
-            .PML4 = (size_t*) PhysAllocateZeroMem(4096)
+            .Lock = NEW_TICKETLOCK(),
+            .PML4 = (size_t*) PhysAllocateZeroMem(4096),
+            .ActiveCores = 0
     };
 
     address_space_t BootloaderAddressSpace = (address_space_t) {
-            .Lock = {.NowServing = 0, .NextTicket = 0},
-            .PML4 = (size_t*) ReadControlRegister(3)
+            .Lock = NEW_TICKETLOCK(),
+            .PML4 = (size_t*) ReadControlRegister(3),
+            .ActiveCores = 0
     };
 
     size_t AddressToFind = KernelAddr + 0x2000;
@@ -45,23 +249,22 @@ void InitPaging() {
     SerialPrintf("[  Mem] Double check: Kernel physically starts at 0x%p (0x%p), ends at 0x%p.\r\n", KernelLocation,
                  AddressToFind, KERNEL_END);
 
+    HugePagesSupported = CheckHugePages();
+    SerialPrintf("[  Mem] Mapping with 2MiB%s pages where possible.\r\n", HugePagesSupported ? " and 1GiB" : "");
+
     SerialPrintf("[  Mem] Identity mapping the entire 0x%p bytes of physical memory to 0x%p\r\n", FullMemorySize,
                  (size_t) KernelAddressSpace.PML4);
 
-    for (size_t i = 0; i < (FullMemorySize / 4096); i++) {
-        size_t Addr = i * 4096;
-        MapVirtualPageNoDirect(&KernelAddressSpace, Addr, Addr, DEFAULT_PAGE_FLAGS);
-        MapVirtualPageNoDirect(&KernelAddressSpace, Addr, TO_DIRECT(Addr), DEFAULT_PAGE_FLAGS);
-    }
+    MapLargeRangeNoDirect(&KernelAddressSpace, 0, 0, FullMemorySize, DEFAULT_PAGE_FLAGS);
+    MapLargeRangeNoDirect(&KernelAddressSpace, 0, TO_DIRECT(0), FullMemorySize, DEFAULT_PAGE_FLAGS | GLOBAL_PAGE_BIT);
 
     SerialPrintf("[  Mem] Identity mapping the entire BIOS memory map.\r\n");
     for (MMapEnt* MapEntry = &bootldr.mmap; (size_t) MapEntry < (size_t) &bootldr + bootldr.size; MapEntry++) {
         size_t entry_from = MMapEnt_Ptr(MapEntry);
-        size_t entry_to = MMapEnt_Ptr(MapEntry) + MMapEnt_Size(MapEntry);
-        for (size_t i = entry_from; i < entry_to; i += PAGE_SIZE) {
-            MapVirtualPageNoDirect(&KernelAddressSpace, i, i, DEFAULT_PAGE_FLAGS);
-            MapVirtualPageNoDirect(&KernelAddressSpace, i, TO_DIRECT(i), DEFAULT_PAGE_FLAGS);
-        }
+        size_t entry_size = MMapEnt_Size(MapEntry);
+        MapLargeRangeNoDirect(&KernelAddressSpace, entry_from, entry_from, entry_size, DEFAULT_PAGE_FLAGS);
+        MapLargeRangeNoDirect(&KernelAddressSpace, entry_from, TO_DIRECT(entry_from), entry_size,
+                              DEFAULT_PAGE_FLAGS | GLOBAL_PAGE_BIT);
     }
 
     SerialPrintf("[  Mem] Identity mapping core system hardware.\r\n");
@@ -70,26 +273,25 @@ void InitPaging() {
     SerialPrintf("[  Mem] Mapping 0x%x bytes of bootloader structure, starting at 0x%p\r\n", bootldr.size,
                  BootldrAddress);
     for (size_t i = BootldrAddress; i < (BootldrAddress + bootldr.size); i += PAGE_SIZE)
-        MapVirtualPageNoDirect(&KernelAddressSpace, i, KERNEL_REGION + (i - BootldrAddress), 0x3);
+        MapVirtualPageNoDirect(&KernelAddressSpace, i, KERNEL_REGION + (i - BootldrAddress), 0x3 | GLOBAL_PAGE_BIT);
 
     // This allows the code to actually run
     SerialPrintf("[  Mem] Mapping 0x%x bytes of kernel, starting at 0x%p\r\n", KERNEL_END - KERNEL_PHYSICAL,
                  KERNEL_PHYSICAL);
     for (size_t i = KERNEL_PHYSICAL; i < KERNEL_END; i += PAGE_SIZE)
-        MapVirtualPageNoDirect(&KernelAddressSpace, i, (i - KERNEL_PHYSICAL) + KERNEL_REGION + KERNEL_TEXT, 0x3);
+        MapVirtualPageNoDirect(&KernelAddressSpace, i, (i - KERNEL_PHYSICAL) + KERNEL_REGION + KERNEL_TEXT,
+                               0x3 | GLOBAL_PAGE_BIT);
 
     // TODO: The above mapping loses the ELF header.
 
     // This allows us to write to the screen
     SerialPrintf("[  Mem] Mapping 0x%x bytes of framebuffer, starting at 0x%p\r\n", bootldr.fb_size, FB_PHYSICAL);
-    for (size_t i = FB_PHYSICAL; i < bootldr.fb_size + FB_PHYSICAL; i += PAGE_SIZE) {
-        MapVirtualPageNoDirect(&KernelAddressSpace, i, i, 0x3); // FD000000 + (page)
-        MapVirtualPageNoDirect(&KernelAddressSpace, i, (i - FB_PHYSICAL) + FB_REGION, 0x3); // FFFFFFFFFC000000 + (page)
-    }
+    MapLargeRangeNoDirect(&KernelAddressSpace, FB_PHYSICAL, FB_PHYSICAL, bootldr.fb_size, 0x3); // FD000000 + (page)
+    MapLargeRangeNoDirect(&KernelAddressSpace, FB_PHYSICAL, FB_REGION, bootldr.fb_size, 0x3 | GLOBAL_PAGE_BIT); // FFFFFFFFFC000000 + (page)
 
     // This allows us to call functions
     SerialPrintf("[  Mem] Mapping stack\r\n");
-    MapVirtualPageNoDirect(&KernelAddressSpace, CORE_STACK_PHYSICAL, STACK_TOP, 0x3);
+    MapVirtualPageNoDirect(&KernelAddressSpace, CORE_STACK_PHYSICAL, STACK_TOP, 0x3 | GLOBAL_PAGE_BIT);
 
     // Make sure everything is sane
     SerialPrintf("[  Mem] Diagnostic: Querying existing page tables\r\n");
@@ -102,9 +304,18 @@ void InitPaging() {
     SerialPrintf("[  Mem] %s\r\n", KernelAddress == KERNEL_PHYSICAL ? "These match. Continuing."
                                                                     : "These do not match. Continuing with caution..");
 
+    size_t Equivalent = PagingStats.Pages[0] + PagingStats.Pages[1] * 512 + PagingStats.Pages[2] * 512 * 512;
+    SerialPrintf("[  Mem] Mapped %u 1GiB, %u 2MiB and %u 4KiB pages with %u page tables (%u KiB), splitting %u.\r\n",
+                 PagingStats.Pages[2], PagingStats.Pages[1], PagingStats.Pages[0], PagingStats.Tables,
+                 PagingStats.Tables * (PAGE_SIZE / 1024), PagingStats.Splits);
+    SerialPrintf("[  Mem] Mapping the same memory with 4KiB pages would take at least %u page tables (%u KiB).\r\n",
+                 Equivalent / 512, Equivalent / 512 * (PAGE_SIZE / 1024));
+
     SerialPrintf("[  Mem] Attempting to jump into our new pagetables: 0x%p\r\n", (size_t) KernelAddressSpace.PML4);
     WriteControlRegister(3, (size_t) KernelAddressSpace.PML4 & STACK_TOP);
     SerialPrintf("[  Mem] Worked\r\n");
+
+    TLBCoreOnline(&KernelAddressSpace);
 }
 
 
@@ -150,15 +361,18 @@ size_t DecodeVirtualAddress(address_space_t* AddressSpace, size_t VirtualAddress
     else
         return VirtualAddress;
 
-    if (PDPT_T[PDP] & PRESENT_BIT)
-        PDE_T = (size_t*) TO_DIRECT(PDPT_T[PDP] & STACK_TOP);
-    else
+    if (!(PDPT_T[PDP] & PRESENT_BIT))
         return VirtualAddress;
+    // A 1GiB page ends the walk early.
+    if (PDPT_T[PDP] & LARGE_PAGE_BIT)
+        return ((PDPT_T[PDP] & STACK_TOP & ~(HUGE_PAGE_SIZE - 1)) + (VirtualAddress & (HUGE_PAGE_SIZE - 1))) & STACK_TOP;
+    PDE_T = (size_t*) TO_DIRECT(PDPT_T[PDP] & STACK_TOP);
 
-    if (PDE_T[PDE] & PRESENT_BIT)
-        PT_T = (size_t*) TO_DIRECT(PDE_T[PDE] & STACK_TOP);
-    else
+    if (!(PDE_T[PDE] & PRESENT_BIT))
         return VirtualAddress;
+    if (PDE_T[PDE] & LARGE_PAGE_BIT)
+        return ((PDE_T[PDE] & STACK_TOP & ~(LARGE_PAGE_SIZE - 1)) + (VirtualAddress & (LARGE_PAGE_SIZE - 1))) & STACK_TOP;
+    PT_T = (size_t*) TO_DIRECT(PDE_T[PDE] & STACK_TOP);
 
     return PT_T[PT] & STACK_TOP;
 }
@@ -174,40 +388,9 @@ size_t DecodeVirtualAddress(address_space_t* AddressSpace, size_t VirtualAddress
  * @param PageFlags Wanted flags for the final page.
  */
 void MapVirtualPage(address_space_t* AddressSpace, size_t Physical, size_t Virtual, size_t PageFlags) {
-    size_t PDPT = PAGE_TABLES_GET_PDPT(Virtual);
-    size_t PDP = PAGE_TABLES_GET_PDP(Virtual);
-    size_t PDE = PAGE_TABLES_GET_PDE(Virtual);
-    size_t PT = PAGE_TABLES_GET_PT(Virtual);
-    size_t* PDPT_T, * PDE_T, * PT_T;
-
-    // Read the top level's bits. If it's marked as present..
-    if (AddressSpace->PML4[PDPT] & PRESENT_BIT)
-        // Set the variable for the next level. Mask off the lower 12 bits, shift it into the "direct region".
-        PDPT_T = (size_t*) TO_DIRECT(AddressSpace->PML4[PDPT] & STACK_TOP);
-    else {
-        // Otherwise, allocate a new page in the direct region.
-        PDPT_T = (size_t*) TO_DIRECT(PhysAllocateZeroMem(4096));
-        // Pull it down from the direct region, and save it as the level's page for future reads of this block.
-        AddressSpace->PML4[PDPT] = FROM_DIRECT(PDPT_T) | DEFAULT_PAGE_FLAGS;
-    }
-
-    // The above repeats.
-    if (PDPT_T[PDP] & PRESENT_BIT)
-        PDE_T = (size_t*) TO_DIRECT(PDPT_T[PDP] & STACK_TOP);
-    else {
-        PDE_T = (size_t*) TO_DIRECT(PhysAllocateZeroMem(4096));
-        PDPT_T[PDP] = FROM_DIRECT(PDE_T) | DEFAULT_PAGE_FLAGS;
-    }
-
-    if (PDE_T[PDE] & PRESENT_BIT)
-        PT_T = (size_t*) TO_DIRECT(PDE_T[PDE] & STACK_TOP);
-    else {
-        PT_T = (size_t*) TO_DIRECT(PhysAllocateZeroMem(4096));
-        PDE_T[PDE] = FROM_DIRECT(PT_T) | DEFAULT_PAGE_FLAGS;
-    }
-
-    // Finally, set the last page table content to the physical page + the flags we specified.
-    PT_T[PT] = (size_t) (Physical | PageFlags);
+    size_t Flags = TicketLockIRQSave(&AddressSpace->Lock);
+    MapPageOfSize(AddressSpace, Physical, Virtual, PAGE_SIZE, PageFlags, true);
+    TicketUnlockIRQRestore(&AddressSpace->Lock, Flags);
 }
 
 /**
@@ -239,15 +422,18 @@ size_t DecodeVirtualAddressNoDirect(address_space_t* AddressSpace, size_t Virtua
     else
         return VirtualAddress;
 
-    if (PDPT_T[PDP] & PRESENT_BIT)
-        PDE_T = (size_t*) (PDPT_T[PDP] & STACK_TOP);
-    else
+    if (!(PDPT_T[PDP] & PRESENT_BIT))
         return VirtualAddress;
+    // A 1GiB page ends the walk early.
+    if (PDPT_T[PDP] & LARGE_PAGE_BIT)
+        return ((PDPT_T[PDP] & STACK_TOP & ~(HUGE_PAGE_SIZE - 1)) + (VirtualAddress & (HUGE_PAGE_SIZE - 1))) & STACK_TOP;
+    PDE_T = (size_t*) (PDPT_T[PDP] & STACK_TOP);
 
-    if (PDE_T[PDE] & PRESENT_BIT)
-        PT_T = (size_t*) (PDE_T[PDE] & STACK_TOP);
-    else
+    if (!(PDE_T[PDE] & PRESENT_BIT))
         return VirtualAddress;
+    if (PDE_T[PDE] & LARGE_PAGE_BIT)
+        return ((PDE_T[PDE] & STACK_TOP & ~(LARGE_PAGE_SIZE - 1)) + (VirtualAddress & (LARGE_PAGE_SIZE - 1))) & STACK_TOP;
+    PT_T = (size_t*) (PDE_T[PDE] & STACK_TOP);
 
     return PT_T[PT] & STACK_TOP;
 }
@@ -266,43 +452,9 @@ size_t DecodeVirtualAddressNoDirect(address_space_t* AddressSpace, size_t Virtua
  * @param PageFlags Wanted flags for the final page.
  */
 void MapVirtualPageNoDirect(address_space_t* AddressSpace, size_t Physical, size_t Virtual, size_t PageFlags) {
-    size_t PDPT = PAGE_TABLES_GET_PDPT(Virtual);
-    size_t PDP = PAGE_TABLES_GET_PDP(Virtual);
-    size_t PDE = PAGE_TABLES_GET_PDE(Virtual);
-    size_t PT = PAGE_TABLES_GET_PT(Virtual);
-    size_t* PDPT_T, * PDE_T, * PT_T;
-
-    // Read the top level's bits. If it's marked as present..
-    if (AddressSpace->PML4[PDPT] & PRESENT_BIT)
-        // Set the variable for the next level. Mask off the lower 12 bits, shift it into the "direct region".
-        PDPT_T = (size_t*) (AddressSpace->PML4[PDPT] & STACK_TOP);
-    else {
-        // Otherwise, allocate a new page in the direct region.
-        PDPT_T = (size_t*) PhysAllocateZeroMem(4096);
-        // Pull it down from the direct region, and save it as the level's page for future reads of this block.
-        AddressSpace->PML4[PDPT] = (size_t) PDPT_T | DEFAULT_PAGE_FLAGS;
-    }
-
-
-    // The above repeats.
-    if (PDPT_T[PDP] & PRESENT_BIT)
-        PDE_T = (size_t*) (PDPT_T[PDP] & STACK_TOP);
-    else {
-        PDE_T = (size_t*) PhysAllocateZeroMem(4096);
-        PDPT_T[PDP] = (size_t) PDE_T | DEFAULT_PAGE_FLAGS;
-    }
-
-
-    if (PDE_T[PDE] & PRESENT_BIT)
-        PT_T = (size_t*) (PDE_T[PDE] & STACK_TOP);
-    else {
-        PT_T = (size_t*) PhysAllocateZeroMem(4096);
-        PDE_T[PDE] = (size_t) PT_T | DEFAULT_PAGE_FLAGS;
-    }
-
-    // Finally, set the last page table content to the physical page + the flags we specified.]
-    *(PT_T + PT) = (size_t) (Physical | PageFlags);
-
+    size_t Flags = TicketLockIRQSave(&AddressSpace->Lock);
+    MapPageOfSize(AddressSpace, Physical, Virtual, PAGE_SIZE, PageFlags, false);
+    TicketUnlockIRQRestore(&AddressSpace->Lock, Flags);
 }
 
 /**
@@ -318,8 +470,9 @@ size_t* CreateNewPageTable(address_space_t* AddressSpace) {
     // Allocate the first page
     size_t* NewPML4 = (size_t*) TO_DIRECT(PhysAllocateZeroMem(4096));
     address_space_t TempAddressSpace = (address_space_t) {
-            .Lock = {.NowServing = 0, .NextTicket = 0},
-            .PML4 = NewPML4
+            .Lock = NEW_TICKETLOCK(),
+            .PML4 = NewPML4,
+            .ActiveCores = 0
     };
 
     // Initialize to zeros
@@ -349,10 +502,113 @@ size_t* CreateNewPageTable(address_space_t* AddressSpace) {
     return NewPML4;
 }
 
+/**
+ * Map a physically contiguous range of memory, using large pages wherever the alignment allows.
+ *
+ * Any pages that were already mapped are added to Batch, to be invalidated by a later FlushTLBBatch.
+ * That way, several map and unmap operations on the same address space can share one shootdown.
+ * If Batch is null, the TLB is flushed before this returns.
+ *
+ * @param Physical The start of the physical range
+ * @param Virtual The address to map it to
+ * @param Length The size of the range, in bytes. It is rounded up to whole pages.
+ * @param PageFlags Wanted flags for every page in the range.
+ */
+void MapVirtualRange(address_space_t* AddressSpace, size_t Physical, size_t Virtual, size_t Length, size_t PageFlags,
+                     tlb_batch_t* Batch) {
+    tlb_batch_t Local = { };
+    MapRange(AddressSpace, Physical, Virtual, Length, PageFlags, true, Batch ? Batch : &Local);
+
+    if (Batch == nullptr)
+        FlushTLBBatch(AddressSpace, &Local);
+}
+
+/**
+ * Remove the mappings for a range of virtual memory.
+ * Large pages that lie entirely inside the range are removed whole; ones that straddle an edge are split first.
+ * The page tables themselves, and the physical memory that was mapped, are left alone.
+ *
+ * As with MapVirtualRange, invalidations go into Batch, or are flushed immediately if it is null.
+ */
+void UnmapVirtualRange(address_space_t* AddressSpace, size_t Virtual, size_t Length, tlb_batch_t* Batch) {
+    tlb_batch_t Local = { };
+    tlb_batch_t* Pending = Batch ? Batch : &Local;
+
+    size_t Offset = Virtual & (PAGE_SIZE - 1);
+    Virtual -= Offset;
+    Length = (Length + Offset + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    size_t* Table = nullptr;
+    size_t TableBase = 0;
+
+    size_t Flags = TicketLockIRQSave(&AddressSpace->Lock);
+
+    while (Length != 0) {
+        size_t* Entry;
+        size_t Size = PAGE_SIZE;
+
+        if (Table != nullptr && (Virtual & ~(LARGE_PAGE_SIZE - 1)) == TableBase)
+            Entry = &Table[(Virtual >> PAGE_SHIFT) & 0x1FF];
+        else {
+            Entry = FindPageEntry(AddressSpace, Virtual, true, &Size);
+            Table = nullptr;
+
+            if (Entry == nullptr) {
+                // Nothing here; skip to the next page.
+                Virtual += PAGE_SIZE;
+                Length -= PAGE_SIZE;
+                continue;
+            }
+
+            if (Size > PAGE_SIZE && ((Virtual & (Size - 1)) != 0 || Length < Size)) {
+                // Only part of this large page is going away.
+                SplitLargePage(Entry, Size, true);
+                continue;
+            }
+
+            if (Size == PAGE_SIZE) {
+                Table = Entry - ((Virtual >> PAGE_SHIFT) & 0x1FF);
+                TableBase = Virtual & ~(LARGE_PAGE_SIZE - 1);
+            }
+        }
+
+        TLBBatchAdd(Pending, Virtual, *Entry, Size);
+        *Entry = 0;
+
+        Virtual += Size;
+        Length -= Size;
+    }
+
+    TicketUnlockIRQRestore(&AddressSpace->Lock, Flags);
+
+    if (Batch == nullptr)
+        FlushTLBBatch(AddressSpace, &Local);
+}
+
 void *operator new(size_t size) {
-    return kmalloc(size);
+    void* Pointer = kmalloc(size);
+    ALLOC_PROFILE_RETAG(Pointer);
+    return Pointer;
 }
 
 void *operator new[](size_t size) {
-    return kmalloc(size);
+    void* Pointer = kmalloc(size);
+    ALLOC_PROFILE_RETAG(Pointer);
+    return Pointer;
+}
+
+void operator delete(void* addr, unsigned long __attribute__((unused)) size) {
+    kfree(addr);
+}
+
+void operator delete(void* addr) {
+    kfree(addr);
+}
+
+void operator delete[](void* addr, unsigned long __attribute__((unused)) size) {
+    kfree(addr);
+}
+
+void operator delete[](void* addr) {
+    kfree(addr);
 }
\ No newline at end of file
@@ -14,14 +14,19 @@
  * The implementation here is bespoke, and in need of documentation.
  * 
  * TODO: Document this mess.
+ *
+ * Single 4KiB frames - the bulk of all requests, since every new page table and mapped page wants one - don't
+ *  go through the buddy lists directly. Each core keeps a small cache ("magazine") of free frames, which it can
+ *  hand out and take back with nothing more than interrupts masked.
+ * Only when a cache runs dry, or fills up, does it touch the buddy lock, and then it moves a whole batch of frames at once.
  */
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define MIN_ORDER 3
-#define PEEK(type, address) (*((volatile type*)(address)))
+// Physical memory is only ever handed out in whole pages, so that's the smallest block the buddies track.
+#define MIN_ORDER PAGE_SHIFT
 
 uint8_t* MemoryStart;
 size_t MemoryBuckets;
@@ -32,8 +37,10 @@ size_t FullMemorySize = 0;
 
 static buddy_t LowBuddy = {
         .MaxOrder = 32,
-        .Base = (directptr_t) DIRECT_REGION,
+        .Base = 0,
         .List = (directptr_t[32 - MIN_ORDER]) {0},
+        .Length = 0,
+        .FreeMap = (uint8_t*[32 - MIN_ORDER]) {0},
         .Lock = {.NowServing = 0, .NextTicket = 0},
 };
 
@@ -41,72 +48,148 @@ static buddy_t HighBuddy = {
         .MaxOrder = 64,
         .Base = 0,
         .List = (directptr_t[64 - MIN_ORDER]) {0},
+        .Length = 0,
+        .FreeMap = (uint8_t*[64 - MIN_ORDER]) {0},
         .Lock = {.NowServing = 0, .NextTicket = 0},
 };
 
 static size_t MemoryLength;
 
-static bool CheckBuddies(buddy_t* Buddy, directptr_t InputA, directptr_t InputB, size_t Size) {
-    size_t LowerBuddy = MIN(CAST(size_t, InputA), CAST(size_t, InputB)) - (size_t) Buddy->Base;
-    size_t HigherBuddy = MAX(CAST(size_t, InputA), CAST(size_t, InputB)) - (size_t) Buddy->Base;
+// The physical range that holds the buddy free maps. It must never be handed out.
+static size_t FreeMapStart;
+static size_t FreeMapEnd;
+
+// Matches Constants::Core::MAX_CORES. Cores above this just skip the cache.
+#define FRAME_CACHE_CORES 12
+// How many frames a single core may hold on to.
+#define FRAME_CACHE_SIZE  64
+// How many frames move between a cache and the buddy lists at once.
+#define FRAME_CACHE_BATCH 32
+
+typedef struct {
+    size_t Count;
+    directptr_t Frames[FRAME_CACHE_SIZE];
+    frame_cache_stats_t Stats;
+} __attribute__((aligned(64))) frame_cache_t;
+
+static frame_cache_t FrameCaches[FRAME_CACHE_CORES];
 
-    return (LowerBuddy ^ Size) == HigherBuddy;
+/*
+ * Every free block starts with links to its neighbours on the free list of its order,
+ *  so any block can be unlinked without walking the list.
+ *
+ * Alongside the lists, each order has a bitmap with one bit per block, which is set while that block is on a free list.
+ * Since blocks are always aligned to their size (relative to the buddy's Base), the buddy of block N is just block N ^ 1,
+ *  so whether it can be merged is a single bit test.
+ */
+typedef struct free_block {
+    struct free_block* Next;
+    struct free_block* Previous;
+} free_block_t;
+
+static size_t BlockIndex(buddy_t* Buddy, directptr_t Address, size_t Order) {
+    return ((size_t) Address - (size_t) Buddy->Base) >> Order;
 }
 
-static void AddToBuddyList(buddy_t* Buddy, directptr_t Address, size_t Order, bool NewEntry) {
-    directptr_t ListHead = Buddy->List[Order - MIN_ORDER];
+static directptr_t BlockAddress(buddy_t* Buddy, size_t Index, size_t Order) {
+    return (directptr_t) ((size_t) Buddy->Base + (Index << Order));
+}
 
-    //SerialPrintf("Adding new entry to buddy: Address 0x%p with order %d, New Entry is %s\r\n", Address, Order, NewEntry ? "true" : "false");
+static bool BlockIsFree(buddy_t* Buddy, size_t Index, size_t Order) {
+    if (Index >= (Buddy->Length >> Order))
+        return false;
 
-    size_t Size = 1ull << Order;
+    uint8_t* Map = Buddy->FreeMap[Order - MIN_ORDER];
+    return (Map[Index / 8] >> (Index % 8)) & 1;
+}
 
-    TicketAttemptLock(&Buddy->Lock);
+static void SetBlockFree(buddy_t* Buddy, size_t Index, size_t Order, bool Free) {
+    uint8_t* Map = Buddy->FreeMap[Order - MIN_ORDER];
 
-    if (!NewEntry && ListHead != 0) {
-        directptr_t ListPrevious = 0;
+    if (Free)
+        Map[Index / 8] |= (1 << (Index % 8));
+    else
+        Map[Index / 8] &= ~(1 << (Index % 8));
+}
 
-        while (true) {
-            if (CheckBuddies(Buddy, ListHead, Address, Size)) {
-                if (ListPrevious != 0) {
-                    PEEK(directptr_t, ListPrevious) = PEEK(directptr_t, ListHead);
-                } else
-                    Buddy->List[Order - MIN_ORDER] = PEEK(directptr_t, ListHead);
+static void PushFreeBlock(buddy_t* Buddy, directptr_t Address, size_t Order) {
+    free_block_t* Block = (free_block_t*) Address;
+    free_block_t* Head = (free_block_t*) Buddy->List[Order - MIN_ORDER];
 
-                AddToBuddyList(Buddy, MIN(ListHead, Address), Order + 1, false);
-                break;
-            }
+    Block->Next = Head;
+    Block->Previous = NULL;
+    if (Head != NULL)
+        Head->Previous = Block;
 
-            if (PEEK(directptr_t, ListHead) == 0) {
-                PEEK(directptr_t, ListHead) = Address;
-                break;
-            }
+    Buddy->List[Order - MIN_ORDER] = Block;
+    SetBlockFree(Buddy, BlockIndex(Buddy, Address, Order), Order, true);
+}
 
-            ListPrevious = ListHead;
-            ListHead = PEEK(directptr_t, ListHead);
-        }
-    } else {
-        *((size_t*) (Address)) = (size_t) ListHead;
-        Buddy->List[Order - MIN_ORDER] = Address;
+static void UnlinkFreeBlock(buddy_t* Buddy, directptr_t Address, size_t Order) {
+    free_block_t* Block = (free_block_t*) Address;
+
+    if (Block->Previous != NULL)
+        Block->Previous->Next = Block->Next;
+    else
+        Buddy->List[Order - MIN_ORDER] = Block->Next;
+
+    if (Block->Next != NULL)
+        Block->Next->Previous = Block->Previous;
+
+    SetBlockFree(Buddy, BlockIndex(Buddy, Address, Order), Order, false);
+}
+
+/**
+ * Return a block to the buddy, merging it with its buddy for as long as the buddy is also free.
+ * Each merge is constant time, so a free costs at most one step per order.
+ */
+static void AddToBuddyList(buddy_t* Buddy, directptr_t Address, size_t Order) {
+    //SerialPrintf("Adding new entry to buddy: Address 0x%p with order %d\r\n", Address, Order);
+
+    size_t Flags = TicketLockIRQSave(&Buddy->Lock);
+
+    if (BlockIsFree(Buddy, BlockIndex(Buddy, Address, Order), Order)) {
+        TicketUnlockIRQRestore(&Buddy->Lock, Flags);
+        SerialPrintf("[  Mem] Attempted to free block 0x%p of order %d twice!\r\n", Address, Order);
+        return;
     }
 
-    TicketUnlock(&Buddy->Lock);
+    while (Order < (size_t) Buddy->MaxOrder - 1) {
+        size_t PartnerIndex = BlockIndex(Buddy, Address, Order) ^ 1;
+
+        if (!BlockIsFree(Buddy, PartnerIndex, Order))
+            break;
+
+        directptr_t Partner = BlockAddress(Buddy, PartnerIndex, Order);
+        UnlinkFreeBlock(Buddy, Partner, Order);
+
+        Address = MIN(Address, Partner);
+        Order++;
+    }
+
+    PushFreeBlock(Buddy, Address, Order);
+
+    TicketUnlockIRQRestore(&Buddy->Lock, Flags);
 }
 
+/**
+ * Split a range into the largest blocks that are both aligned and fit, and add them to the buddy.
+ */
 static void AddRangeToBuddy(buddy_t* Buddy, directptr_t Base, size_t Size) {
-    while (Size > (1ull << MIN_ORDER)) {
-        //SerialPrintf("New iteration. Current Size: 0x%x\r\n\t", Size);
-        for (int Order = Buddy->MaxOrder - 1; Order >= MIN_ORDER; Order--) {
-            //SerialPrintf("New Loop. Current Order: %d\r\n\t", Order);
-            if (Size >= (1ull << Order)) {
-                //SerialPrintf("\tNew loop check passed.\r\n\t");
-                AddToBuddyList(Buddy, Base, Order, true);
-                //SerialPrintf("\tEntry added to current buddy. Moving onto memory operations..\r\n\t");
-                Base = (void*) ((((char*) Base) + (1ull << Order)));
-                Size -= 1ull << Order;
-                //SerialPrintf("\tMemory operations complete. Moving onto next iteration.\r\n");
-                break;
-            }
-        }
+    ASSERT((size_t) Base >= (size_t) Buddy->Base && (size_t) Base + Size <= (size_t) Buddy->Base + Buddy->Length,
+           "AddRangeToBuddy: Range is not covered by the buddy's free maps!");
+
+    while (Size >= (1ull << MIN_ORDER)) {
+        size_t Offset = (size_t) Base - (size_t) Buddy->Base;
+        int Order = MIN_ORDER;
+
+        while (Order + 1 < Buddy->MaxOrder && (Offset & ((1ull << (Order + 1)) - 1)) == 0 &&
+               Size >= (1ull << (Order + 1)))
+            Order++;
+
+        AddToBuddyList(Buddy, Base, Order);
+        Base = (void*) ((((char*) Base) + (1ull << Order)));
+        Size -= 1ull << Order;
     }
 }
 
@@ -123,35 +206,240 @@ static directptr_t BuddyAllocate(buddy_t* Buddy, size_t Size) {
         return NULL;
     }
 
-    TicketAttemptLock(&Buddy->Lock);
-
-    //SerialPrintf("Searching for a valid order to allocate into. Condition: {\r\n\tOrder: %d,\r\n\tSize: 0x%x\r\n}\r\n\n", InitialOrder, WantedSize);
+    size_t Flags = TicketLockIRQSave(&Buddy->Lock);
 
     for (int Order = InitialOrder; Order < Buddy->MaxOrder; Order++) {
-        //SerialPrintf("\tCurrent Order: %d, Buddy entry: %x\r\n", Order, Buddy->List[Order - MIN_ORDER]);
         if (Buddy->List[Order - MIN_ORDER] != 0) {
-            //SerialPrintf("\tFound a valid Order!\r\n");
             directptr_t Address = Buddy->List[Order - MIN_ORDER];
-            Buddy->List[Order - MIN_ORDER] = PEEK(directptr_t, Address);
-            TicketUnlock(&Buddy->Lock);
-
-            size_t FoundSize = 1ull << Order;
+            UnlinkFreeBlock(Buddy, Address, Order);
 
-            //SerialPrintf("\tAdding area - Address 0x%p, Size 0x%x\r\n\n", Address, FoundSize);
-
-            AddRangeToBuddy(Buddy, (void*) ((size_t) Address + WantedSize), FoundSize - WantedSize);
+            // Hand the upper halves back until the block is the size we wanted.
+            while (Order > InitialOrder) {
+                Order--;
+                PushFreeBlock(Buddy, (void*) ((size_t) Address + (1ull << Order)), Order);
+            }
 
-            //SerialPrintf("\tArea added!\r\n");
+            TicketUnlockIRQRestore(&Buddy->Lock, Flags);
             return Address;
         }
     }
 
     //SerialPrintf("BuddyAllocate: Unable to find a valid order to allocate!\r\nInitial Order: %d, WantedSize: 0x%x\r\n\r\n", InitialOrder, WantedSize);
 
-    TicketUnlock(&Buddy->Lock);
+    TicketUnlockIRQRestore(&Buddy->Lock, Flags);
     return NULL;
 }
 
+static size_t FreeMapSize(buddy_t* Buddy) {
+    size_t Bytes = 0;
+
+    for (int Order = MIN_ORDER; Order < Buddy->MaxOrder; Order++)
+        Bytes += ((Buddy->Length >> Order) + 7) / 8;
+
+    return Bytes;
+}
+
+static size_t AssignFreeMaps(buddy_t* Buddy, size_t Storage) {
+    for (int Order = MIN_ORDER; Order < Buddy->MaxOrder; Order++) {
+        Buddy->FreeMap[Order - MIN_ORDER] = (uint8_t*) Storage;
+        Storage += ((Buddy->Length >> Order) + 7) / 8;
+    }
+
+    return Storage;
+}
+
+/**
+ * Work out how much memory each buddy covers, and carve the space for their free maps out of the memory map.
+ * This has to happen before any range is added, as there's no allocator to ask yet.
+ */
+static void InitFreeMaps() {
+    size_t LowEnd = 0, HighStart = 0, HighEnd = 0;
+
+    for (MMapEnt* MapEntry = &bootldr.mmap; (size_t) MapEntry < (size_t) &bootldr + bootldr.size; MapEntry++) {
+        if (MMapEnt_Type(MapEntry) != MMAP_FREE)
+            continue;
+
+        size_t From = AlignUpwards(MMapEnt_Ptr(MapEntry), PAGE_SIZE);
+        size_t To = AlignDownwards(MMapEnt_Ptr(MapEntry) + MMapEnt_Size(MapEntry), PAGE_SIZE);
+        if (From == 0 || From >= To)
+            continue;
+
+        if (From < LOWER_REGION)
+            LowEnd = MAX(LowEnd, MIN(To, LOWER_REGION));
+
+        if (To > LOWER_REGION) {
+            size_t Start = MAX(From, LOWER_REGION);
+            HighStart = HighStart == 0 ? Start : MIN(HighStart, Start);
+            HighEnd = MAX(HighEnd, To);
+        }
+    }
+
+    LowBuddy.Length = LowEnd;
+    if (HighEnd != 0) {
+        HighBuddy.Base = (directptr_t) HighStart;
+        HighBuddy.Length = HighEnd - HighStart;
+    }
+
+    size_t Needed = AlignUpwards(FreeMapSize(&LowBuddy) + FreeMapSize(&HighBuddy), PAGE_SIZE);
+
+    // Prefer to keep clear of the first megabyte, which is full of things we'd rather not overwrite.
+    for (int Pass = 0; Pass < 2 && FreeMapEnd == 0; Pass++) {
+        for (MMapEnt* MapEntry = &bootldr.mmap; (size_t) MapEntry < (size_t) &bootldr + bootldr.size; MapEntry++) {
+            size_t From = AlignUpwards(MMapEnt_Ptr(MapEntry), PAGE_SIZE);
+            size_t To = AlignDownwards(MMapEnt_Ptr(MapEntry) + MMapEnt_Size(MapEntry), PAGE_SIZE);
+
+            if (MMapEnt_Type(MapEntry) != MMAP_FREE || From == 0 || From + Needed > To)
+                continue;
+            if (Pass == 0 && From < 0x100000)
+                continue;
+
+            FreeMapStart = From;
+            FreeMapEnd = From + Needed;
+            break;
+        }
+    }
+
+    ASSERT(FreeMapEnd != 0, "InitFreeMaps: No room for the buddy free maps!");
+
+    memset((void*) FreeMapStart, 0, Needed);
+    AssignFreeMaps(&HighBuddy, AssignFreeMaps(&LowBuddy, FreeMapStart));
+
+    SerialPrintf("[  Mem] Buddy free maps take 0x%x bytes at 0x%p\r\n", Needed, FreeMapStart);
+}
+
+static directptr_t BuddyAllocateAny(size_t Size) {
+    directptr_t Pointer = NULL;
+
+    if (HighBuddy.Base == 0) {
+        //SerialPrintf("Attempting allocation into high memory.\n");
+        Pointer = BuddyAllocate(&HighBuddy, Size);
+    }
+
+    if (Pointer == NULL) {
+        //SerialPrintf("Attempting allocation into low memory.\n");
+        Pointer = BuddyAllocate(&LowBuddy, Size);
+    }
+
+    return Pointer;
+}
+
+static buddy_t* BuddyForAddress(directptr_t Pointer) {
+    if (Pointer < (void*) (LOWER_REGION /* + DIRECT_REGION */))
+        return &LowBuddy;
+    else
+        return &HighBuddy;
+}
+
+/**
+ * The frame caches are only ever touched by their own core, so masking interrupts is all the protection they need.
+ */
+static frame_cache_t* CurrentFrameCache() {
+    size_t Core = GetCurrentCoreID();
+    return Core < FRAME_CACHE_CORES ? &FrameCaches[Core] : NULL;
+}
+
+/**
+ * Pull a batch of frames out of the buddy lists.
+ * Ideally, the batch comes out as one contiguous block, so that the buddy lock is only taken once.
+ * If memory is too fragmented for that, fall back to collecting individual frames.
+ */
+static void RefillFrameCache(frame_cache_t* Cache) {
+    directptr_t Block = BuddyAllocateAny(FRAME_CACHE_BATCH * PAGE_SIZE);
+
+    if (Block != NULL) {
+        for (size_t i = 0; i < FRAME_CACHE_BATCH; i++)
+            Cache->Frames[Cache->Count++] = (directptr_t) ((size_t) Block + i * PAGE_SIZE);
+    } else {
+        for (size_t i = 0; i < FRAME_CACHE_BATCH; i++) {
+            directptr_t Frame = BuddyAllocateAny(PAGE_SIZE);
+            if (Frame == NULL)
+                break;
+            Cache->Frames[Cache->Count++] = Frame;
+        }
+    }
+
+    Cache->Stats.Refills++;
+}
+
+/**
+ * Give the coldest batch of frames back to the buddy lists, where they can be merged into larger blocks again.
+ * The most recently freed frames stay behind, as they're the most likely to still be in the cache.
+ */
+static void DrainFrameCache(frame_cache_t* Cache) {
+    for (size_t i = 0; i < FRAME_CACHE_BATCH; i++)
+        AddToBuddyList(BuddyForAddress(Cache->Frames[i]), Cache->Frames[i], PAGE_SHIFT);
+
+    for (size_t i = FRAME_CACHE_BATCH; i < Cache->Count; i++)
+        Cache->Frames[i - FRAME_CACHE_BATCH] = Cache->Frames[i];
+
+    Cache->Count -= FRAME_CACHE_BATCH;
+    Cache->Stats.Drains++;
+}
+
+static directptr_t FrameCacheAllocate() {
+    directptr_t Frame = NULL;
+    size_t Flags = DisableInterrupts();
+    frame_cache_t* Cache = CurrentFrameCache();
+
+    if (Cache != NULL) {
+        if (Cache->Count == 0) {
+            Cache->Stats.Misses++;
+            RefillFrameCache(Cache);
+        } else
+            Cache->Stats.Hits++;
+
+        if (Cache->Count != 0)
+            Frame = Cache->Frames[--Cache->Count];
+    }
+
+    RestoreInterrupts(Flags);
+    return Frame;
+}
+
+static bool FrameCacheFree(directptr_t Frame) {
+    size_t Flags = DisableInterrupts();
+    frame_cache_t* Cache = CurrentFrameCache();
+
+    if (Cache != NULL) {
+        if (Cache->Count == FRAME_CACHE_SIZE)
+            DrainFrameCache(Cache);
+
+        Cache->Frames[Cache->Count++] = Frame;
+        Cache->Stats.Frees++;
+    }
+
+    RestoreInterrupts(Flags);
+    return Cache != NULL;
+}
+
+void PhysGetFrameCacheStats(size_t Core, frame_cache_stats_t* Stats) {
+    if (Core >= FRAME_CACHE_CORES) {
+        memset(Stats, 0, sizeof(frame_cache_stats_t));
+        return;
+    }
+
+    *Stats = FrameCaches[Core].Stats;
+    Stats->Cached = FrameCaches[Core].Count;
+}
+
+void PhysDumpFrameCacheStats() {
+    SerialPrintf("[  Mem] Frame cache statistics (%u frames per core, batches of %u):\r\n", FRAME_CACHE_SIZE, FRAME_CACHE_BATCH);
+
+    for (size_t Core = 0; Core < FRAME_CACHE_CORES; Core++) {
+        frame_cache_stats_t Stats;
+        PhysGetFrameCacheStats(Core, &Stats);
+
+        if (Stats.Hits == 0 && Stats.Misses == 0 && Stats.Frees == 0)
+            continue;
+
+        SerialPrintf("[  Mem]   Core %u: %u hits, %u misses, %u refills, %u drains, %u frees, %u cached\r\n", Core,
+                     Stats.Hits, Stats.Misses, Stats.Refills, Stats.Drains, Stats.Frees, Stats.Cached);
+    }
+
+    TicketPrintStats("Low buddy", &LowBuddy.Lock);
+    TicketPrintStats("High buddy", &HighBuddy.Lock);
+}
+
 void InitMemoryManager() {
 
     SerialPrintf("[  Mem] Counting memory..\r\n");
@@ -178,8 +466,9 @@ void InitMemoryManager() {
 
 void ListMemoryMap() {
 
-    SerialPrintf("[  Mem] BIOS-Provided memory map:\r\n");
+    InitFreeMaps();
 
+    SerialPrintf("[  Mem] BIOS-Provided memory map:\r\n");
 
     for (MMapEnt* MapEntry = &bootldr.mmap; (size_t) MapEntry < (size_t) &bootldr + bootldr.size; MapEntry++) {
         char EntryType[8] = {0};
@@ -210,7 +499,17 @@ void ListMemoryMap() {
             size_t page_from = AlignUpwards(entry_from, 0x1000);
             size_t page_to = AlignDownwards(entry_to, 0x1000);
 
-            if (page_from != 0 && page_to != 0) {
+            // Keep the buddy free maps out of the buddies themselves.
+            if (page_from < FreeMapEnd && page_to > FreeMapStart) {
+                if (page_from < FreeMapStart && page_from != 0) {
+                    SerialPrintf("[  Mem]      Adding the range 0x%p-0x%p to the physical memory manager!\r\n", page_from,
+                                 FreeMapStart);
+                    AddRangeToPhysMem((void*) ((char*) (page_from)), FreeMapStart - page_from);
+                }
+                page_from = MAX(page_from, FreeMapEnd);
+            }
+
+            if (page_from != 0 && page_to != 0 && page_from < page_to) {
                 SerialPrintf("[  Mem]      Adding the range 0x%p-0x%p to the physical memory manager!\r\n", page_from,
                              page_to);
                 AddRangeToPhysMem((void*) ((char*) (page_from)), page_to - page_from);
@@ -236,12 +535,10 @@ void AddRangeToPhysMem(directptr_t Base, size_t Size) {
             Size = Size - difference;
         }
 
-        if (HighBuddy.Base == NULL) {
-            HighBuddy.Base = Base;
+        if (Size != 0) {
+            SerialPrintf("[  Mem]      New range in higher memory: 0x%p, size 0x%x\r\n", (size_t) Base, Size);
+            AddRangeToBuddy(&HighBuddy, Base, Size);
         }
-
-        SerialPrintf("[  Mem]      New range in higher memory: 0x%p, size 0x%x\r\n", (size_t) Base, Size);
-        AddRangeToBuddy(&HighBuddy, Base, Size);
     }
 
     if (MemoryLength < AlignUpwards((size_t) Base + Size, PAGE_SIZE) / PAGE_SIZE) {
@@ -259,15 +556,11 @@ directptr_t PhysAllocateLowMem(size_t Size) {
 directptr_t PhysAllocateMem(size_t Size) {
     directptr_t Pointer = NULL;
 
-    if (HighBuddy.Base == 0) {
-        //SerialPrintf("Attempting allocation into high memory.\n");
-        Pointer = BuddyAllocate(&HighBuddy, Size);
-    }
+    if (MAX(64 - CLZ(Size - 1), MIN_ORDER) == PAGE_SHIFT)
+        Pointer = FrameCacheAllocate();
 
-    if (Pointer == NULL) {
-        //SerialPrintf("Attempting allocation into low memory.\n");
-        Pointer = BuddyAllocate(&LowBuddy, Size);
-    }
+    if (Pointer == NULL)
+        Pointer = BuddyAllocateAny(Size);
 
     ASSERT(Pointer != NULL, "PhysAllocateMem: Unable to allocate memory!");
 
@@ -290,15 +583,12 @@ directptr_t PhysAllocateLowZeroMem(size_t Size) {
 void PhysFreeMem(directptr_t Pointer, size_t Size) {
     //ASSERT(Pointer >= (directptr_t) DIRECT_REGION, "PhysFreeMem: Attempting to free memory not in the direct mapping region.");
 
-    buddy_t* Buddy;
+    int Order = MAX(64 - CLZ(Size - 1), MIN_ORDER);
 
-    if (Pointer < (void*) (LOWER_REGION /* + DIRECT_REGION */))
-        Buddy = &LowBuddy;
-    else
-        Buddy = &HighBuddy;
+    if (Order == PAGE_SHIFT && FrameCacheFree(Pointer))
+        return;
 
-    int Order = MAX(64 - CLZ(Size - 1), MIN_ORDER);
-    AddToBuddyList(Buddy, Pointer, Order, false);
+    AddToBuddyList(BuddyForAddress(Pointer), Pointer, Order);
 }
 
 static _Atomic(uint16_t)* PageRefCount = NULL;
@@ -0,0 +1,356 @@
+#include <kernel/chroma.h>
+#include <kernel/constants.hpp>
+#include <kernel/system/trace.h>
+
+/************************
+ *** Team Kitty, 2021 ***
+ ***     Chroma       ***
+ ***********************/
+
+/* This file contains the size-class slab allocator that backs kmalloc, kfree and operator new.
+ * It is an alternative to liballoc; the CHROMA_SLAB_ALLOCATOR CMake option decides which of the two is linked in.
+ *
+ * Every request up to SLAB_MAX_SIZE is rounded up to a power of two and served out of a slab:
+ *  a single page with a slab_t header at the bottom and fixed-size objects packed after it.
+ *  Free objects are chained through their first word, so allocating out of a slab is a single pop.
+ *
+ * In front of the slabs, each core keeps a small magazine of free objects per size class.
+ *  The common path never touches a lock; only refilling or draining a magazine takes the class lock,
+ *  and it moves SLAB_BATCH objects at a time when it does.
+ *
+ * Anything bigger than SLAB_MAX_SIZE bypasses the slabs and is handed whole pages from the physical allocator.
+ *  Those pages carry the same header, so kfree can tell the two apart by looking at the bottom of the page.
+ */
+
+#define SLAB_MAGIC          0x51AB51AB
+#define SLAB_LARGE_MAGIC    0x1A26E51A
+
+#define SLAB_MIN_SHIFT      4           // The smallest size class is 16 bytes, which is also the alignment guarantee.
+#define SLAB_CLASSES        7           // 16, 32, 64, 128, 256, 512, 1024
+#define SLAB_MAX_SIZE       ((size_t) 1 << (SLAB_MIN_SHIFT + SLAB_CLASSES - 1))
+
+#define SLAB_MAGAZINE_SIZE  32          // Free objects each core may hold per size class.
+#define SLAB_BATCH          16          // Objects moved between a magazine and the slabs at once.
+
+typedef struct slab {
+    uint32_t Magic;                     // SLAB_MAGIC or SLAB_LARGE_MAGIC.
+    uint32_t Class;                     // Size class index. Unused for large allocations.
+    size_t Pages;                       // Pages backing a large allocation. Always 1 for a slab.
+    size_t InUse;                       // Objects handed out of this slab, including those sat in magazines.
+    void* FreeList;                     // Free objects, chained through their first word.
+    struct slab* Next;                  // Neighbours on the class' partial list.
+    struct slab* Previous;
+} __attribute__((aligned(64))) slab_t;
+
+typedef struct {
+    ticketlock_t Lock;
+    size_t Size;                        // Object size of this class.
+    size_t PerSlab;                     // How many objects fit in one slab.
+    slab_t* Partial;                    // Slabs with at least one free object.
+    slab_t* Spare;                      // One completely empty slab, kept to stop a page bouncing in and out.
+} slab_class_t;
+
+typedef struct {
+    size_t Count;
+    void* Objects[SLAB_MAGAZINE_SIZE];
+} slab_magazine_t;
+
+typedef struct {
+    slab_magazine_t Magazines[SLAB_CLASSES];
+} __attribute__((aligned(64))) slab_cache_t;
+
+static slab_class_t SlabClasses[SLAB_CLASSES];
+static slab_cache_t SlabCaches[Constants::Core::MAX_CORES];
+static bool SlabReady = false;
+
+static void InitSlabs() {
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        SlabClasses[i].Lock = NEW_TICKETLOCK();
+        SlabClasses[i].Size = (size_t) 1 << (SLAB_MIN_SHIFT + i);
+        SlabClasses[i].PerSlab = (PAGE_SIZE - sizeof(slab_t)) / SlabClasses[i].Size;
+    }
+
+    SlabReady = true;
+}
+
+static size_t SizeToClass(size_t Size) {
+    size_t Class = 0;
+    while (((size_t) 1 << (SLAB_MIN_SHIFT + Class)) < Size)
+        Class++;
+    return Class;
+}
+
+static inline slab_t* SlabForObject(void* Object) {
+    return (slab_t*) ((size_t) Object & ~((size_t) PAGE_SIZE - 1));
+}
+
+static void UnlinkSlab(slab_class_t* Class, slab_t* Slab) {
+    if (Slab->Previous)
+        Slab->Previous->Next = Slab->Next;
+    else
+        Class->Partial = Slab->Next;
+    if (Slab->Next)
+        Slab->Next->Previous = Slab->Previous;
+    Slab->Next = Slab->Previous = NULL;
+}
+
+static void PushSlab(slab_class_t* Class, slab_t* Slab) {
+    Slab->Previous = NULL;
+    Slab->Next = Class->Partial;
+    if (Class->Partial)
+        Class->Partial->Previous = Slab;
+    Class->Partial = Slab;
+}
+
+/**
+ * Carve a fresh page into objects of the given class.
+ * Must be called with the class lock held.
+ */
+static slab_t* NewSlab(size_t ClassIndex) {
+    slab_class_t* Class = &SlabClasses[ClassIndex];
+    slab_t* Slab = Class->Spare;
+
+    if (Slab != NULL) {
+        Class->Spare = NULL;
+        return Slab;
+    }
+
+    Slab = (slab_t*) PhysAllocateZeroMem(PAGE_SIZE);
+    if (Slab == NULL)
+        return NULL;
+
+    Slab->Magic = SLAB_MAGIC;
+    Slab->Class = ClassIndex;
+    Slab->Pages = 1;
+
+    // Thread the objects so that the lowest address is handed out first.
+    uint8_t* Object = (uint8_t*) Slab + sizeof(slab_t);
+    for (size_t i = 0; i < Class->PerSlab; i++) {
+        *(void**) Object = i + 1 < Class->PerSlab ? Object + Class->Size : NULL;
+        Object += Class->Size;
+    }
+    Slab->FreeList = (uint8_t*) Slab + sizeof(slab_t);
+
+    return Slab;
+}
+
+/**
+ * Move up to SLAB_BATCH objects from the partial slabs into the magazine.
+ * Must be called with interrupts disabled.
+ */
+static void RefillMagazine(size_t ClassIndex, slab_magazine_t* Magazine) {
+    slab_class_t* Class = &SlabClasses[ClassIndex];
+
+    TicketLock(&Class->Lock);
+    while (Magazine->Count < SLAB_BATCH) {
+        slab_t* Slab = Class->Partial;
+        if (Slab == NULL) {
+            Slab = NewSlab(ClassIndex);
+            if (Slab == NULL)
+                break;
+            PushSlab(Class, Slab);
+        }
+
+        while (Slab->FreeList != NULL && Magazine->Count < SLAB_BATCH) {
+            void* Object = Slab->FreeList;
+            Slab->FreeList = *(void**) Object;
+            Slab->InUse++;
+            Magazine->Objects[Magazine->Count++] = Object;
+        }
+
+        if (Slab->FreeList == NULL)
+            UnlinkSlab(Class, Slab);
+    }
+    TicketUnlock(&Class->Lock);
+}
+
+/**
+ * Hand an object back to its slab.
+ * Must be called with the class lock held.
+ */
+static void ReturnToSlab(slab_class_t* Class, void* Object) {
+    slab_t* Slab = SlabForObject(Object);
+
+    if (Slab->FreeList == NULL)
+        PushSlab(Class, Slab);
+
+    *(void**) Object = Slab->FreeList;
+    Slab->FreeList = Object;
+    Slab->InUse--;
+
+    if (Slab->InUse == 0) {
+        UnlinkSlab(Class, Slab);
+        if (Class->Spare == NULL)
+            Class->Spare = Slab;
+        else
+            PhysFreeMem((directptr_t) Slab, PAGE_SIZE);
+    }
+}
+
+/**
+ * Return the oldest SLAB_BATCH objects in the magazine to their slabs.
+ * Must be called with interrupts disabled.
+ */
+static void DrainMagazine(size_t ClassIndex, slab_magazine_t* Magazine) {
+    slab_class_t* Class = &SlabClasses[ClassIndex];
+    size_t Batch = Magazine->Count < SLAB_BATCH ? Magazine->Count : SLAB_BATCH;
+
+    TicketLock(&Class->Lock);
+    for (size_t i = 0; i < Batch; i++)
+        ReturnToSlab(Class, Magazine->Objects[i]);
+    TicketUnlock(&Class->Lock);
+
+    for (size_t i = Batch; i < Magazine->Count; i++)
+        Magazine->Objects[i - Batch] = Magazine->Objects[i];
+    Magazine->Count -= Batch;
+}
+
+static void* SlabAllocate(size_t ClassIndex) {
+    void* Object = NULL;
+    size_t Flags = DisableInterrupts();
+    size_t Core = GetCurrentCoreID();
+
+    if (Core < Constants::Core::MAX_CORES) {
+        slab_magazine_t* Magazine = &SlabCaches[Core].Magazines[ClassIndex];
+        if (Magazine->Count == 0)
+            RefillMagazine(ClassIndex, Magazine);
+        if (Magazine->Count != 0)
+            Object = Magazine->Objects[--Magazine->Count];
+    } else {
+        // A core we have no magazine for goes straight to the slabs.
+        slab_magazine_t Single = { .Count = 0, .Objects = { } };
+        RefillMagazine(ClassIndex, &Single);
+        if (Single.Count != 0) {
+            Object = Single.Objects[--Single.Count];
+            DrainMagazine(ClassIndex, &Single);
+        }
+    }
+
+    RestoreInterrupts(Flags);
+    return Object;
+}
+
+static void SlabFree(size_t ClassIndex, void* Object) {
+    size_t Flags = DisableInterrupts();
+    size_t Core = GetCurrentCoreID();
+
+    if (Core < Constants::Core::MAX_CORES) {
+        slab_magazine_t* Magazine = &SlabCaches[Core].Magazines[ClassIndex];
+        if (Magazine->Count == SLAB_MAGAZINE_SIZE)
+            DrainMagazine(ClassIndex, Magazine);
+        Magazine->Objects[Magazine->Count++] = Object;
+    } else {
+        slab_class_t* Class = &SlabClasses[ClassIndex];
+        TicketLock(&Class->Lock);
+        ReturnToSlab(Class, Object);
+        TicketUnlock(&Class->Lock);
+    }
+
+    RestoreInterrupts(Flags);
+}
+
+static void* LargeAllocate(size_t Size) {
+    size_t Pages = (Size + sizeof(slab_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+    slab_t* Header = (slab_t*) PhysAllocateZeroMem(Pages * PAGE_SIZE);
+    if (Header == NULL)
+        return NULL;
+
+    Header->Magic = SLAB_LARGE_MAGIC;
+    Header->Pages = Pages;
+    return (uint8_t*) Header + sizeof(slab_t);
+}
+
+/**
+ * @return How many bytes the caller may use at the given allocation.
+ */
+static size_t UsableSize(slab_t* Header) {
+    if (Header->Magic == SLAB_LARGE_MAGIC)
+        return Header->Pages * PAGE_SIZE - sizeof(slab_t);
+    return SlabClasses[Header->Class].Size;
+}
+
+static void* KernelAllocate(size_t Size) {
+    if (!SlabReady)
+        InitSlabs();
+
+    if (Size == 0)
+        Size = 1;
+
+    if (Size > SLAB_MAX_SIZE)
+        return LargeAllocate(Size);
+
+    return SlabAllocate(SizeToClass(Size));
+}
+
+static void KernelFree(void* Pointer) {
+    if (Pointer == NULL)
+        return;
+
+    slab_t* Header = SlabForObject(Pointer);
+
+    if (Header->Magic == SLAB_LARGE_MAGIC) {
+        PhysFreeMem((directptr_t) Header, Header->Pages * PAGE_SIZE);
+        return;
+    }
+
+    ASSERT(Header->Magic == SLAB_MAGIC, "kfree: pointer was not allocated by kmalloc");
+    SlabFree(Header->Class, Pointer);
+}
+
+static void* KernelReallocate(void* Pointer, size_t Size) {
+    if (Pointer == NULL)
+        return KernelAllocate(Size);
+
+    if (Size == 0) {
+        KernelFree(Pointer);
+        return NULL;
+    }
+
+    size_t Current = UsableSize(SlabForObject(Pointer));
+    if (Size <= Current)
+        return Pointer;
+
+    void* New = KernelAllocate(Size);
+    if (New == NULL)
+        return NULL;
+
+    memcpy(New, Pointer, Current);
+    KernelFree(Pointer);
+    return New;
+}
+
+// The public entry points are thin wrappers, so that the allocation profiler sees the real call site.
+
+void* PREFIX(malloc)(size_t Size) {
+    void* Pointer = KernelAllocate(Size);
+    Trace(TRACE_ALLOC, (size_t) Pointer, Size);
+    ALLOC_PROFILE_ALLOC(Pointer, Size);
+    return Pointer;
+}
+
+void PREFIX(free)(void* Pointer) {
+    Trace(TRACE_FREE, (size_t) Pointer, 0);
+    ALLOC_PROFILE_FREE(Pointer);
+    KernelFree(Pointer);
+}
+
+void* PREFIX(calloc)(size_t Count, size_t Size) {
+    size_t Total = Count * Size;
+    if (Size != 0 && Total / Size != Count)
+        return NULL;
+
+    void* Pointer = KernelAllocate(Total);
+    if (Pointer != NULL)
+        memset(Pointer, 0, Total);
+
+    Trace(TRACE_ALLOC, (size_t) Pointer, Total);
+    ALLOC_PROFILE_ALLOC(Pointer, Total);
+    return Pointer;
+}
+
+void* PREFIX(realloc)(void* Pointer, size_t Size) {
+    void* New = KernelReallocate(Pointer, Size);
+    Trace(TRACE_ALLOC, (size_t) New, Size);
+    ALLOC_PROFILE_REALLOC(Pointer, New, Size);
+    return New;
+}
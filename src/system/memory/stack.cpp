@@ -0,0 +1,182 @@
+#include <kernel/chroma.h>
+#include <kernel/constants.hpp>
+
+/************************
+ *** Team Kitty, 2021 ***
+ ***     Chroma       ***
+ ***********************/
+
+/* This file contains the kernel stack allocator.
+ * KERNEL_STACK_REGION is cut into fixed slots of KERNEL_STACK_SLOT bytes. The bottom page of each slot is never mapped,
+ *  and the stack sits on top of it, so an overflow hits the guard page and faults where it happened.
+ *  The double fault handler runs on its own stack, so it can still report it.
+ *
+ * Mapping a stack and unmapping it again costs a TLB shootdown, so freed stacks aren't given back straight away.
+ *  Each core keeps a few of them mapped and ready, and only once its cache is full does a stack go back to the region.
+ *
+ * Stacks are painted with a known pattern when they're mapped. The deepest word that no longer holds the pattern
+ *  is the high-water mark. A stack is repainted up to its high-water mark when it's cached,
+ *  so reusing one doesn't mean painting it all again.
+ */
+
+#define STACK_SLOTS         ((KERNEL_STACK_END - KERNEL_STACK_REGION) / KERNEL_STACK_SLOT)
+#define STACK_CACHE_SIZE    8           // Mapped stacks each core may keep for reuse.
+#define STACK_PAINT         0x57ACC0DE57ACC0DEull
+
+typedef struct {
+    size_t Count;
+    void* Stacks[STACK_CACHE_SIZE];
+} __attribute__((aligned(64))) stack_cache_t;
+
+static stack_cache_t StackCaches[Constants::Core::MAX_CORES];
+
+// Which slots are in use, cached stacks included. Only touched when a stack is mapped or unmapped.
+static ticketlock_t SlotLock;
+static size_t SlotMap[(STACK_SLOTS + 63) / 64];
+static size_t NextSlot = 0;
+static size_t SlotsUsed = 0;
+
+static inline size_t SlotToStack(size_t Slot) {
+    return KERNEL_STACK_REGION + Slot * KERNEL_STACK_SLOT + KERNEL_STACK_GUARD;
+}
+
+static inline size_t StackToSlot(void* Stack) {
+    return ((size_t) Stack - KERNEL_STACK_REGION) / KERNEL_STACK_SLOT;
+}
+
+/**
+ * Find a free slot, starting from where the last search left off. Returns STACK_SLOTS if the region is full.
+ */
+static size_t ClaimSlot() {
+    size_t Flags = TicketLockIRQSave(&SlotLock);
+
+    size_t Found = STACK_SLOTS;
+    for (size_t i = 0; i < STACK_SLOTS; i++) {
+        size_t Slot = (NextSlot + i) % STACK_SLOTS;
+        if (SlotMap[Slot / 64] & (1ull << (Slot % 64)))
+            continue;
+
+        SlotMap[Slot / 64] |= 1ull << (Slot % 64);
+        SlotsUsed++;
+        NextSlot = Slot + 1;
+        Found = Slot;
+        break;
+    }
+
+    TicketUnlockIRQRestore(&SlotLock, Flags);
+    return Found;
+}
+
+static void ReleaseSlot(size_t Slot) {
+    size_t Flags = TicketLockIRQSave(&SlotLock);
+    SlotMap[Slot / 64] &= ~(1ull << (Slot % 64));
+    SlotsUsed--;
+    TicketUnlockIRQRestore(&SlotLock, Flags);
+}
+
+static void Paint(size_t* From, size_t* To) {
+    for (; From < To; From++)
+        *From = STACK_PAINT;
+}
+
+/**
+ * Back a fresh slot with memory. Only the slot is contiguous in physical memory; the guard page has none.
+ */
+static void* MapStack() {
+    size_t Slot = ClaimSlot();
+    if (Slot == STACK_SLOTS) {
+        SerialPrintf("[STACK] Out of kernel stack slots!\r\n");
+        return nullptr;
+    }
+
+    size_t Physical = (size_t) PhysAllocateMem(KERNEL_STACK_SIZE);
+    size_t Stack = SlotToStack(Slot);
+
+    MapVirtualRange(&KernelAddressSpace, Physical, Stack, KERNEL_STACK_SIZE, 3, nullptr);
+    Paint((size_t*) Stack, (size_t*) (Stack + KERNEL_STACK_SIZE));
+
+    return (void*) Stack;
+}
+
+static void UnmapStack(void* Stack) {
+    size_t Physical = DecodeVirtualAddress(&KernelAddressSpace, (size_t) Stack);
+
+    UnmapVirtualRange(&KernelAddressSpace, (size_t) Stack, KERNEL_STACK_SIZE, nullptr);
+    PhysFreeMem((directptr_t) Physical, KERNEL_STACK_SIZE);
+    ReleaseSlot(StackToSlot(Stack));
+}
+
+/**
+ * Fill the boot core's cache up front.
+ * That also builds the page tables under KERNEL_STACK_REGION now, before any address space copies the higher half.
+ */
+void InitKernelStacks() {
+    SlotLock = NEW_TICKETLOCK();
+
+    for (size_t i = 0; i < STACK_CACHE_SIZE; i++) {
+        void* Stack = MapStack();
+        if (Stack == nullptr)
+            break;
+        FreeKernelStack(Stack);
+    }
+
+    SerialPrintf("[STACK] %u slots of %u bytes, with %u bytes of guard.\r\n", STACK_SLOTS, KERNEL_STACK_SIZE, KERNEL_STACK_GUARD);
+}
+
+void* AllocateKernelStack() {
+    void* Stack = nullptr;
+
+    size_t Flags = DisableInterrupts();
+    size_t Core = GetCurrentCoreID();
+    if (Core < Constants::Core::MAX_CORES && StackCaches[Core].Count != 0)
+        Stack = StackCaches[Core].Stacks[--StackCaches[Core].Count];
+    RestoreInterrupts(Flags);
+
+    if (Stack == nullptr)
+        Stack = MapStack();
+
+    return Stack;
+}
+
+/**
+ * Mapping and unmapping happen with interrupts enabled, because a shootdown waits on the other cores.
+ */
+void FreeKernelStack(void* StackAddress) {
+    if (StackAddress == nullptr)
+        return;
+
+    size_t* Top = (size_t*) ((size_t) StackAddress + KERNEL_STACK_SIZE);
+    Paint((size_t*) ((size_t) Top - KernelStackHighWater(StackAddress)), Top);
+
+    size_t Flags = DisableInterrupts();
+    size_t Core = GetCurrentCoreID();
+    bool Cached = false;
+    if (Core < Constants::Core::MAX_CORES && StackCaches[Core].Count < STACK_CACHE_SIZE) {
+        StackCaches[Core].Stacks[StackCaches[Core].Count++] = StackAddress;
+        Cached = true;
+    }
+    RestoreInterrupts(Flags);
+
+    if (!Cached)
+        UnmapStack(StackAddress);
+}
+
+/**
+ * @return How many bytes of the stack have been used, at most, since it was last painted.
+ */
+size_t KernelStackHighWater(void* StackAddress) {
+    size_t* Word = (size_t*) StackAddress;
+    size_t* Top = (size_t*) ((size_t) StackAddress + KERNEL_STACK_SIZE);
+
+    while (Word < Top && *Word == STACK_PAINT)
+        Word++;
+
+    return (size_t) Top - (size_t) Word;
+}
+
+bool IsKernelStackGuard(size_t Address) {
+    if (Address < KERNEL_STACK_REGION || Address >= KERNEL_STACK_REGION + STACK_SLOTS * KERNEL_STACK_SLOT)
+        return false;
+
+    return (Address - KERNEL_STACK_REGION) % KERNEL_STACK_SLOT < KERNEL_STACK_GUARD;
+}
@@ -0,0 +1,490 @@
+#include <kernel/chroma.h>
+#include <driver/io/apic.h>
+
+/************************
+ *** Team Kitty, 2021 ***
+ ***     Chroma       ***
+ ***********************/
+
+/* This file contains the TLB shootdown mechanism, and the address space switching that it has to agree with.
+ *
+ * Changing a page table entry only affects the TLB of the core that made the change.
+ * Any other core that has the same address space loaded may keep using the stale translation until told otherwise.
+ *
+ * Each address space keeps a bitmap of the cores that may have its translations cached.
+ * FlushTLBBatch uses that to work out who needs to hear about a batch of changes:
+ *  - Changes to the higher half go to every online core, since all address spaces share it.
+ *  - Changes to the lower half only go to cores in the bitmap.
+ *
+ * Every core has a mailbox. Senders merge their pages into each target's mailbox, bump its request counter,
+ *  and send a TLB_SHOOTDOWN_VECTOR IPI. The target drains the whole mailbox at once, then publishes
+ *  the request count it drained up to as its completion counter. The sender waits for that counter to catch up.
+ * Requests from several senders, or several batches from one sender, coalesce into one drain.
+ *
+ * While waiting, a sender keeps servicing its own mailbox. Otherwise, two cores shooting each other down
+ *  at the same time, both with interrupts disabled, would wait forever.
+ *
+ * When the processor supports PCIDs, every core hands out PCID_SLOTS of them to the address spaces it runs.
+ * Switching to an address space that still has its PCID loads CR3 without flushing anything,
+ *  so a core that bounces between a few processes keeps all of their translations warm.
+ * The price is that a core can hold translations for address spaces it isn't running. It stays in their bitmap
+ *  until the PCID is taken away, and invalidates them with INVPCID, or by flushing the PCID on its next use.
+ */
+
+#define PAUSE   __asm__ __volatile__("pause")
+
+#define CR4_PGE         (1 << 7)
+#define CR4_PCIDE       (1 << 17)
+#define CR3_NOFLUSH     (1ull << 63)
+
+#define INVPCID_ADDRESS     0
+#define INVPCID_CONTEXT     1
+#define INVPCID_EVERYTHING  2
+
+#define PCID_SLOTS      8               // Slot i is PCID i + 1. PCID 0 is for untagged loads.
+
+typedef struct {
+    ticketlock_t Lock;
+    size_t Count;
+    size_t Pages[TLB_BATCH_PAGES];
+    address_space_t* Space;             // Who the pages belong to. Null if more than one address space posted.
+    bool Posted;                        // Whether anything is waiting here at all.
+    bool FlushAll;
+    bool Shared;
+    volatile size_t Requested;          // Bumped by a sender each time it posts to this mailbox.
+    volatile size_t Completed;          // The value of Requested at the last drain that finished.
+} __attribute__((aligned(64))) tlb_mailbox_t;
+
+typedef struct {
+    address_space_t* Owner;
+    bool Stale;                         // Owner changed while this PCID wasn't loaded. Flush it on the next use.
+} pcid_slot_t;
+
+/**
+ * What a core has loaded. Only ever touched by the core itself, with interrupts off.
+ */
+typedef struct {
+    address_space_t* Loaded;            // Null until the core loads one; it may be running on other tables until then.
+    size_t Slot;                        // The slot Loaded is tagged with, or PCID_SLOTS for PCID 0.
+    size_t NextVictim;
+    pcid_slot_t Slots[PCID_SLOTS];
+} __attribute__((aligned(64))) tlb_context_t;
+
+static tlb_mailbox_t Mailboxes[Constants::Core::MAX_CORES];
+static tlb_context_t Contexts[Constants::Core::MAX_CORES];
+static volatile size_t OnlineCores = 0;
+
+static bool FeaturesChecked = false;
+static bool PCIDEnabled = false;
+static bool INVPCIDSupported = false;
+static bool GlobalPagesEnabled = false;
+
+static inline size_t PhysicalTables(address_space_t* Space) {
+    size_t PML4 = (size_t) Space->PML4;
+    return PML4 >= DIRECT_REGION ? FROM_DIRECT(PML4) : PML4;
+}
+
+/**
+ * Throw away every translation this core has, in every PCID, global pages included.
+ */
+static void FlushEverything(tlb_context_t* Context) {
+    if (INVPCIDSupported)
+        InvalidatePCID(INVPCID_EVERYTHING, 0, 0);
+    else if (GlobalPagesEnabled) {
+        // Toggling PGE flushes every PCID as well.
+        size_t CR4 = ReadControlRegister(4);
+        WriteControlRegister(4, CR4 & ~CR4_PGE);
+        WriteControlRegister(4, CR4);
+    } else {
+        // Without global pages there is nothing else to catch, but only the current PCID gets flushed.
+        WriteControlRegister(3, ReadControlRegister(3));
+        for (size_t i = 0; i < PCID_SLOTS; i++)
+            if (i != Context->Slot && Context->Slots[i].Owner != nullptr)
+                Context->Slots[i].Stale = true;
+        return;
+    }
+
+    for (size_t i = 0; i < PCID_SLOTS; i++)
+        Context->Slots[i].Stale = false;
+}
+
+/**
+ * Invalidate pages in a PCID that isn't loaded right now.
+ */
+static void InvalidateSlot(tlb_context_t* Context, size_t Slot, size_t* Pages, size_t Count, bool FlushAll) {
+    if (!INVPCIDSupported) {
+        Context->Slots[Slot].Stale = true;
+        return;
+    }
+
+    if (FlushAll)
+        InvalidatePCID(INVPCID_CONTEXT, Slot + 1, 0);
+    else
+        for (size_t i = 0; i < Count; i++)
+            InvalidatePCID(INVPCID_ADDRESS, Slot + 1, Pages[i]);
+}
+
+/**
+ * Apply a batch of invalidations to this core. Must be called with interrupts off.
+ * @param Space The address space that changed, or null if it could have been any of them.
+ */
+static void Invalidate(size_t Core, address_space_t* Space, size_t* Pages, size_t Count, bool FlushAll, bool Shared) {
+    tlb_context_t* Context = &Contexts[Core];
+    bool Any = Space == nullptr;
+
+    if (FlushAll && (Shared || Any)) {
+        FlushEverything(Context);
+        return;
+    }
+
+    // Whatever is in CR3 right now. INVLPG also catches global pages, wherever they came from.
+    if (Any || Shared || Context->Loaded == nullptr || Context->Loaded == Space) {
+        if (FlushAll)
+            WriteControlRegister(3, ReadControlRegister(3));
+        else
+            for (size_t i = 0; i < Count; i++)
+                InvalidatePage(Pages[i]);
+    }
+
+    // Every other PCID that might have cached the same thing.
+    for (size_t i = 0; i < PCID_SLOTS; i++) {
+        address_space_t* Owner = Context->Slots[i].Owner;
+        if (i == Context->Slot || Owner == nullptr)
+            continue;
+
+        if (Shared || Owner == Space)
+            InvalidateSlot(Context, i, Pages, Count, FlushAll);
+    }
+}
+
+/**
+ * Perform everything that has been posted to this core's mailbox.
+ */
+static void ServiceMailbox(size_t Core) {
+    tlb_mailbox_t* Mailbox = &Mailboxes[Core];
+    size_t Pages[TLB_BATCH_PAGES];
+
+    if (__atomic_load_n(&Mailbox->Completed, __ATOMIC_ACQUIRE) == __atomic_load_n(&Mailbox->Requested, __ATOMIC_ACQUIRE))
+        return;
+
+    size_t Flags = TicketLockIRQSave(&Mailbox->Lock);
+    size_t Count = Mailbox->Count;
+    address_space_t* Space = Mailbox->Space;
+    bool FlushAll = Mailbox->FlushAll;
+    bool Shared = Mailbox->Shared;
+    size_t Requested = Mailbox->Requested;
+
+    for (size_t i = 0; i < Count; i++)
+        Pages[i] = Mailbox->Pages[i];
+    Mailbox->Count = 0;
+    Mailbox->Space = nullptr;
+    Mailbox->Posted = false;
+    Mailbox->FlushAll = false;
+    Mailbox->Shared = false;
+    TicketUnlockIRQRestore(&Mailbox->Lock, Flags);
+
+    // Interrupts go off again so that LoadAddressSpace can't run underneath us.
+    Flags = DisableInterrupts();
+    Invalidate(Core, Space, Pages, Count, FlushAll, Shared);
+    RestoreInterrupts(Flags);
+
+    __atomic_store_n(&Mailbox->Completed, Requested, __ATOMIC_RELEASE);
+}
+
+/**
+ * Merge a batch into another core's mailbox.
+ * @return The request number to wait for.
+ */
+static size_t PostToMailbox(size_t Core, address_space_t* Space, tlb_batch_t* Batch) {
+    tlb_mailbox_t* Mailbox = &Mailboxes[Core];
+
+    size_t Flags = TicketLockIRQSave(&Mailbox->Lock);
+
+    if (!Mailbox->Posted)
+        Mailbox->Space = Space;
+    else if (Mailbox->Space != Space) {
+        Mailbox->Space = nullptr;
+        Mailbox->FlushAll = true;
+    }
+    Mailbox->Posted = true;
+    Mailbox->Shared |= Batch->Shared;
+
+    if (Batch->FlushAll || Mailbox->Count + Batch->Count > TLB_BATCH_PAGES)
+        Mailbox->FlushAll = true;
+    else
+        for (size_t i = 0; i < Batch->Count; i++)
+            Mailbox->Pages[Mailbox->Count++] = Batch->Pages[i];
+
+    size_t Ticket = ++Mailbox->Requested;
+    TicketUnlockIRQRestore(&Mailbox->Lock, Flags);
+
+    return Ticket;
+}
+
+static void CheckFeatures() {
+    uint32_t Eax = 1, Ebx, Ecx = 0, Edx;
+    __asm__ __volatile__("cpuid" : "+a"(Eax), "=b"(Ebx), "+c"(Ecx), "=d"(Edx));
+    PCIDEnabled = Ecx & (1 << 17);
+    GlobalPagesEnabled = Edx & (1 << 13);
+
+    Eax = 7; Ecx = 0;
+    __asm__ __volatile__("cpuid" : "+a"(Eax), "=b"(Ebx), "+c"(Ecx), "=d"(Edx));
+    INVPCIDSupported = PCIDEnabled && (Ebx & (1 << 10));
+
+    FeaturesChecked = true;
+    SerialPrintf("[  Mem] TLB: PCID %s, INVPCID %s, global pages %s.\r\n", PCIDEnabled ? "on" : "off",
+                 INVPCIDSupported ? "on" : "off", GlobalPagesEnabled ? "on" : "off");
+}
+
+static size_t FindSlot(tlb_context_t* Context, address_space_t* Space) {
+    for (size_t i = 0; i < PCID_SLOTS; i++)
+        if (Context->Slots[i].Owner == Space)
+            return i;
+    return PCID_SLOTS;
+}
+
+/**
+ * Free up a PCID slot on this core, taking it away from whichever address space had it.
+ */
+static size_t ClaimSlot(size_t Core, tlb_context_t* Context) {
+    size_t Slot = Context->NextVictim;
+    if (Slot == Context->Slot)
+        Slot = (Slot + 1) % PCID_SLOTS;
+    Context->NextVictim = (Slot + 1) % PCID_SLOTS;
+
+    address_space_t* Owner = Context->Slots[Slot].Owner;
+    if (Owner != nullptr && Owner != Context->Loaded)
+        __atomic_fetch_and(&Owner->ActiveCores, ~(1ull << Core), __ATOMIC_SEQ_CST);
+
+    Context->Slots[Slot].Owner = nullptr;
+    Context->Slots[Slot].Stale = false;
+    return Slot;
+}
+
+/**
+ * @param Tagged Whether to use a PCID. Without one, the load flushes everything that isn't global.
+ */
+static void SwitchTo(size_t Core, address_space_t* Next, bool Tagged) {
+    tlb_context_t* Context = &Contexts[Core];
+    address_space_t* Previous = Context->Loaded;
+    size_t Slot = PCID_SLOTS;
+    size_t CR3 = PhysicalTables(Next);
+
+    if (Previous == Next)
+        return;
+
+    // Join the bitmap before the tables go live, and leave the old one only afterwards,
+    //  so that a shootdown can never miss a core that might still hold its translations.
+    __atomic_fetch_or(&Next->ActiveCores, 1ull << Core, __ATOMIC_SEQ_CST);
+
+    if (Tagged) {
+        Slot = FindSlot(Context, Next);
+        if (Slot == PCID_SLOTS) {
+            Slot = ClaimSlot(Core, Context);
+            Context->Slots[Slot].Owner = Next;
+        } else if (!Context->Slots[Slot].Stale)
+            CR3 |= CR3_NOFLUSH;
+
+        Context->Slots[Slot].Stale = false;
+        CR3 |= Slot + 1;
+    }
+
+    WriteControlRegister(3, CR3);
+    Context->Loaded = Next;
+    Context->Slot = Slot;
+
+    if (Previous != nullptr && FindSlot(Context, Previous) == PCID_SLOTS)
+        __atomic_fetch_and(&Previous->ActiveCores, ~(1ull << Core), __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Prepare the calling core's TLB handling, and mark it as able to take shootdown IPIs.
+ * Until it is, it is assumed to have nothing in its TLB worth invalidating.
+ *
+ * Turns on global pages and PCIDs where the processor has them. CR3 must not have a PCID in it yet.
+ * @param Current The address space the core is running in, or null if it's on tables of its own.
+ */
+void TLBCoreOnline(address_space_t* Current) {
+    size_t Core = GetCurrentCoreID();
+    if (Core >= Constants::Core::MAX_CORES)
+        return;
+
+    if (!FeaturesChecked)
+        CheckFeatures();
+
+    size_t CR4 = ReadControlRegister(4);
+    if (GlobalPagesEnabled)
+        CR4 |= CR4_PGE;
+    if (PCIDEnabled)
+        CR4 |= CR4_PCIDE;
+    WriteControlRegister(4, CR4);
+
+    Contexts[Core].Loaded = Current;
+    Contexts[Core].Slot = PCID_SLOTS;
+    if (Current != nullptr)
+        __atomic_fetch_or(&Current->ActiveCores, 1ull << Core, __ATOMIC_SEQ_CST);
+
+    __atomic_fetch_or(&OnlineCores, 1ull << Core, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Switch this core over to a new address space, keeping its PCID if it still has one.
+ */
+void LoadAddressSpace(address_space_t* Next) {
+    size_t Core = GetCurrentCoreID();
+
+    if (Core >= Constants::Core::MAX_CORES) {
+        WriteControlRegister(3, PhysicalTables(Next));
+        return;
+    }
+
+    size_t Flags = DisableInterrupts();
+    SwitchTo(Core, Next, PCIDEnabled);
+    RestoreInterrupts(Flags);
+}
+
+/**
+ * Invalidate a batch of changes to an address space on every core that might have them cached,
+ *  and wait until they all have. The batch is empty afterwards.
+ */
+void FlushTLBBatch(address_space_t* AddressSpace, tlb_batch_t* Batch) {
+    size_t Tickets[Constants::Core::MAX_CORES];
+
+    if (Batch->Count == 0 && !Batch->FlushAll)
+        return;
+
+    size_t Self = GetCurrentCoreID();
+    size_t Online = __atomic_load_n(&OnlineCores, __ATOMIC_ACQUIRE);
+    size_t Targets = __atomic_load_n(&AddressSpace->ActiveCores, __ATOMIC_ACQUIRE);
+
+    if (Batch->Shared || AddressSpace == &KernelAddressSpace)
+        Targets |= Online;
+    Targets &= Online;
+
+    // Always flush here. Before TLBCoreOnline we aren't in any bitmap, but we are still the one using these tables.
+    if (Self < Constants::Core::MAX_CORES) {
+        size_t Flags = DisableInterrupts();
+        Invalidate(Self, AddressSpace, Batch->Pages, Batch->Count, Batch->FlushAll, Batch->Shared);
+        RestoreInterrupts(Flags);
+
+        Targets &= ~(1ull << Self);
+    }
+
+    if (Targets != 0) {
+        for (size_t Core = 0; Core < Constants::Core::MAX_CORES; Core++) {
+            if (!(Targets & (1ull << Core)))
+                continue;
+
+            Tickets[Core] = PostToMailbox(Core, AddressSpace, Batch);
+            Device::APIC::driver->SendInterCoreInterrupt(Core, TLB_SHOOTDOWN_VECTOR);
+        }
+
+        for (size_t Core = 0; Core < Constants::Core::MAX_CORES; Core++) {
+            if (!(Targets & (1ull << Core)))
+                continue;
+
+            while (__atomic_load_n(&Mailboxes[Core].Completed, __ATOMIC_ACQUIRE) < Tickets[Core]) {
+                if (Self < Constants::Core::MAX_CORES)
+                    ServiceMailbox(Self);
+                PAUSE;
+            }
+        }
+    }
+
+    Batch->Count = 0;
+    Batch->FlushAll = false;
+    Batch->Shared = false;
+}
+
+/**
+ * Called from the TLB_SHOOTDOWN_VECTOR handler.
+ */
+void TLBShootdownInterrupt() {
+    size_t Core = GetCurrentCoreID();
+    if (Core < Constants::Core::MAX_CORES)
+        ServiceMailbox(Core);
+}
+
+#ifdef CHROMA_SWITCH_BENCHMARK
+
+#define BENCHMARK_ROUNDS    10000
+#define BENCHMARK_PAGES     64                          // Pages touched after every switch.
+#define BENCHMARK_BASE      0x0000004000000000ull       // Somewhere in the lower half that nothing else uses.
+
+/**
+ * A throwaway address space with the kernel's higher half, and the working set mapped at BENCHMARK_BASE.
+ * It is never freed, since this core may still hold a PCID for it afterwards.
+ */
+static address_space_t* BenchmarkSpace(size_t Frames) {
+    address_space_t* Space = new address_space_t { NEW_TICKETLOCK(), 0, 0 };
+    size_t* Kernel = (size_t*) TO_DIRECT(PhysicalTables(&KernelAddressSpace));
+
+    Space->PML4 = (size_t*) TO_DIRECT(PhysAllocateZeroMem(PAGE_SIZE));
+    for (size_t i = 256; i < 512; i++)
+        Space->PML4[i] = Kernel[i];
+
+    MapVirtualRange(Space, Frames, BENCHMARK_BASE, BENCHMARK_PAGES * PAGE_SIZE, 0x3, nullptr);
+    return Space;
+}
+
+/**
+ * Bounce between two address spaces, touching the working set after each switch.
+ * @return The average cycles per switch. The quickest goes in Best.
+ */
+static size_t RunSwitches(size_t Core, address_space_t* First, address_space_t* Second, bool Tagged, size_t* Best) {
+    size_t Total = 0;
+    *Best = (size_t) -1;
+
+    for (size_t Round = 0; Round < BENCHMARK_ROUNDS; Round++) {
+        size_t Start = ReadTimeStampCounter();
+
+        SwitchTo(Core, (Round & 1) ? First : Second, Tagged);
+        for (size_t i = 0; i < BENCHMARK_PAGES; i++)
+            (void) *(volatile size_t*) (BENCHMARK_BASE + i * PAGE_SIZE + (i * 64) % PAGE_SIZE);
+
+        size_t Elapsed = ReadTimeStampCounter() - Start;
+        Total += Elapsed;
+        if (Elapsed < *Best)
+            *Best = Elapsed;
+    }
+
+    return Total / BENCHMARK_ROUNDS;
+}
+
+/**
+ * Measure what a context switch costs once the TLB has to be refilled, with and without PCIDs.
+ * Under QEMU, both halves of the comparison need a CPU model with PCID, eg. -cpu max or -cpu host with KVM.
+ */
+void TLBSwitchBenchmark() {
+    size_t Core = GetCurrentCoreID();
+    size_t Frames = (size_t) PhysAllocateZeroMem(BENCHMARK_PAGES * PAGE_SIZE);
+    address_space_t* First = BenchmarkSpace(Frames);
+    address_space_t* Second = BenchmarkSpace(Frames);
+    size_t UntaggedBest, TaggedBest = 0, Tagged = 0;
+
+    size_t Flags = DisableInterrupts();
+    address_space_t* Original = Contexts[Core].Loaded;
+
+    size_t Untagged = RunSwitches(Core, First, Second, false, &UntaggedBest);
+    if (PCIDEnabled)
+        Tagged = RunSwitches(Core, First, Second, true, &TaggedBest);
+
+    SwitchTo(Core, Original != nullptr ? Original : &KernelAddressSpace, PCIDEnabled);
+    RestoreInterrupts(Flags);
+
+    SerialPrintf("[  Mem] Switch benchmark: %u rounds, touching %u pages after each switch.\r\n", BENCHMARK_ROUNDS,
+                 BENCHMARK_PAGES);
+    SerialPrintf("[  Mem] Flushing CR3 write: %u cycles on average, %u at best.\r\n", Untagged, UntaggedBest);
+    if (PCIDEnabled)
+        SerialPrintf("[  Mem] PCID CR3 write: %u cycles on average, %u at best.\r\n", Tagged, TaggedBest);
+    else
+        SerialPrintf("[  Mem] This processor has no PCIDs to compare against.\r\n");
+}
+
+#else
+
+void TLBSwitchBenchmark() {
+    SerialPrintf("[  Mem] The switch benchmark is not built in. Configure with -DCHROMA_SWITCH_BENCHMARK=ON.\r\n");
+}
+
+#endif
@@ -0,0 +1,309 @@
+#include <kernel/chroma.h>
+#include <kernel/system/process/process.h>
+
+/************************
+ *** Team Kitty, 2021 ***
+ ***     Chroma       ***
+ ***********************/
+
+/* This file contains the scheduler benchmark.
+ * It starts BENCHMARK_THREADS kernel threads, all pinned to the calling core at the most urgent realtime priority, and:
+ *  - has them yield to each other in turn, to time a whole yield: the interrupt, the scheduler, and the switch;
+ *  - times every SwitchContext, and every scheduler pass that switches, while they run;
+ *  - has them sleep to tick deadlines, and measures how late each one is running again;
+ *  - then bounces messages between two more, to time a round trip, and how fast small messages and page transfers go one way.
+ *
+ * Results go to serial, one "[BENCH] name key=value ..." line each, between "[BENCH] begin" and "[BENCH] end",
+ *  so that tools/sched_bench.sh can pick them out of a QEMU log and compare them against limits.
+ */
+
+#ifdef CHROMA_SCHED_BENCHMARK
+
+#define BENCHMARK_THREADS   4
+#define BENCHMARK_YIELDS    2000    // Per thread.
+#define BENCHMARK_SLEEPS    50      // Per thread.
+// Wakeup latency buckets, in powers of two microseconds. The last takes everything longer.
+#define HISTOGRAM_BUCKETS   20
+
+#define PINGPONG_ROUNDS     2000
+#define STREAM_MESSAGES     20000   // Of MESSAGE_INLINE bytes each.
+#define PAGE_MESSAGES       2000
+#define PAGE_MESSAGE_SIZE   (4 * PAGE_SIZE)
+
+// What the ping and pong threads send each other.
+enum {
+    MESSAGE_PING,       // Sent straight back.
+    MESSAGE_STREAM,     // Counted.
+    MESSAGE_TRANSFER,   // Pages; touched, then freed.
+    MESSAGE_SYNC,       // Answered once everything sent before it has been dealt with.
+    MESSAGE_STOP
+};
+
+typedef struct {
+    size_t Count;
+    size_t Total;
+    size_t Min;
+    size_t Max;
+} bench_stat_t;
+
+static volatile bool Recording = false;
+static size_t BenchmarkCore = 0;
+
+static bench_stat_t SwitchCost;
+static bench_stat_t ScheduleCost;
+static bench_stat_t WakeLatency;
+static size_t Histogram[HISTOGRAM_BUCKETS];
+
+static bench_stat_t RoundTrip;
+static size_t StreamCycles;
+static size_t TransferCycles;
+static volatile size_t PongPID = 0;
+static volatile bool MessagesDone = false;
+
+static volatile size_t YieldStart = 0;
+static volatile size_t YieldEnd = 0;
+static volatile size_t YieldsDone = 0;
+static volatile size_t Finished = 0;
+
+static void Record(bench_stat_t* Stat, size_t Value) {
+    if (Stat->Count == 0 || Value < Stat->Min)
+        Stat->Min = Value;
+    if (Value > Stat->Max)
+        Stat->Max = Value;
+    Stat->Total += Value;
+    Stat->Count++;
+}
+
+static void Print(const char* Name, bench_stat_t* Stat) {
+    SerialPrintf("[BENCH] %s avg=%u min=%u max=%u count=%u\r\n", Name, Stat->Count ? Stat->Total / Stat->Count : 0,
+                 Stat->Min, Stat->Max, Stat->Count);
+}
+
+static size_t CyclesToMicroseconds(size_t Cycles) {
+    size_t Frequency = GetTSCFrequency();
+    return Frequency == 0 ? 0 : Cycles * 1000 / Frequency;
+}
+
+void BenchmarkRecordSwitch(size_t CoreID, size_t SwitchCycles, size_t ScheduleCycles) {
+    if (!Recording || CoreID != BenchmarkCore)
+        return;
+
+    Record(&SwitchCost, SwitchCycles);
+    Record(&ScheduleCost, ScheduleCycles);
+}
+
+static void BenchmarkThread() {
+    size_t Expected = 0;
+    __atomic_compare_exchange_n(&YieldStart, &Expected, ReadTimeStampCounter(), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+    for (size_t i = 0; i < BENCHMARK_YIELDS; i++)
+        ProcessManager::yield();
+
+    if (__atomic_add_fetch(&YieldsDone, 1, __ATOMIC_SEQ_CST) == BENCHMARK_THREADS)
+        YieldEnd = ReadTimeStampCounter();
+
+    // Keep the phases apart, so that nobody is still yielding while the others sleep.
+    while (YieldsDone < BENCHMARK_THREADS)
+        ProcessManager::yield();
+
+    for (size_t i = 0; i < BENCHMARK_SLEEPS; i++) {
+        size_t Deadline = GetTicks() + 1 + i % 3;
+        ProcessManager::SleepUntil(Deadline);
+        size_t Late = CyclesToMicroseconds(ReadTimeStampCounter() - GetTickTSC(Deadline));
+
+        size_t Bucket = 0;
+        while (Bucket < HISTOGRAM_BUCKETS - 1 && Late >= (1ull << Bucket))
+            Bucket++;
+
+        size_t Flags = DisableInterrupts();
+        Record(&WakeLatency, Late);
+        Histogram[Bucket]++;
+        RestoreInterrupts(Flags);
+    }
+
+    __atomic_add_fetch(&Finished, 1, __ATOMIC_SEQ_CST);
+}
+
+static void Send(size_t PID, uint32_t Type, const void* Data, size_t Length) {
+    while (!ProcessManager::SendMessage(PID, Type, Data, Length))
+        ProcessManager::yield();
+}
+
+static void PongThread() {
+    Process::ProcessMessage Message;
+
+    while (true) {
+        ProcessManager::ReceiveMessage(&Message);
+
+        switch (Message.Type) {
+            case MESSAGE_PING:
+            case MESSAGE_SYNC:
+                Send(Message.Source, Message.Type, Message.Inline, Message.Length);
+                break;
+            case MESSAGE_TRANSFER:
+                for (size_t i = 0; i < Message.Length; i += PAGE_SIZE)
+                    ((volatile uint8_t*) Message.Content)[i];
+                ProcessManager::FreeMessagePages((void*) Message.Content, Message.Length);
+                break;
+            case MESSAGE_STOP:
+                return;
+            default:
+                break;
+        }
+    }
+}
+
+// Wait for the pong thread to get through everything sent so far.
+static void Sync() {
+    Process::ProcessMessage Reply;
+    Send(PongPID, MESSAGE_SYNC, nullptr, 0);
+    do
+        ProcessManager::ReceiveMessage(&Reply);
+    while (Reply.Type != MESSAGE_SYNC);
+}
+
+static void PingThread() {
+    Process::ProcessMessage Reply;
+
+    for (size_t i = 0; i < PINGPONG_ROUNDS; i++) {
+        size_t Start = ReadTimeStampCounter();
+        Send(PongPID, MESSAGE_PING, &i, sizeof(i));
+        ProcessManager::ReceiveMessage(&Reply);
+        Record(&RoundTrip, ReadTimeStampCounter() - Start);
+    }
+
+    uint8_t Payload[MESSAGE_INLINE];
+    memset(Payload, 0x5A, sizeof(Payload));
+
+    size_t Start = ReadTimeStampCounter();
+    for (size_t i = 0; i < STREAM_MESSAGES; i++)
+        Send(PongPID, MESSAGE_STREAM, Payload, sizeof(Payload));
+    Sync();
+    StreamCycles = ReadTimeStampCounter() - Start;
+
+    Start = ReadTimeStampCounter();
+    for (size_t i = 0; i < PAGE_MESSAGES; i++) {
+        uint8_t* Pages = (uint8_t*) ProcessManager::AllocateMessagePages(PAGE_MESSAGE_SIZE);
+        for (size_t Offset = 0; Offset < PAGE_MESSAGE_SIZE; Offset += PAGE_SIZE)
+            Pages[Offset] = (uint8_t) i;
+
+        while (!ProcessManager::SendPages(PongPID, MESSAGE_TRANSFER, Pages, PAGE_MESSAGE_SIZE))
+            ProcessManager::yield();
+    }
+    Sync();
+    TransferCycles = ReadTimeStampCounter() - Start;
+
+    Send(PongPID, MESSAGE_STOP, nullptr, 0);
+    MessagesDone = true;
+}
+
+static void PrintThroughput(const char* Name, size_t Messages, size_t Bytes, size_t Cycles) {
+    size_t Frequency = GetTSCFrequency();
+    if (Cycles == 0)
+        Cycles = 1;
+
+    // The TSC frequency is in kHz, so bytes times that over cycles is bytes a millisecond: kilobytes a second.
+    SerialPrintf("[BENCH] %s messages=%u bytes=%u cycles_per_message=%u kb_per_s=%u\r\n", Name, Messages, Bytes,
+                 Cycles / Messages, Bytes * Frequency / Cycles);
+}
+
+/**
+ * Both threads are realtime and pinned to this core, so every round trip is two blocking receives and two wakeups.
+ */
+static void MessageBenchmark(size_t CoreID) {
+    memset(&RoundTrip, 0, sizeof(RoundTrip));
+    StreamCycles = TransferCycles = 0;
+    MessagesDone = false;
+
+    Process* Pong = ProcessManager::instance->CreateProcess(PongThread, false, "pong", false, CoreID);
+    Process* Ping = ProcessManager::instance->CreateProcess(PingThread, false, "ping", false, CoreID);
+    if (Pong == nullptr || Ping == nullptr) {
+        SerialPrintf("[BENCH] error could not create the message threads\r\n");
+        return;
+    }
+
+    PongPID = Pong->GetPID();
+
+    size_t Flags = DisableInterrupts();
+    Process* Threads[] = { Pong, Ping };
+    for (Process* Target : Threads) {
+        Target->SetAffinity(1ull << CoreID);
+        Target->SetScheduling(Process::CLASS_REALTIME, 0);
+        Target->SetState(Process::PROCESS_WAITING);
+    }
+    RestoreInterrupts(Flags);
+
+    while (!MessagesDone)
+        ProcessManager::Sleep(10);
+
+    Print("ipc_roundtrip", &RoundTrip);
+    PrintThroughput("ipc_inline", STREAM_MESSAGES, STREAM_MESSAGES * MESSAGE_INLINE, StreamCycles);
+    PrintThroughput("ipc_pages", PAGE_MESSAGES, PAGE_MESSAGES * PAGE_MESSAGE_SIZE, TransferCycles);
+}
+
+void SchedulerBenchmark() {
+    size_t CoreID = GetCurrentCoreID();
+
+    memset(&SwitchCost, 0, sizeof(SwitchCost));
+    memset(&ScheduleCost, 0, sizeof(ScheduleCost));
+    memset(&WakeLatency, 0, sizeof(WakeLatency));
+    memset(Histogram, 0, sizeof(Histogram));
+    YieldStart = YieldEnd = YieldsDone = Finished = 0;
+
+    SerialPrintf("[BENCH] begin threads=%u yields=%u sleeps=%u tick_hz=%u tsc_khz=%u\r\n", BENCHMARK_THREADS,
+                 BENCHMARK_YIELDS, BENCHMARK_SLEEPS, CHROMA_TICK_HZ, GetTSCFrequency());
+
+    BenchmarkCore = CoreID;
+    Recording = true;
+
+    Process* Threads[BENCHMARK_THREADS] = {};
+    for (size_t i = 0; i < BENCHMARK_THREADS; i++) {
+        Threads[i] = ProcessManager::instance->CreateProcess(BenchmarkThread, false, "bench", false, CoreID);
+        if (Threads[i] == nullptr) {
+            SerialPrintf("[BENCH] error could not create thread %u\r\n", i);
+            break;
+        }
+
+        Threads[i]->SetAffinity(1ull << CoreID);
+        Threads[i]->SetScheduling(Process::CLASS_REALTIME, 0);
+    }
+
+    // The first one to be queued takes the core from us, so queue them all before it can.
+    size_t Flags = DisableInterrupts();
+    for (size_t i = 0; i < BENCHMARK_THREADS && Threads[i] != nullptr; i++)
+        Threads[i]->SetState(Process::PROCESS_WAITING);
+    RestoreInterrupts(Flags);
+
+    while (Finished < BENCHMARK_THREADS)
+        ProcessManager::Sleep(10);
+
+    Recording = false;
+
+    SerialPrintf("[BENCH] yield cycles=%u count=%u\r\n", (YieldEnd - YieldStart) / (BENCHMARK_THREADS * BENCHMARK_YIELDS),
+                 BENCHMARK_THREADS * BENCHMARK_YIELDS);
+    Print("switch_context", &SwitchCost);
+    Print("scheduler", &ScheduleCost);
+    Print("wakeup_us", &WakeLatency);
+
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (Histogram[i] == 0)
+            continue;
+
+        if (i == HISTOGRAM_BUCKETS - 1)
+            SerialPrintf("[BENCH] wakeup_hist ge_us=%u count=%u\r\n", 1ull << (i - 1), Histogram[i]);
+        else
+            SerialPrintf("[BENCH] wakeup_hist lt_us=%u count=%u\r\n", 1ull << i, Histogram[i]);
+    }
+
+    MessageBenchmark(CoreID);
+
+    SerialPrintf("[BENCH] end\r\n");
+}
+
+#else
+
+void SchedulerBenchmark() {
+    SerialPrintf("[BENCH] The scheduler benchmark is not built in. Configure with -DCHROMA_SCHED_BENCHMARK=ON.\r\n");
+}
+
+#endif
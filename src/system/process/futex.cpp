@@ -0,0 +1,124 @@
+#include <kernel/chroma.h>
+#include <kernel/system/process/process.h>
+#include <kernel/system/process/futex.h>
+
+/************************
+ *** Team Kitty, 2021 ***
+ ***     Chroma       ***
+ ***********************/
+
+/* This file contains futexes, and the mutex, semaphore and condition variable built on them.
+ * A futex is only an address. Waiters are kept in a fixed table of wait queues, picked by hashing the address,
+ *  so any 32-bit word can be waited on without setting anything up first. Unrelated addresses can share a queue;
+ *  each waiter is keyed by its address, and only woken by a wake on that address.
+ *
+ * The mutex is the classic three-state futex lock, with a spin in front of the sleep.
+ */
+
+#define FUTEX_BUCKET_BITS   6
+#define FUTEX_BUCKETS       (1 << FUTEX_BUCKET_BITS)
+
+static WaitQueue FutexQueues[FUTEX_BUCKETS];
+
+static WaitQueue* QueueFor(volatile uint32_t* Address) {
+    size_t Hash = ((size_t) Address >> 2) * 0x9E3779B97F4A7C15;
+    return &FutexQueues[Hash >> (64 - FUTEX_BUCKET_BITS)];
+}
+
+bool FutexWait(volatile uint32_t* Address, uint32_t Expected) {
+    return QueueFor(Address)->WaitIfEqual(Address, Expected);
+}
+
+size_t FutexWake(volatile uint32_t* Address, size_t Count) {
+    return QueueFor(Address)->WakeAddress(Address, Count);
+}
+
+static inline uint32_t CompareExchange(volatile uint32_t* Address, uint32_t Expected, uint32_t Desired) {
+    __atomic_compare_exchange_n(Address, &Expected, Desired, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    return Expected;
+}
+
+bool Mutex::TryLock() {
+    if (CompareExchange(&State, 0, 1) != 0)
+        return false;
+
+    Owner = Process::Current();
+    return true;
+}
+
+/**
+ * Spinning only pays while the holder is running, since nothing else is going to let go of it.
+ * The holder is read without a lock, so it may have moved on by the time it's looked at; that only costs a wasted spin or an early sleep.
+ * Once asleep, the state is always set to 2 on the way in, so that whoever unlocks knows to wake somebody.
+ */
+void Mutex::Lock() {
+    for (size_t i = 0; i < MUTEX_SPINS; i++) {
+        uint32_t Seen = __atomic_load_n(&State, __ATOMIC_RELAXED);
+        if (Seen == 0 && CompareExchange(&State, 0, 1) == 0) {
+            Owner = Process::Current();
+            return;
+        }
+
+        Process* Holder = Owner;
+        if (Seen == 2 || (Holder != nullptr && !Holder->IsOnCore()))
+            break;
+
+        PAUSE;
+    }
+
+    while (__atomic_exchange_n(&State, 2, __ATOMIC_ACQUIRE) != 0)
+        FutexWait(&State, 2);
+
+    Owner = Process::Current();
+}
+
+void Mutex::Unlock() {
+    Owner = nullptr;
+    if (__atomic_exchange_n(&State, 0, __ATOMIC_RELEASE) == 2)
+        FutexWake(&State, 1);
+}
+
+bool Semaphore::TryWait() {
+    uint32_t Seen = __atomic_load_n(&Count, __ATOMIC_RELAXED);
+    while (Seen != 0) {
+        if (__atomic_compare_exchange_n(&Count, &Seen, Seen - 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * A waiter counts itself before it checks the count for the last time, and a poster bumps the count before it checks for waiters,
+ *  so at least one of them sees the other.
+ */
+void Semaphore::Wait() {
+    while (!TryWait()) {
+        __atomic_add_fetch(&Waiters, 1, __ATOMIC_SEQ_CST);
+        FutexWait(&Count, 0);
+        __atomic_sub_fetch(&Waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void Semaphore::Post() {
+    __atomic_add_fetch(&Count, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&Waiters, __ATOMIC_SEQ_CST) != 0)
+        FutexWake(&Count, 1);
+}
+
+void ConditionVariable::Wait(Mutex* Lock) {
+    uint32_t Seen = __atomic_load_n(&Sequence, __ATOMIC_SEQ_CST);
+
+    Lock->Unlock();
+    FutexWait(&Sequence, Seen);
+    Lock->Lock();
+}
+
+void ConditionVariable::Signal() {
+    __atomic_add_fetch(&Sequence, 1, __ATOMIC_SEQ_CST);
+    FutexWake(&Sequence, 1);
+}
+
+void ConditionVariable::Broadcast() {
+    __atomic_add_fetch(&Sequence, 1, __ATOMIC_SEQ_CST);
+    FutexWake(&Sequence, FUTEX_WAKE_ALL);
+}
@@ -0,0 +1,143 @@
+#include <kernel/chroma.h>
+#include <kernel/system/process/process.h>
+
+/************************
+ *** Team Kitty, 2021 ***
+ ***     Chroma       ***
+ ***********************/
+
+/* This file contains message passing between processes.
+ * Small messages are copied straight into a slot of the receiver's mailbox, so sending one costs a copy of at most
+ *  MESSAGE_INLINE bytes and no lock, plus a wakeup.
+ *
+ * Anything bigger goes as pages. Every process shares the kernel's half of the address space, so the pages don't
+ *  have to be remapped to be seen by the receiver: the message carries their address, and ownership goes with it.
+ *  The data itself is never copied, and no mapping changes, so there's no TLB shootdown either.
+ */
+
+Mailbox::Mailbox() : Head(0), Tail(0), Arrivals() {
+    for (size_t i = 0; i < MAILBOX_SLOTS; i++)
+        Slots[i].Sequence = i;
+}
+
+bool Mailbox::Post(size_t Source, uint32_t Type, uint32_t Flags, const void* Data, size_t Length, size_t Content) {
+    size_t Position = __atomic_load_n(&Head, __ATOMIC_RELAXED);
+    Process::ProcessMessage* Slot;
+
+    while (true) {
+        Slot = &Slots[Position & (MAILBOX_SLOTS - 1)];
+        size_t Sequence = __atomic_load_n(&Slot->Sequence, __ATOMIC_ACQUIRE);
+
+        if (Sequence == Position) {
+            if (__atomic_compare_exchange_n(&Head, &Position, Position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (Sequence < Position) {
+            // The owner hasn't taken the message from the last pass yet.
+            return false;
+        } else {
+            Position = __atomic_load_n(&Head, __ATOMIC_RELAXED);
+        }
+    }
+
+    Slot->Source = Source;
+    Slot->Type = Type;
+    Slot->Flags = Flags;
+    Slot->Length = Length;
+    Slot->Content = Content;
+    if (Data != nullptr)
+        memcpy(Slot->Inline, Data, Length);
+
+    __atomic_store_n(&Slot->Sequence, Position + 1, __ATOMIC_RELEASE);
+
+    Arrivals.WakeOne();
+    return true;
+}
+
+bool Mailbox::TryTake(Process::ProcessMessage* Message) {
+    Process::ProcessMessage* Slot = &Slots[Tail & (MAILBOX_SLOTS - 1)];
+    if (__atomic_load_n(&Slot->Sequence, __ATOMIC_ACQUIRE) != Tail + 1)
+        return false;
+
+    Message->Source = Slot->Source;
+    Message->Type = Slot->Type;
+    Message->Flags = Slot->Flags;
+    Message->Length = Slot->Length;
+    Message->Content = Slot->Content;
+    if (!(Slot->Flags & MESSAGE_PAGES))
+        memcpy(Message->Inline, Slot->Inline, Slot->Length);
+
+    __atomic_store_n(&Slot->Sequence, Tail + MAILBOX_SLOTS, __ATOMIC_RELEASE);
+    Tail++;
+    return true;
+}
+
+void Mailbox::Take(Process::ProcessMessage* Message) {
+    Arrivals.WaitFor([&]() { return TryTake(Message); });
+}
+
+void Mailbox::Discard() {
+    Process::ProcessMessage Message;
+    while (TryTake(&Message)) {
+        if (Message.Flags & MESSAGE_PAGES)
+            ProcessManager::FreeMessagePages((void*) Message.Content, Message.Length);
+    }
+}
+
+void Process::InitMessages() {
+    if (Messages == nullptr)
+        Messages = new Mailbox();
+}
+
+/**
+ * The post happens with the process table locked, so the receiver can't be reaped, and its mailbox freed, partway through.
+ */
+bool ProcessManager::SendMessage(size_t PID, uint32_t Type, const void* Data, size_t Length) {
+    if (Length > MESSAGE_INLINE)
+        return false;
+
+    Process* Current = Process::Current();
+    size_t Source = Current ? Current->GetPID() : 0;
+
+    return ProcessTable::WithPID(PID, [&](Process* Target) {
+        return Target->GetMailbox() != nullptr && Target->GetMailbox()->Post(Source, Type, 0, Data, Length, 0);
+    });
+}
+
+bool ProcessManager::SendPages(size_t PID, uint32_t Type, void* Pages, size_t Length) {
+    Process* Current = Process::Current();
+    size_t Source = Current ? Current->GetPID() : 0;
+
+    return ProcessTable::WithPID(PID, [&](Process* Target) {
+        return Target->GetMailbox() != nullptr &&
+               Target->GetMailbox()->Post(Source, Type, MESSAGE_PAGES, nullptr, Length, (size_t) Pages);
+    });
+}
+
+bool ProcessManager::PollMessage(Process::ProcessMessage* Message) {
+    Process* Current = Process::Current();
+    if (Current == nullptr || Current->GetMailbox() == nullptr)
+        return false;
+
+    return Current->GetMailbox()->TryTake(Message);
+}
+
+void ProcessManager::ReceiveMessage(Process::ProcessMessage* Message) {
+    Process* Current = Process::Current();
+    if (Current == nullptr || Current->GetMailbox() == nullptr) {
+        SerialPrintf("[ PROC] A process without a mailbox tried to receive a message.\r\n");
+        Kill(-1);
+    }
+
+    Current->GetMailbox()->Take(Message);
+}
+
+/**
+ * Whole pages straight from the physical allocator, the same as the heap's large allocations, so any kernel thread can reach them.
+ */
+void* ProcessManager::AllocateMessagePages(size_t Length) {
+    return (void*) PhysAllocateMem(AlignUpwards(Length, PAGE_SIZE));
+}
+
+void ProcessManager::FreeMessagePages(void* Pages, size_t Length) {
+    PhysFreeMem((directptr_t) Pages, AlignUpwards(Length, PAGE_SIZE));
+}
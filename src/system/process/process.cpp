@@ -1,5 +1,6 @@
 #include <kernel/chroma.h>
 #include <kernel/system/process/process.h>
+#include <kernel/system/trace.h>
 #include "driver/io/apic.h"
 
 /************************
@@ -16,10 +17,8 @@ struct DeadProcessData {
 // Details on dead processes.
 lainlib::vector<DeadProcessData> deadProcesses;
 
-// An array of pointers to the header of each active process.
-Process** processes;
 // An array of pointers to the header of each process active on the current core.
-Process* processesPerCore[MAX_CORES];
+Process* processesPerCore[Constants::Core::MAX_CORES];
 
 ProcessManager* ProcessManager::instance;
 
@@ -27,26 +26,31 @@ ProcessManager* ProcessManager::instance;
 // Positive values mean the process is being locked by another, zero and negative means it is active.
 int locked = 0;
 
-// Counts how many process are slated to be killed.
-// These will be cleaned up by a reaper thread in the background.
-int dying = 0;
+// Processes that have been killed, linked through DeadNext, for the reaper thread to clean up in the background.
+// The reaper blocks on ReaperQueue while there are none.
+static Process* dead = nullptr;
+static ticketlock_t deadlock;
+static WaitQueue ReaperQueue;
 
 // Used in HandleRequest for load balancing if requested.
 size_t lastSelectedCPU = 0;
 
-// Whether the current process is fully loaded into memory and ready to run.
-bool loaded = false;
-
-// A ticketlock that prevents two threads being created at the same time.
-ticketlock_t creatorlock;
 // A ticketlock that prevents two threads from being switched into at the same time.
 ticketlock_t switcherlock;
 
 // The PID of the next process to be created. The kernel is always 0.
 size_t nextPID = 1;
 
-// A counter used in scheduling.
-size_t lastProcess = 0;
+// Where each core's idle loop (its boot context) keeps its stack pointer while a process runs.
+static size_t IdleContexts[Constants::Core::MAX_CORES];
+// The process each core has just switched away from, for whatever runs next to finish with.
+static Process* SwitchedOut[Constants::Core::MAX_CORES];
+
+#ifdef CHROMA_SCHED_BENCHMARK
+// When each core last entered the scheduler, and SwitchContext.
+static size_t ScheduleStarted[Constants::Core::MAX_CORES];
+static size_t SwitchStarted[Constants::Core::MAX_CORES];
+#endif
 
 Process* Process::Current() {
     return processesPerCore[Device::APIC::driver->GetCurrentCore()];
@@ -69,110 +73,195 @@ bool isLocked() {
 }
 
 [[noreturn]] void NullProcess() {
-    __asm__("cli");
-    for(;;) {
-        ProcessManager::yield();
+    ProcessManager::Idle();
+}
+
+/**
+ * Where every new process starts, on its own stack, in the middle of the scheduler interrupt that switched to it.
+ */
+[[noreturn]] static void ThreadStart() {
+    ProcessManager::instance->FinishSwitch();
+    __asm__ __volatile__("sti");
+
+    reinterpret_cast<function_t>(Process::Current()->GetEntry())();
+
+    ProcessManager::Kill(0);
+}
+
+/**
+ * Halts with interrupts enabled, so the core sleeps until its timer, a device or another core wakes it.
+ * The check for work and the HLT happen with interrupts disabled, and STI only takes effect after the instruction that follows it,
+ *  so a wakeup can't arrive between deciding to halt and halting.
+ */
+void ProcessManager::Idle() {
+    size_t CoreID = GetCurrentCoreID();
+
+    for (;;) {
+        __asm__ __volatile__("cli");
+        RunQueue::SetIdle(CoreID, true);
+
+        if (RunQueue::WorkAvailable(CoreID)) {
+            RunQueue::SetIdle(CoreID, false);
+            __asm__ __volatile__("sti");
+            yield();
+            continue;
+        }
+
+        __asm__ __volatile__("sti; hlt");
+        RunQueue::SetIdle(CoreID, false);
     }
 }
 
 void Process::Destroy() {
+    TimerCancel(&SleepTimer);
+    if (WaitingOn != nullptr)
+        WaitingOn->Remove(this);
+    Core::FreeExtraRegisters(Header.SSE);
+    Header.SSE = nullptr;
+    FreeKernelStack(Header.Stack);
+    Header.Stack = nullptr;
+    if (Messages != nullptr) {
+        Messages->Discard();
+        delete Messages;
+        Messages = nullptr;
+    }
     SetActive(false);
     SetState(PROCESS_AVAILABLE);
 }
 
-[[noreturn]] void Reaper() {
-    __asm__("cli");
+/**
+ * Only the first kill of a process buries it; killing it again does nothing.
+ */
+void ProcessManager::Bury(Process* Target) {
+    size_t Flags = TicketLockIRQSave(&deadlock);
+
+    bool First = Target->GetState() != Process::PROCESS_REAP;
+    Target->Kill();
+    if (First) {
+        Target->DeadNext = dead;
+        dead = Target;
+    }
 
-    while (true) {
-        while (dying == 0) {
-            // TODO: waitFor(100);
-        }
+    TicketUnlockIRQRestore(&deadlock, Flags);
 
-        for(size_t i = 0; i < MAX_PROCESSES; i++) {
-            if ((loaded && i == 0) || processes[i] == nullptr)
-                continue;
-
-            TicketAttemptLock(&creatorlock);
-            lockProcess();
-
-            if(processes[i]->GetState() == Process::PROCESS_REAP) {
-                SerialPrintf("[ PROC] Killing Process %u (%s)\r\n", i, processes[i]->GetName());
-                processes[i]->Destroy();
-                delete processes[i];
-                processes[i] = nullptr;
-                dying--;
-                TicketUnlock(&creatorlock);
-            }
-            unlockProcess();
+    if (First)
+        ReaperQueue.WakeOne();
+}
+
+/**
+ * A process that killed itself may still be switching away, and on its own stack. It's put back for next time.
+ */
+bool ProcessManager::ReapDead() {
+    size_t Flags = TicketLockIRQSave(&deadlock);
+    Process* List = dead;
+    dead = nullptr;
+    TicketUnlockIRQRestore(&deadlock, Flags);
+
+    Process* Busy = nullptr;
+    while (List != nullptr) {
+        Process* Target = List;
+        List = Target->DeadNext;
+
+        if (Target->IsOnCore()) {
+            Target->DeadNext = Busy;
+            Busy = Target;
+            continue;
         }
 
-        // TODO: waitFor(100);
+        SerialPrintf("[ PROC] Killing Process %u (%s), which used %u of %u bytes of stack\r\n", Target->GetKPID(),
+                     Target->GetName(), Target->GetStackHighWater(), Target->GetHeader()->StackSize);
+
+        ProcessTable::Remove(Target);
+
+        Target->Destroy();
+        delete Target;
+    }
+
+    if (Busy == nullptr)
+        return false;
+
+    Flags = TicketLockIRQSave(&deadlock);
+    Process* Last = Busy;
+    while (Last->DeadNext != nullptr)
+        Last = Last->DeadNext;
+    Last->DeadNext = dead;
+    dead = Busy;
+    TicketUnlockIRQRestore(&deadlock, Flags);
+
+    return true;
+}
+
+/**
+ * Sleeps on ReaperQueue until something is killed, so it costs nothing while nothing dies.
+ */
+[[noreturn]] void Reaper() {
+    while (true) {
+        ReaperQueue.WaitFor([] { return __atomic_load_n(&dead, __ATOMIC_ACQUIRE) != nullptr; });
+
+        // Give anything still switching away a tick to finish.
+        if (ProcessManager::ReapDead())
+            ProcessManager::Sleep(1);
     }
 }
 
 void ProcessManager::InitKernelProcess(function_t EntryPoint) {
     SerialPrintf("[ PROC] Initializing process manager\r\n");
 
-    processes = reinterpret_cast<Process**>(kmalloc(sizeof(Process*) * MAX_PROCESSES * PAGE_SIZE));
+    ProcessTable::Init();
     Process::SetCurrent(nullptr);
 
-    for (size_t i = 0; i < MAX_PROCESSES; i++) {
-        processes[i] = nullptr;
-    }
-
     SerialPrintf("[ PROC] Creating system processes\r\n");
-    CreateProcess(NullProcess, true, "testproc", false);
+    Process* Null = CreateProcess(NullProcess, false, "testproc", false);
     CreateProcess(EntryPoint, true, "kernel", false);
-    CreateProcess(Reaper, true, "reaper", false);
-
-    loaded = true;
-    unlockProcess();
-    locked = 0;
-
-}
+    Process* Reap = CreateProcess(Reaper, false, "reaper", false);
+    // The tracer only runs when nothing else wants to.
+    Process* Tracer = CreateProcess(TraceThread, false, "tracer", false);
+
+    // The reaper has to get its turn even under load, but it can wait.
+    if (Reap != nullptr) {
+        Reap->SetScheduling(Process::CLASS_FAIR, PRIORITY_LEVELS - 1);
+        Reap->SetState(Process::PROCESS_WAITING);
+    }
 
-int64_t findFreeProcessSlot() {
-    for (size_t i = lastProcess; i < MAX_PROCESSES; i++) {
-        if ((loaded && i == 0) || processes[i] != nullptr)
+    Process* Background[] = { Null, Tracer };
+    for (Process* Target : Background) {
+        if (Target == nullptr)
             continue;
-        if (processes[i] == nullptr) {
-            lastProcess = i + 1;
-            return i;
-        }
+        Target->SetScheduling(Process::CLASS_IDLE, PRIORITY_DEFAULT);
+        Target->SetState(Process::PROCESS_WAITING);
     }
 
-    if (lastProcess == 0)
-        return -1;
-    else {
-        lastProcess = 0;
-        return findFreeProcessSlot();
-    }
+    unlockProcess();
+    locked = 0;
+
 }
 
 Process* ProcessManager::CreateProcessInternal(const char* name, function_t entry, bool userspace) {
-    int64_t toAdd = findFreeProcessSlot();
+    int64_t toAdd = ProcessTable::Reserve();
     if (toAdd == -1) {
         SerialPrintf("[ PROC] Unable to create new process %s; OUT_OF_SLOTS\r\n", name);
         return nullptr;
     }
-    SerialPrintf("[ PROC] New process: %u, name %s, %s userspace\r\n", nextPID, name, userspace ? "is" : "is not");
 
-    processes[toAdd] = new Process(name, toAdd, nextPID++, (size_t) entry, userspace);
-    processes[toAdd]->SetState(Process::PROCESS_NOT_STARTED);
-    return processes[toAdd];
+    size_t PID = __atomic_fetch_add(&nextPID, 1, __ATOMIC_RELAXED);
+    SerialPrintf("[ PROC] New process: %u, name %s, %s userspace\r\n", PID, name, userspace ? "is" : "is not");
+
+    Process* Created = new Process(name, toAdd, PID, (size_t) entry, userspace);
+    Created->SetState(Process::PROCESS_NOT_STARTED);
+    ProcessTable::Insert(Created);
+    return Created;
 }
 
 
 void ProcessManager::InitProcessPagetable(Process* proc, bool Userspace) {
     if (Userspace)
-        proc->GetHeader()->AddressSpace = new address_space_t { NEW_TICKETLOCK(), 0 };
+        proc->GetHeader()->AddressSpace = new address_space_t { NEW_TICKETLOCK(), 0, 0 };
     else
         proc->GetHeader()->AddressSpace = Core::GetCore(Device::APIC::driver->GetCurrentCore())->AddressSpace;
 }
 
 void ProcessManager::InitProcessArch(Process* proc) {
-    UNUSED(proc);
-    // TODO
+    proc->GetHeader()->SSE = Core::AllocateExtraRegisters();
 }
 
 void ProcessManager::InitProcessData(Process* proc, const char* name, bool userspace, char**argv, size_t argc, function_t entry) {
@@ -182,10 +271,30 @@ void ProcessManager::InitProcessData(Process* proc, const char* name, bool users
     UNUSED(entry);
 
     InitProcessPagetable(proc, userspace);
-    // TODO: Stack, VFS
+    InitProcessStack(proc);
+    proc->InitMessages();
+    // TODO: VFS
     InitProcessArch(proc);
 }
 
+/**
+ * The stack is laid out as if the process had called SwitchStacks: six zeroed registers, then ThreadStart to return into.
+ * Above that is a zero return address, so that ThreadStart sees the stack alignment a call would give it, and stack traces end there.
+ */
+void ProcessManager::InitProcessStack(Process* proc) {
+    Process::ProcessHeader* Header = proc->GetHeader();
+    Header->StackSize = PROCESS_STACK;
+    Header->Stack = (uint8_t*) AllocateKernelStack();
+
+    size_t* Top = (size_t*) (((size_t) Header->Stack + PROCESS_STACK) & ~(size_t) 15);
+    *--Top = 0;
+    *--Top = (size_t) ThreadStart;
+    for (size_t i = 0; i < 6; i++)
+        *--Top = 0;
+
+    Header->RSP = (size_t) Top;
+}
+
 
 Process* ProcessManager::CreateProcess(function_t EntryPoint, bool StartImmediately, const char* Name, bool Userspace, size_t TargetCore, size_t argc, char** argv) {
     Process* toAdd = CreateProcessInternal(Name, EntryPoint, Userspace);
@@ -200,96 +309,158 @@ Process* ProcessManager::CreateProcess(function_t EntryPoint, bool StartImmediat
     InitProcessData(toAdd, Name, Userspace, argv, argc, EntryPoint);
     toAdd->SetParent(toAdd->GetPID());
 
-    if (StartImmediately || Process::Current() == nullptr) {
+    if (StartImmediately)
         toAdd->SetState(Process::PROCESS_WAITING);
-        Process::SetCurrent(toAdd);
-    }
 
     return toAdd;
 }
 
-Process* ProcessManager::GetNextToRun(size_t Current) {
+Process* ProcessManager::GetNextToRun(bool Yield) {
     if (locked)
         return Process::Current();
 
     size_t CoreID = Device::APIC::driver->GetCurrentCore();
-    for (size_t i = Current + 1; i < MAX_PROCESSES; i++) {
-        if (processes[i] != nullptr && processes[i]->CanRun(CoreID))
-            return processes[i];
-    }
+    RunQueue* Queue = RunQueue::ForCore(CoreID);
+
+    // The current process isn't queued while it runs. Let it carry on unless something waiting should replace it.
+    Process* Current = Process::Current();
+    bool CurrentRunnable = Current != nullptr && Current->GetState() == Process::PROCESS_RUNNING &&
+                           Current->GetCore() == CoreID && !Current->IsSleeping();
+
+    Process* Next = Queue != nullptr ? Queue->Dequeue(CurrentRunnable ? Current : nullptr, Yield) : nullptr;
+    if (Next != nullptr)
+        return Next;
 
-    // If there's no open slots AFTER this process, check from the start.
-    if (Current != 0)
-        return GetNextToRun(0);
+    if (CurrentRunnable)
+        return Current;
 
-    // If we get here, there's no slots AND we're 0. No processes left.
-    SerialPrintf("[ PROC] Scheduler Error!\r\n[ PROC] Core %u has no work to do.\r\n[ PROC] Last task was %s\r\n", Process::Current()->GetName());
+    // Nothing of our own to do, so take something from whoever has the most.
+    Next = RunQueue::Steal(CoreID);
+    if (Next != nullptr)
+        return Next;
 
-    for(;;) {}
+    // Nothing anywhere. If there's a current process, it can't continue: it's asleep or dying, so the core goes back to idling.
     return nullptr;
 }
 
-size_t ProcessManager::SchedulerInterrupt(INTERRUPT_FRAME* CurrentFrame, bool ForceSwitch) {
+size_t ProcessManager::SchedulerInterrupt(INTERRUPT_FRAME* CurrentFrame, bool ForceSwitch, bool Yield) {
 
-    SerialPrintf("[ PROC] Scheduler called\r\n");
+    Process* Current = Process::Current();
+    Trace(TRACE_SCHEDULE, Current != nullptr ? Current->GetPID() : TRACE_IDLE, ForceSwitch);
 
-    if (locked)
-        return (size_t) CurrentFrame;
+    size_t CoreID = GetCurrentCoreID();
 
-    if (ForceSwitch) {
-        for (size_t i = 1; i < MAX_PROCESSES; i++) {
-            if (processes[i] != nullptr && processes[i]->IsSleeping()) {
-                processes[i]->DecreaseSleep(1);
-            }
-        }
+#ifdef CHROMA_SCHED_BENCHMARK
+    ScheduleStarted[CoreID] = ReadTimeStampCounter();
+#endif
 
-        NotifyAllCores();
-    }
+    // Whatever this core was doing, it isn't idle while it's in here.
+    RunQueue::SetIdle(CoreID, false);
 
-    Process* i;
-    if (Process::Current() == nullptr)
-        i = GetNextToRun(0);
-    else
-        i = GetNextToRun(Process::Current()->GetKPID());
+    RunQueue* Queue = RunQueue::ForCore(CoreID);
+    if (Queue != nullptr)
+        Queue->Account(Current);
+
+    if (!locked) {
+        if (ForceSwitch)
+            NotifyAllCores();
+
+        // Null means the idle loop: either it's running now, or the current process is going back to it.
+        Process* i = GetNextToRun(ForceSwitch || Yield);
+        if (i != Process::Current())
+            return SwitchContext(CurrentFrame, i);
+    }
 
-    if (i == 0)
-        return (size_t) CurrentFrame;
+    // Only ask for the end of this slice if something is waiting for it; otherwise the core sleeps until its next timer.
+    ProgramNextTimer(Queue != nullptr && Queue->Size() != 0);
 
-    return SwitchContext(CurrentFrame, i);
+    return (size_t) CurrentFrame;
 }
 
 Process* Process::FromName(const char* name) {
-    for (size_t i = 0; i < MAX_PROCESSES; i++) {
-        if (processes[i] != nullptr) {
-            if (strcmp((char*) name, processes[i]->GetName()))
-                return processes[i];
-        }
-    }
-
-    return nullptr;
+    return ProcessTable::FromName(name);
 }
 
 Process* Process::FromPID(size_t PID) {
-    for (size_t i = 0; i < MAX_PROCESSES; i++) {
-        if (processes[i] != nullptr) {
-            if (processes[i]->GetPID() == PID)
-                return processes[i];
-        }
-    }
+    return ProcessTable::FromPID(PID);
+}
 
-    return nullptr;
+void Process::Rename(const char* NewName) {
+    ProcessTable::Rename(this, NewName);
+}
+
+static void WakeSleeper(void* Argument) {
+    reinterpret_cast<Process*>(Argument)->Wake();
 }
 
+/**
+ * The timer goes on the wheel of the core doing the sleeping, so it wakes on the core that will run it.
+ */
+void Process::SleepUntil(size_t Deadline) {
+    Sleeping = 1;
+    Requeue();
+    TimerArm(&SleepTimer, Deadline, WakeSleeper, this);
+}
+
+void Process::Block() {
+    Sleeping = 1;
+    Requeue();
+}
+
+void Process::Wake() {
+    Trace(TRACE_WAKE, GetPID(), 0);
+    TimerCancel(&SleepTimer);
+    Sleeping = 0;
+    Requeue();
+}
+
+bool ProcessManager::SetScheduling(size_t PID, Process::SchedulingClass Class, uint8_t Priority) {
+    Process* Target = Process::FromPID(PID);
+    if (Target == nullptr)
+        return false;
+
+    Target->SetScheduling(Class, Priority);
+    return true;
+}
+
+/**
+ * The scheduler switches away until the timer wakes the process.
+ * If it can't, because the process lock is held, the process halts in place and tries again.
+ */
 void ProcessManager::Sleep(size_t Count) {
+    SleepUntil(GetTicks() + MillisecondsToTicks(Count));
+}
+
+void ProcessManager::SleepUntil(size_t Deadline) {
+    Process* Current = Process::Current();
+    if (Current == nullptr)
+        return;
+
     lockProcess();
-    Process::Current()->IncreaseSleep(Count);
+    Current->SleepUntil(Deadline);
     unlockProcess();
-    yield();
+
+    WaitForWake(Current);
+}
+
+void ProcessManager::WaitForWake(Process* Current) {
+    while (Current->IsSleeping()) {
+        yield();
+
+        size_t Flags = DisableInterrupts();
+        if (Current->IsSleeping())
+            __asm__ __volatile__("sti; hlt");
+        RestoreInterrupts(Flags);
+    }
 }
 
 void ProcessManager::Sleep(size_t Count, size_t PID) {
+    Process* Target = Process::FromPID(PID);
+    if (Target == nullptr)
+        return;
+
     lockProcess();
-    Process::FromPID(PID)->IncreaseSleep(Count);
+    Target->SleepUntil(GetTicks() + MillisecondsToTicks(Count));
     unlockProcess();
 }
 
@@ -301,10 +472,7 @@ void ProcessManager::Kill(size_t PID, int Code) {
         return;
     }
 
-    lockProcess();
-    target->Kill();
-    dying++;
-    unlockProcess();
+    Bury(target);
 }
 
 [[noreturn]] void ProcessManager::Kill(int Code) {
@@ -313,15 +481,16 @@ void ProcessManager::Kill(size_t PID, int Code) {
 
     DeadProcessData data = { Process::Current()->GetPID(), 1, (uint32_t) Code };
     deadProcesses.emplace_back(data);
-    Process::Current()->Kill();
-    dying++;
     unlockProcess();
+    Bury(Process::Current());
 
     __asm__ __volatile__("sti");
 
     // Wait until we're reaped
-    while (true)
+    while (true) {
         yield();
+        __asm__ __volatile__("hlt");
+    }
 }
 
 void ProcessManager::NotifyAllCores() {
@@ -334,9 +503,7 @@ void ProcessManager::NotifyAllCores() {
 }
 
 void ProcessManager::MapThreadMemory(Process* proc, size_t from, size_t to, size_t length) {
-    for (size_t i = 0; i < length; i++) {
-        MapVirtualPage(proc->GetHeader()->AddressSpace, from + (i * PAGE_SIZE), to + (i * PAGE_SIZE), 3);
-    }
+    MapVirtualRange(proc->GetHeader()->AddressSpace, from, to, length * PAGE_SIZE, 3, nullptr);
 }
 
 void ProcessManager::GetStatus(size_t PID, int* ReturnVal, size_t* StatusVal) {
@@ -356,38 +523,86 @@ void ProcessManager::GetStatus(size_t PID, int* ReturnVal, size_t* StatusVal) {
 void ProcessManager::SwitchContextInternal(Process* next) {
     // TODO: set TSS Stack
 
-    Core::GetCore(Device::APIC::driver->GetCurrentCore())->AddressSpace = next->GetHeader()->AddressSpace;
-    WriteControlRegister(3, FROM_DIRECT((size_t)next->GetHeader()->AddressSpace->PML4));
+    Core* Current = Core::GetCore(Device::APIC::driver->GetCurrentCore());
+    LoadAddressSpace(next->GetHeader()->AddressSpace);
+    Current->AddressSpace = next->GetHeader()->AddressSpace;
 }
 
+/**
+ * The process being switched away from stays PROCESS_RUNNING, out of every run queue, until the switch is over.
+ * Another core can't pick it up before its registers are saved; FinishSwitch puts it back, from whatever runs next.
+ */
 size_t ProcessManager::SwitchContext(INTERRUPT_FRAME* frame, Process* NextProcess) {
-    if (locked)
+    if (locked) {
+        // It was claimed from a run queue to be switched to. Put it back.
+        if (NextProcess != nullptr && NextProcess != Process::Current())
+            NextProcess->SetState(Process::PROCESS_WAITING);
         return (size_t) frame;
+    }
+
+    size_t CoreID = GetCurrentCoreID();
+    Core* CurrentCore = Core::GetCore(CoreID);
+    Process* Previous = Process::Current();
+
+#ifdef CHROMA_SCHED_BENCHMARK
+    SwitchStarted[CoreID] = ReadTimeStampCounter();
+#endif
 
-    if (NextProcess == nullptr)
+    if (NextProcess == Previous)
         return (size_t) frame;
 
-    if (Process::Current() != nullptr) {
-        if (Process::Current()->GetState() != Process::PROCESS_REAP) {
-            Process::Current()->SetState(Process::PROCESS_WAITING);
-            Process::Current()->GetHeader()->RSP = (size_t) frame;
-            Process::Current()->GetHeader()->ContextFrame = *frame;
-            // TODO: Save SSE Context
-        }
+    size_t* SaveTo = &IdleContexts[CoreID];
+    if (Previous != nullptr) {
+        SaveTo = &Previous->GetHeader()->RSP;
+        CurrentCore->SaveExtraRegisters(Previous->GetHeader()->SSE);
     }
 
-    NextProcess->SetState(Process::PROCESS_RUNNING);
-    SerialPrintf("[ PROC] Switching to process %u (%s)\r\n", NextProcess->GetPID(), NextProcess->GetName());
+    SwitchedOut[CoreID] = Previous;
     Process::SetCurrent(NextProcess);
-    *frame = Process::Current()->GetHeader()->ContextFrame;
 
-    // TODO: Load SSE context
+    RunQueue* Queue = RunQueue::ForCore(CoreID);
+    if (Queue != nullptr)
+        Queue->SetRunning(NextProcess);
+
+    CurrentCore->LoadExtraRegisters(NextProcess != nullptr ? NextProcess->GetHeader()->SSE : nullptr);
+
+    size_t NextRSP = IdleContexts[CoreID];
+    if (NextProcess != nullptr) {
+        NextProcess->SetState(Process::PROCESS_RUNNING);
+        __atomic_store_n(&NextProcess->OnCore, true, __ATOMIC_RELAXED);
 
-    // TODO: New process has 0 mappings, so triple faults.
-    // TODO: copy page tables?
-    SwitchContextInternal(NextProcess);
+        SwitchContextInternal(NextProcess);
+        NextRSP = NextProcess->GetHeader()->RSP;
+    }
+
+    Trace(TRACE_SWITCH, Previous != nullptr ? Previous->GetPID() : TRACE_IDLE,
+          NextProcess != nullptr ? NextProcess->GetPID() : TRACE_IDLE);
+    SwitchStacks(SaveTo, NextRSP);
+
+    // Some time later, this process (or idle loop) has been switched back to, maybe on another core.
+    FinishSwitch();
+    return (size_t) frame;
+}
+
+void ProcessManager::FinishSwitch() {
+    size_t CoreID = GetCurrentCoreID();
+
+#ifdef CHROMA_SCHED_BENCHMARK
+    size_t Now = ReadTimeStampCounter();
+    BenchmarkRecordSwitch(CoreID, Now - SwitchStarted[CoreID], Now - ScheduleStarted[CoreID]);
+#endif
+    Process* Previous = SwitchedOut[CoreID];
+    SwitchedOut[CoreID] = nullptr;
+
+    if (Previous != nullptr) {
+        // Let go of it before it's requeued. Once it's back in a queue, another core may take it and set OnCore itself.
+        __atomic_store_n(&Previous->OnCore, false, __ATOMIC_RELEASE);
+        if (Previous->GetState() == Process::PROCESS_RUNNING)
+            Previous->SetState(Process::PROCESS_WAITING);
+    }
 
-    return NextProcess->GetHeader()->RSP;
+    RunQueue* Queue = RunQueue::ForCore(CoreID);
+    ProgramNextTimer(Queue != nullptr && Queue->Size() != 0);
 }
 
 void* Process::AllocateProcessSpace(size_t Bytes) {
@@ -0,0 +1,434 @@
+#include <kernel/chroma.h>
+#include <kernel/system/process/process.h>
+#include <driver/io/apic.h>
+
+/************************
+ *** Team Kitty, 2021 ***
+ ***     Chroma       ***
+ ***********************/
+
+/* This file contains the per-core run queues.
+ * The scheduler used to walk the whole process table to find something to run.
+ * Now, every process that is ready to run sits in the queue of the core it is assigned to,
+ *  and a process moves in and out of it as its state changes.
+ *
+ * A core that runs out of work steals from whichever other core has the longest queue.
+ * It takes the most urgent process it is allowed to run, from the back of its list:
+ *  the front is what the owner is about to pick, and the back has waited least, so it loses least by moving.
+ *
+ * Idle cores halt, and only their own timer or an interrupt wakes them.
+ * So queueing a process wakes the core it was queued on, if that core is idle; otherwise it wakes some other idle core, to steal it.
+ * Queueing a realtime process on a core that is running anything less urgent interrupts that core, so it doesn't wait out the slice.
+ * A busy core only arms its slice timer while something is queued behind it, so the first process queued on it interrupts it too.
+ *
+ * The fair class charges each process for the cycles it runs, divided by its weight, and runs whichever has been charged least.
+ * A process that has been asleep is brought up to a tick behind the least-charged process on the queue,
+ *  so it gets the core soon, but can't bank its sleep to shut everyone else out afterwards.
+ */
+
+// How far back from the tail of each list to look for a process that may run on the thief.
+#define STEAL_SCAN 8
+
+// The weight of each fair priority. Each level gets a quarter more time than the one after it; the default gets 1024.
+static const size_t FairWeights[PRIORITY_LEVELS] = { 2500, 2000, 1600, 1280, 1024, 820, 655, 524 };
+#define FAIR_WEIGHT_DEFAULT 1024
+
+static size_t TickCycles() {
+    return GetTickTSC(1) - GetTickTSC(0);
+}
+
+static RunQueue Queues[Constants::Core::MAX_CORES];
+
+// Bit n is set while core n is halted in its idle loop.
+static volatile size_t IdleCores = 0;
+
+RunQueue* RunQueue::ForCore(size_t CoreID) {
+    return CoreID < Constants::Core::MAX_CORES ? &Queues[CoreID] : nullptr;
+}
+
+void RunQueue::Unlink(Process* Target) {
+    size_t Level = Target->QueueLevel;
+
+    if (Target->QueuePrev != nullptr)
+        Target->QueuePrev->QueueNext = Target->QueueNext;
+    else
+        Heads[Level] = Target->QueueNext;
+
+    if (Target->QueueNext != nullptr)
+        Target->QueueNext->QueuePrev = Target->QueuePrev;
+    else
+        Tails[Level] = Target->QueuePrev;
+
+    if (Heads[Level] == nullptr)
+        Occupied &= ~(1u << Level);
+
+    Target->QueueNext = Target->QueuePrev = nullptr;
+    Target->Queue = nullptr;
+    Count--;
+}
+
+/**
+ * Requeue always takes a process out of its old queue first, so one that is still in a queue is a bug somewhere.
+ */
+void RunQueue::Enqueue(Process* Target) {
+    size_t Flags = TicketLockIRQSave(&Lock);
+
+    if (Target->Queue != nullptr) {
+        TicketUnlockIRQRestore(&Lock, Flags);
+        SerialPrintf("[ PROC] Process %u is already queued; not queueing it again.\r\n", Target->GetPID());
+        return;
+    }
+
+    size_t Level = Target->GetQueueLevel();
+    Process* After = Tails[Level];
+
+    if (Level == QUEUE_LEVEL_FAIR) {
+        size_t Credit = TickCycles();
+        if (Target->VirtualRuntime + Credit < MinVirtualRuntime)
+            Target->VirtualRuntime = MinVirtualRuntime - Credit;
+
+        // Usually the newcomer has had the most, so this stops at the tail.
+        while (After != nullptr && After->VirtualRuntime > Target->VirtualRuntime)
+            After = After->QueuePrev;
+    }
+
+    Target->Queue = this;
+    Target->QueueLevel = Level;
+    Target->QueuePrev = After;
+    Target->QueueNext = After != nullptr ? After->QueueNext : Heads[Level];
+
+    if (Target->QueueNext != nullptr)
+        Target->QueueNext->QueuePrev = Target;
+    else
+        Tails[Level] = Target;
+
+    if (After != nullptr)
+        After->QueueNext = Target;
+    else
+        Heads[Level] = Target;
+
+    Occupied |= 1u << Level;
+    bool First = Count++ == 0;
+
+    TicketUnlockIRQRestore(&Lock, Flags);
+
+    // The kick goes first: once WakeIdleCore has claimed an idle owner, it no longer looks idle.
+    if (First)
+        Kick(this - Queues);
+    else
+        Preempt(this - Queues, Level);
+
+    WakeIdleCore(this - Queues);
+}
+
+void RunQueue::WakeIdleCore(size_t Owner) {
+    size_t Idle = __atomic_load_n(&IdleCores, __ATOMIC_ACQUIRE);
+    if (Idle == 0 || Device::APIC::driver == nullptr || !Device::APIC::driver->IsReady())
+        return;
+
+    size_t Self = GetCurrentCoreID();
+    Idle &= ~(1ull << Self);
+
+    size_t Target;
+    if (Idle & (1ull << Owner))
+        Target = Owner;
+    else if (Owner == Self || Idle == 0)
+        return;     // Either we'll get to it ourselves, or nobody is free to.
+    else
+        Target = __builtin_ctzll(Idle);
+
+    // Queues are indexed by local APIC ID. Only one wakeup per idle period; the core sets its bit again when it next halts.
+    if (__atomic_fetch_and(&IdleCores, ~(1ull << Target), __ATOMIC_ACQ_REL) & (1ull << Target))
+        Device::APIC::driver->SendInterCoreInterrupt(Target, RESCHEDULE_VECTOR);
+}
+
+void RunQueue::Preempt(size_t Owner, uint8_t Level) {
+    uint8_t Running = Queues[Owner].Running;
+
+    // Idle cores are WakeIdleCore's business. Fair processes wait for the end of the slice.
+    if (Level >= QUEUE_LEVEL_FAIR || Level >= Running || Running == QUEUE_LEVELS)
+        return;
+
+    if (Device::APIC::driver == nullptr || !Device::APIC::driver->IsReady())
+        return;
+
+    // This works on our own core too: the interrupt arrives as soon as interrupts are enabled.
+    Device::APIC::driver->SendInterCoreInterrupt(Owner, RESCHEDULE_VECTOR);
+}
+
+/**
+ * The owner's scheduler pass arms the slice timer now that its queue isn't empty, and preempts for a realtime arrival.
+ */
+void RunQueue::Kick(size_t Owner) {
+    // Idle cores are WakeIdleCore's business.
+    if (__atomic_load_n(&IdleCores, __ATOMIC_ACQUIRE) & (1ull << Owner))
+        return;
+
+    if (Device::APIC::driver == nullptr || !Device::APIC::driver->IsReady())
+        return;
+
+    Device::APIC::driver->SendInterCoreInterrupt(Owner, RESCHEDULE_VECTOR);
+}
+
+void RunQueue::SetIdle(size_t CoreID, bool Idle) {
+    if (CoreID >= Constants::Core::MAX_CORES)
+        return;
+
+    if (Idle)
+        __atomic_fetch_or(&IdleCores, 1ull << CoreID, __ATOMIC_ACQ_REL);
+    else
+        __atomic_fetch_and(&IdleCores, ~(1ull << CoreID), __ATOMIC_ACQ_REL);
+}
+
+void RunQueue::Remove(Process* Target) {
+    size_t Flags = TicketLockIRQSave(&Lock);
+
+    if (Target->Queue == this)
+        Unlink(Target);
+
+    TicketUnlockIRQRestore(&Lock, Flags);
+}
+
+bool RunQueue::ShouldPreempt(Process* Current, Process* Next, bool Yield) {
+    uint8_t Mine = Current->GetQueueLevel();
+    if (Next->QueueLevel != Mine)
+        return Next->QueueLevel < Mine;
+
+    if (Yield)
+        return true;
+
+    // Half a tick of slack, so that two fair processes take turns by the tick rather than fighting over every interrupt.
+    if (Mine == QUEUE_LEVEL_FAIR)
+        return Next->VirtualRuntime + TickCycles() / 2 < Current->VirtualRuntime;
+
+    // Idle processes take turns by the tick. Realtime ones keep the core until they give it up.
+    return Mine == QUEUE_LEVEL_IDLE;
+}
+
+void RunQueue::Account(Process* Current) {
+    if (Current == nullptr)
+        return;
+
+    size_t Now = ReadTimeStampCounter();
+    size_t Delta = Now - Current->RunStarted;
+    Current->RunStarted = Now;
+
+    if (Current->Class != Process::CLASS_FAIR)
+        return;
+
+    Current->VirtualRuntime += Delta * FAIR_WEIGHT_DEFAULT / FairWeights[Current->Priority];
+
+    size_t Flags = TicketLockIRQSave(&Lock);
+
+    size_t Least = Current->VirtualRuntime;
+    Process* Head = Heads[QUEUE_LEVEL_FAIR];
+    if (Head != nullptr && Head->VirtualRuntime < Least)
+        Least = Head->VirtualRuntime;
+
+    if (Least > MinVirtualRuntime)
+        MinVirtualRuntime = Least;
+
+    TicketUnlockIRQRestore(&Lock, Flags);
+}
+
+void RunQueue::SetRunning(Process* Next) {
+    Running = Next != nullptr ? Next->GetQueueLevel() : QUEUE_LEVELS;
+    if (Next != nullptr)
+        Next->RunStarted = ReadTimeStampCounter();
+}
+
+Process* RunQueue::Peek() {
+    size_t Flags = TicketLockIRQSave(&Lock);
+
+    Process* Next = Occupied == 0 ? nullptr : Heads[__builtin_ctz(Occupied)];
+
+    TicketUnlockIRQRestore(&Lock, Flags);
+    return Next;
+}
+
+/**
+ * Take a process out to run it. Called with the queue's lock held, and the process' RequeueLock.
+ * Marking it running is what stops a wakeup on another core from queueing it again before the switch.
+ */
+void RunQueue::Claim(Process* Target) {
+    Unlink(Target);
+    Target->State = Process::PROCESS_RUNNING;
+}
+
+/**
+ * Requeue takes a process' lock before the queue's, so it can only be tried here.
+ * If someone is requeueing the process right now, back off and let them finish before looking again.
+ */
+Process* RunQueue::Dequeue(Process* Current, bool Yield) {
+    while (true) {
+        size_t Flags = TicketLockIRQSave(&Lock);
+
+        Process* Next = Occupied == 0 ? nullptr : Heads[__builtin_ctz(Occupied)];
+        if (Next != nullptr && Current != nullptr && !ShouldPreempt(Current, Next, Yield))
+            Next = nullptr;
+
+        if (Next == nullptr) {
+            TicketUnlockIRQRestore(&Lock, Flags);
+            return nullptr;
+        }
+
+        if (TicketAttemptLock(&Next->RequeueLock)) {
+            Claim(Next);
+            TicketUnlock(&Next->RequeueLock);
+            TicketUnlockIRQRestore(&Lock, Flags);
+            return Next;
+        }
+
+        TicketUnlockIRQRestore(&Lock, Flags);
+        PAUSE;
+    }
+}
+
+/**
+ * The same search as GiveUp, without taking anything.
+ */
+bool RunQueue::HasWorkFor(size_t Thief) {
+    size_t Flags = TicketLockIRQSave(&Lock);
+    bool Found = false;
+
+    for (size_t Level = 0; Level < QUEUE_LEVELS && !Found; Level++) {
+        Process* Candidate = Tails[Level];
+        for (size_t i = 0; i < STEAL_SCAN && Candidate != nullptr && !Found; i++, Candidate = Candidate->QueuePrev)
+            Found = Candidate->CanRunOn(Thief);
+    }
+
+    TicketUnlockIRQRestore(&Lock, Flags);
+    return Found;
+}
+
+Process* RunQueue::GiveUp(size_t Thief) {
+    size_t Flags = TicketLockIRQSave(&Lock);
+    Process* Taken = nullptr;
+
+    for (size_t Level = 0; Level < QUEUE_LEVELS && Taken == nullptr; Level++) {
+        if (!(Occupied & (1u << Level)))
+            continue;
+
+        Process* Candidate = Tails[Level];
+        for (size_t i = 0; i < STEAL_SCAN && Candidate != nullptr; i++, Candidate = Candidate->QueuePrev) {
+            // One that is being requeued may be on its way somewhere else; leave it be.
+            if (Candidate->CanRunOn(Thief) && TicketAttemptLock(&Candidate->RequeueLock)) {
+                Taken = Candidate;
+                break;
+            }
+        }
+    }
+
+    if (Taken != nullptr) {
+        Claim(Taken);
+        Taken->Core = Thief;
+        Stolen++;
+
+        // Keep its place relative to everyone else, not its charge: the thief's clock may be well behind ours.
+        if (Taken->Class == Process::CLASS_FAIR) {
+            size_t Lead = Taken->VirtualRuntime > MinVirtualRuntime ? Taken->VirtualRuntime - MinVirtualRuntime : 0;
+            Taken->VirtualRuntime = Queues[Thief].MinVirtualRuntime + Lead;
+        }
+
+        TicketUnlock(&Taken->RequeueLock);
+    }
+
+    TicketUnlockIRQRestore(&Lock, Flags);
+    return Taken;
+}
+
+/**
+ * The process comes back out of every queue, ready to be switched to.
+ * If the longest queue has nothing the thief may run, it doesn't try any others; it'll ask again next time.
+ */
+static RunQueue* StealVictim(size_t Thief) {
+    RunQueue* Victim = nullptr;
+    size_t Longest = 0;
+
+    for (size_t i = 0; i < Constants::Core::MAX_CORES; i++) {
+        if (i != Thief && Queues[i].Size() > Longest) {
+            Victim = &Queues[i];
+            Longest = Queues[i].Size();
+        }
+    }
+
+    return Victim;
+}
+
+Process* RunQueue::Steal(size_t Thief) {
+    if (Thief >= Constants::Core::MAX_CORES)
+        return nullptr;
+
+    RunQueue* Victim = StealVictim(Thief);
+    if (Victim == nullptr)
+        return nullptr;
+
+    Process* Taken = Victim->GiveUp(Thief);
+    if (Taken != nullptr)
+        __atomic_fetch_add(&Queues[Thief].Steals, 1, __ATOMIC_RELAXED);
+
+    return Taken;
+}
+
+/**
+ * Work pinned to other cores doesn't count, or it would keep this core spinning on a steal that can never succeed.
+ */
+bool RunQueue::WorkAvailable(size_t CoreID) {
+    if (CoreID >= Constants::Core::MAX_CORES)
+        return false;
+
+    if (Queues[CoreID].Count != 0)
+        return true;
+
+    RunQueue* Victim = StealVictim(CoreID);
+    return Victim != nullptr && Victim->HasWorkFor(CoreID);
+}
+
+void RunQueue::PrintStats() {
+    for (size_t i = 0; i < Constants::Core::MAX_CORES; i++) {
+        RunQueue* Queue = &Queues[i];
+        if (Queue->Count == 0 && Queue->Steals == 0 && Queue->Stolen == 0)
+            continue;
+
+        SerialPrintf("[ PROC] Core %u: %u queued, %u stolen from others, %u stolen by others\r\n", i, Queue->Count,
+                     Queue->Steals, Queue->Stolen);
+    }
+}
+
+/**
+ * A process belongs in a queue if the scheduler could pick it: the same rules as CanRun, minus the core check.
+ * The kernel's slot 0 is never queued.
+ *
+ * Wakeups, timers, the scheduler and the reaper can all requeue the same process from different cores at once,
+ *  so the whole look-then-move is done under the process' RequeueLock.
+ */
+void Process::Requeue() {
+    size_t Flags = TicketLockIRQSave(&RequeueLock);
+    RequeueLocked();
+    TicketUnlockIRQRestore(&RequeueLock, Flags);
+}
+
+void Process::RequeueLocked() {
+    bool Runnable = State == ProcessState::PROCESS_WAITING && KernelPID != 0 && !(ORS && !IsActive) && !IsSleeping();
+    RunQueue* Target = Runnable ? RunQueue::ForCore(Core) : nullptr;
+
+    // Already in the right place. Leave it, so that it keeps its turn.
+    if (Target == Queue && (Queue == nullptr || QueueLevel == GetQueueLevel()))
+        return;
+
+    if (Queue != nullptr)
+        Queue->Remove(this);
+
+    if (Target != nullptr)
+        Target->Enqueue(this);
+}
+
+/**
+ * The state is changed under the same lock, so that it can't cross with a run queue claiming the process.
+ */
+void Process::SetState(ProcessState NewState) {
+    size_t Flags = TicketLockIRQSave(&RequeueLock);
+    State = NewState;
+    RequeueLocked();
+    TicketUnlockIRQRestore(&RequeueLock, Flags);
+}
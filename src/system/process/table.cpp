@@ -0,0 +1,251 @@
+#include <kernel/chroma.h>
+#include <kernel/system/process/process.h>
+
+/************************
+ *** Team Kitty, 2021 ***
+ ***     Chroma       ***
+ ***********************/
+
+/* This file contains the process table.
+ * It used to be a fixed array of 128 pointers, searched from end to end for a free slot, a PID or a name.
+ * Now creating, finding and removing a process costs the same however many there are, apart from the odd doubling.
+ *
+ * PIDs are handed out in order, so the low bits of a PID make a fine hash on their own.
+ * Names are hashed with FNV-1a.
+ *
+ * Processes are looked up far more often than they come and go, so the table is under a reader-writer lock:
+ *  lookups on different cores don't contend with each other, only with a process being created or destroyed.
+ */
+
+static rwlock_t TableLock;
+
+static Process** Slots = nullptr;
+static size_t Capacity = 0;
+
+// A stack of the slots nobody is using.
+static size_t* FreeSlots = nullptr;
+static size_t FreeCount = 0;
+
+static Process** PIDBuckets = nullptr;
+static Process** NameBuckets = nullptr;
+static size_t BucketCount = 0;     // Always a power of two.
+
+static size_t Processes = 0;
+
+static size_t HashName(const char* Name) {
+    size_t Hash = 0xCBF29CE484222325;
+    for (; *Name != '\0'; Name++) {
+        Hash ^= (uint8_t) *Name;
+        Hash *= 0x100000001B3;
+    }
+    return Hash;
+}
+
+void ProcessTable::LinkPID(Process* Target) {
+    Process** Bucket = &PIDBuckets[Target->GetPID() & (BucketCount - 1)];
+    Target->PIDNext = *Bucket;
+    *Bucket = Target;
+}
+
+void ProcessTable::LinkName(Process* Target) {
+    Process** Bucket = &NameBuckets[HashName(Target->GetName()) & (BucketCount - 1)];
+    Target->NameNext = *Bucket;
+    *Bucket = Target;
+}
+
+void ProcessTable::UnlinkPID(Process* Target) {
+    Process** Link = &PIDBuckets[Target->GetPID() & (BucketCount - 1)];
+    while (*Link != nullptr && *Link != Target)
+        Link = &(*Link)->PIDNext;
+
+    if (*Link != nullptr)
+        *Link = Target->PIDNext;
+    Target->PIDNext = nullptr;
+}
+
+void ProcessTable::UnlinkName(Process* Target) {
+    Process** Link = &NameBuckets[HashName(Target->GetName()) & (BucketCount - 1)];
+    while (*Link != nullptr && *Link != Target)
+        Link = &(*Link)->NameNext;
+
+    if (*Link != nullptr)
+        *Link = Target->NameNext;
+    Target->NameNext = nullptr;
+}
+
+/**
+ * Double the slots, and put the new ones on the free stack, lowest on top.
+ * Allocating with the table locked is fine: the allocator never looks at processes.
+ */
+static bool GrowSlots() {
+    size_t NewCapacity = Capacity == 0 ? PROCESS_TABLE_INITIAL : Capacity * 2;
+
+    Process** NewSlots = (Process**) kmalloc(sizeof(Process*) * NewCapacity);
+    size_t* NewFree = (size_t*) kmalloc(sizeof(size_t) * NewCapacity);
+    if (NewSlots == nullptr || NewFree == nullptr) {
+        kfree(NewSlots);
+        kfree(NewFree);
+        return false;
+    }
+
+    memset(NewSlots, 0, sizeof(Process*) * NewCapacity);
+    if (Capacity != 0) {
+        memcpy(NewSlots, Slots, sizeof(Process*) * Capacity);
+        memcpy(NewFree, FreeSlots, sizeof(size_t) * FreeCount);
+    }
+
+    for (size_t i = NewCapacity; i > Capacity; i--)
+        NewFree[FreeCount++] = i - 1;
+
+    kfree(Slots);
+    kfree(FreeSlots);
+    Slots = NewSlots;
+    FreeSlots = NewFree;
+    Capacity = NewCapacity;
+    return true;
+}
+
+bool ProcessTable::GrowBuckets() {
+    size_t NewCount = BucketCount == 0 ? PROCESS_TABLE_INITIAL : BucketCount * 2;
+
+    Process** NewPID = (Process**) kmalloc(sizeof(Process*) * NewCount);
+    Process** NewName = (Process**) kmalloc(sizeof(Process*) * NewCount);
+    if (NewPID == nullptr || NewName == nullptr) {
+        kfree(NewPID);
+        kfree(NewName);
+        return false;
+    }
+
+    memset(NewPID, 0, sizeof(Process*) * NewCount);
+    memset(NewName, 0, sizeof(Process*) * NewCount);
+
+    kfree(PIDBuckets);
+    kfree(NameBuckets);
+    PIDBuckets = NewPID;
+    NameBuckets = NewName;
+    BucketCount = NewCount;
+
+    for (size_t i = 0; i < Capacity; i++) {
+        if (Slots[i] == nullptr)
+            continue;
+        LinkPID(Slots[i]);
+        LinkName(Slots[i]);
+    }
+
+    return true;
+}
+
+void ProcessTable::Init() {
+    size_t Flags = RWWriteLockIRQSave(&TableLock);
+
+    if (Capacity == 0 && (!GrowSlots() || !GrowBuckets()))
+        SerialPrintf("[ PROC] Unable to allocate the process table\r\n");
+
+    RWWriteUnlockIRQRestore(&TableLock, Flags);
+}
+
+int64_t ProcessTable::Reserve() {
+    size_t Flags = RWWriteLockIRQSave(&TableLock);
+
+    int64_t Slot = -1;
+    if (FreeCount != 0 || GrowSlots())
+        Slot = FreeSlots[--FreeCount];
+
+    RWWriteUnlockIRQRestore(&TableLock, Flags);
+    return Slot;
+}
+
+/**
+ * The indexes are allowed to fill to one process per bucket before they grow.
+ * If they can't grow, they just get slower.
+ */
+void ProcessTable::Insert(Process* Target) {
+    size_t Flags = RWWriteLockIRQSave(&TableLock);
+
+    Slots[Target->GetKPID()] = Target;
+    Processes++;
+
+    if (Processes > BucketCount && GrowBuckets()) {
+        // GrowBuckets linked it in with everything else.
+    } else {
+        LinkPID(Target);
+        LinkName(Target);
+    }
+
+    RWWriteUnlockIRQRestore(&TableLock, Flags);
+}
+
+void ProcessTable::Remove(Process* Target) {
+    size_t Flags = RWWriteLockIRQSave(&TableLock);
+
+    size_t Slot = Target->GetKPID();
+    if (Slot < Capacity && Slots[Slot] == Target) {
+        UnlinkPID(Target);
+        UnlinkName(Target);
+        Slots[Slot] = nullptr;
+        Processes--;
+
+        if (Slot != 0)
+            FreeSlots[FreeCount++] = Slot;
+    }
+
+    RWWriteUnlockIRQRestore(&TableLock, Flags);
+}
+
+size_t ProcessTable::ReadLock() {
+    return RWReadLockIRQSave(&TableLock);
+}
+
+void ProcessTable::ReadUnlock(size_t Cookie) {
+    RWReadUnlockIRQRestore(&TableLock, Cookie);
+}
+
+Process* ProcessTable::FindPID(size_t PID) {
+    Process* Found = BucketCount == 0 ? nullptr : PIDBuckets[PID & (BucketCount - 1)];
+    while (Found != nullptr && Found->GetPID() != PID)
+        Found = Found->PIDNext;
+
+    return Found;
+}
+
+/**
+ * Nothing stops the process being removed and freed as soon as this returns. Use WithPID to do anything to it.
+ */
+Process* ProcessTable::FromPID(size_t PID) {
+    size_t Cookie = RWReadLockIRQSave(&TableLock);
+    Process* Found = FindPID(PID);
+    RWReadUnlockIRQRestore(&TableLock, Cookie);
+    return Found;
+}
+
+Process* ProcessTable::FromName(const char* Name) {
+    size_t Cookie = RWReadLockIRQSave(&TableLock);
+
+    Process* Found = BucketCount == 0 ? nullptr : NameBuckets[HashName(Name) & (BucketCount - 1)];
+    while (Found != nullptr && !strcmp((char*) Name, Found->GetName()))
+        Found = Found->NameNext;
+
+    RWReadUnlockIRQRestore(&TableLock, Cookie);
+    return Found;
+}
+
+void ProcessTable::Rename(Process* Target, const char* NewName) {
+    size_t Flags = RWWriteLockIRQSave(&TableLock);
+
+    bool Indexed = Target->GetKPID() < Capacity && Slots[Target->GetKPID()] == Target;
+    if (Indexed)
+        UnlinkName(Target);
+
+    size_t Length = MIN(strlen(NewName), sizeof(Target->Name) - 1);
+    memcpy(Target->Name, NewName, Length);
+    Target->Name[Length] = '\0';
+
+    if (Indexed)
+        LinkName(Target);
+
+    RWWriteUnlockIRQRestore(&TableLock, Flags);
+}
+
+size_t ProcessTable::Count() {
+    return Processes;
+}
@@ -0,0 +1,164 @@
+#include <kernel/chroma.h>
+#include <kernel/system/process/process.h>
+
+/************************
+ *** Team Kitty, 2021 ***
+ ***     Chroma       ***
+ ***********************/
+
+/* This file contains wait queues, which let a process block until something happens, without using any CPU meanwhile.
+ * A blocked process is marked as sleeping, with no timer to wake it, so it drops out of its run queue like any sleeper.
+ * Waking it is Process::Wake, same as the timer would.
+ *
+ * The generation counter is what stops a wakeup being lost between a waiter checking its condition and blocking:
+ *  the waiter only blocks if nothing has been woken since it looked, and it looks under the same lock the wakers take.
+ *
+ * A queue can also be shared between unrelated waits, each under its own key, which is how the futex table uses it.
+ */
+
+void WaitQueue::Unlink(Process* Target) {
+    if (Target->WaitPrev != nullptr)
+        Target->WaitPrev->WaitNext = Target->WaitNext;
+    else
+        Head = Target->WaitNext;
+
+    if (Target->WaitNext != nullptr)
+        Target->WaitNext->WaitPrev = Target->WaitPrev;
+    else
+        Tail = Target->WaitPrev;
+
+    Target->WaitNext = Target->WaitPrev = nullptr;
+    Target->WaitingOn = nullptr;
+}
+
+// Must be called with the lock held.
+void WaitQueue::Enqueue(Process* Target, size_t Key) {
+    Target->WaitingOn = this;
+    Target->WaitKey = Key;
+    Target->WaitNext = nullptr;
+    Target->WaitPrev = Tail;
+    if (Tail != nullptr)
+        Tail->WaitNext = Target;
+    else
+        Head = Target;
+    Tail = Target;
+
+    Target->Block();
+}
+
+/**
+ * If a wakeup gets in between dropping the lock and switching away, the process is just marked awake again,
+ *  and WaitForWake returns without switching.
+ */
+void WaitQueue::Wait(size_t Ticket) {
+    Process* Current = Process::Current();
+
+    // The idle loop has nowhere to block to; it has to poll.
+    if (Current == nullptr) {
+        PAUSE;
+        return;
+    }
+
+    size_t Flags = TicketLockIRQSave(&Lock);
+
+    if (Generation != Ticket) {
+        TicketUnlockIRQRestore(&Lock, Flags);
+        return;
+    }
+
+    Enqueue(Current, 0);
+
+    TicketUnlockIRQRestore(&Lock, Flags);
+
+    ProcessManager::WaitForWake(Current);
+}
+
+/**
+ * The same as Wait, except that what decides whether to block is the value at the address, rather than the generation.
+ * Whoever changes the value must do it before taking the lock to wake, so one of the two always sees the other.
+ */
+bool WaitQueue::WaitIfEqual(volatile uint32_t* Address, uint32_t Expected) {
+    Process* Current = Process::Current();
+
+    if (Current == nullptr) {
+        PAUSE;
+        return false;
+    }
+
+    size_t Flags = TicketLockIRQSave(&Lock);
+
+    if (__atomic_load_n(Address, __ATOMIC_SEQ_CST) != Expected) {
+        TicketUnlockIRQRestore(&Lock, Flags);
+        return false;
+    }
+
+    Enqueue(Current, (size_t) Address);
+
+    TicketUnlockIRQRestore(&Lock, Flags);
+
+    ProcessManager::WaitForWake(Current);
+    return true;
+}
+
+/**
+ * Waiters are woken with the lock held, so that one can't be destroyed out from under us halfway through.
+ * That nests a run queue's lock inside ours; run queues never take a wait queue's lock, so that's safe.
+ */
+bool WaitQueue::WakeOne() {
+    size_t Flags = TicketLockIRQSave(&Lock);
+
+    __atomic_add_fetch(&Generation, 1, __ATOMIC_RELEASE);
+
+    Process* Woken = Head;
+    if (Woken != nullptr) {
+        Unlink(Woken);
+        Woken->Wake();
+    }
+
+    TicketUnlockIRQRestore(&Lock, Flags);
+    return Woken != nullptr;
+}
+
+void WaitQueue::WakeAll() {
+    size_t Flags = TicketLockIRQSave(&Lock);
+
+    __atomic_add_fetch(&Generation, 1, __ATOMIC_RELEASE);
+
+    while (Head != nullptr) {
+        Process* Woken = Head;
+        Unlink(Woken);
+        Woken->Wake();
+    }
+
+    TicketUnlockIRQRestore(&Lock, Flags);
+}
+
+size_t WaitQueue::WakeAddress(volatile uint32_t* Address, size_t Count) {
+    size_t Woken = 0;
+    size_t Flags = TicketLockIRQSave(&Lock);
+
+    Process* Next = Head;
+    while (Next != nullptr && Woken < Count) {
+        Process* Target = Next;
+        Next = Target->WaitNext;
+
+        if (Target->WaitKey != (size_t) Address)
+            continue;
+
+        Unlink(Target);
+        Target->Wake();
+        Woken++;
+    }
+
+    TicketUnlockIRQRestore(&Lock, Flags);
+    return Woken;
+}
+
+void WaitQueue::Remove(Process* Target) {
+    size_t Flags = TicketLockIRQSave(&Lock);
+
+    if (Target->WaitingOn == this)
+        Unlink(Target);
+
+    TicketUnlockIRQRestore(&Lock, Flags);
+}
@@ -69,6 +69,14 @@ void WriteMMIO(size_t Address, size_t Data, int Length) {
 }
 
 
+size_t ReadTimeStampCounter() {
+    size_t RegHigh = 0, RegLow = 0;
+
+    __asm__ __volatile__ ("rdtsc" : "=a" (RegLow), "=d" (RegHigh) : :);
+
+    return RegHigh << 32 | RegLow;
+}
+
 size_t ReadModelSpecificRegister(size_t MSR) {
     size_t RegHigh = 0, RegLow = 0;
 
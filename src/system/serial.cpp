@@ -1,4 +1,5 @@
 #include <kernel/chroma.h>
+#include <kernel/system/interrupts.h>
 /************************
  *** Team Kitty, 2020 ***
  ***     Chroma       ***
@@ -6,15 +7,49 @@
 
 /* This file provides functions related to the Serial port.
  * Through this file, you send and receive text and extra debugging information if available.
+ *
+ * Output is buffered. Writers copy their text into a ring and go on their way, and the UART is fed from the ring
+ *  sixteen bytes at a time: by whoever wrote last, if the transmitter is idle, and by the transmitter-empty interrupt
+ *  (IRQ 4) once InitSerialInterrupts has run. Before that, text waits in the ring until a later write finds the UART free.
+ *
+ * Any core can write at once. A writer claims a run of slots with a compare-and-swap on the head, and marks each slot
+ *  full as it fills it; the transmitter stops at the first slot that isn't full yet, so it never waits on a writer.
+ *
+ * SerialPanic stops all of that, and writes everything out directly from then on.
  */
 
 #define SERIAL_DATA(base)           (base)
 #define SERIAL_DLAB(base)           (base + 1)
+#define SERIAL_INTERRUPTS(base)     (base + 1)
 #define SERIAL_FIFO(base)           (base + 2)
+#define SERIAL_IDENTITY(base)       (base + 2)
 #define SERIAL_LINE(base)           (base + 3)
 #define SERIAL_MODEM(base)          (base + 4)
 #define SERIAL_LINE_STATUS(base)    (base + 5)
 #define COM1                        0x3F8
+#define COM1_IRQ                    4
+
+#define SERIAL_LINE_EMPTY           0x20    // The transmit FIFO has room for SERIAL_FIFO_DEPTH bytes.
+#define SERIAL_INTERRUPT_EMPTY      0x02    // Interrupt when the transmit FIFO empties.
+#define SERIAL_MODEM_OUT2           0x08    // Lets the UART's interrupt out to the interrupt controller.
+#define SERIAL_FIFO_DEPTH           16
+
+// Must be a power of two.
+#define SERIAL_BUFFER_SIZE          16384
+#define SERIAL_BUFFER_MASK          (SERIAL_BUFFER_SIZE - 1)
+// A slot holds its byte in the low half, and this bit while it's waiting to be sent.
+#define SERIAL_SLOT_FULL            0x100
+
+static volatile uint16_t Buffer[SERIAL_BUFFER_SIZE];
+static volatile size_t Head = 0;        // Slots claimed by writers, ever.
+static volatile size_t Tail = 0;        // Slots sent, ever. Only moved by whoever holds Transmitting.
+
+static volatile bool Transmitting = false;
+static volatile bool InterruptsReady = false;
+static volatile bool InterruptEnabled = false;
+static volatile bool Synchronous = false;
+
+static volatile size_t Dropped = 0;
 
 void InitSerial() {
     // Disable interrupts
@@ -36,13 +71,165 @@ int CheckSerial() {
     return ReadPort(SERIAL_LINE_STATUS(COM1), 1);
 }
 
-void WriteSerialChar(const char chr) {
-    while (!(CheckSerial() & 0x20));
+static void WriteSerialDirect(const char chr) {
+    while (!(CheckSerial() & SERIAL_LINE_EMPTY));
     WritePort(COM1, chr, 1);
 }
 
+static bool Waiting() {
+    return Buffer[__atomic_load_n(&Tail, __ATOMIC_ACQUIRE) & SERIAL_BUFFER_MASK] & SERIAL_SLOT_FULL;
+}
+
+/**
+ * Move up to a FIFO's worth of bytes from the ring into the UART, if it's ready for them.
+ * The caller must hold Transmitting.
+ */
+static void FillTransmitter() {
+    if (!(CheckSerial() & SERIAL_LINE_EMPTY))
+        return;
+
+    for (size_t i = 0; i < SERIAL_FIFO_DEPTH; i++) {
+        volatile uint16_t* Slot = &Buffer[Tail & SERIAL_BUFFER_MASK];
+        uint16_t Value = *Slot;
+        if (!(Value & SERIAL_SLOT_FULL))
+            break;
+
+        WritePort(COM1, Value & 0xFF, 1);
+        *Slot = 0;
+        __atomic_store_n(&Tail, Tail + 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void SetInterruptEnabled(bool Enabled) {
+    if (InterruptEnabled == Enabled)
+        return;
+
+    InterruptEnabled = Enabled;
+    WritePort(SERIAL_INTERRUPTS(COM1), Enabled ? SERIAL_INTERRUPT_EMPTY : 0, 1);
+}
+
+/**
+ * Feed the UART, unless someone else already is.
+ * The interrupt is left on only while there's something to send, so an idle port doesn't keep interrupting.
+ * Once the flag is dropped, look again: a writer may have given up on it just before.
+ */
+static void Transmit() {
+    do {
+        if (__atomic_exchange_n(&Transmitting, true, __ATOMIC_ACQUIRE))
+            return;
+
+        if (!Synchronous) {
+            FillTransmitter();
+            SetInterruptEnabled(InterruptsReady && Waiting());
+        }
+
+        __atomic_store_n(&Transmitting, false, __ATOMIC_RELEASE);
+    } while (!Synchronous && Waiting() && (InterruptsReady ? !InterruptEnabled : (CheckSerial() & SERIAL_LINE_EMPTY)));
+}
+
+/**
+ * Claim Length slots. Returns false if the ring doesn't have that many free.
+ */
+static bool Reserve(size_t Length, size_t* Start) {
+    size_t Current = __atomic_load_n(&Head, __ATOMIC_RELAXED);
+    do {
+        if (Current - __atomic_load_n(&Tail, __ATOMIC_ACQUIRE) + Length > SERIAL_BUFFER_SIZE)
+            return false;
+    } while (!__atomic_compare_exchange_n(&Head, &Current, Current + Length, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+    *Start = Current;
+    return true;
+}
+
+/**
+ * The ring is full, so wait on the UART directly until it isn't. Returns false if that didn't work.
+ * If another writer is feeding it - maybe the one this interrupt cut off - the text is dropped instead,
+ *  because waiting for it could be waiting forever.
+ */
+static bool MakeRoom(size_t Length) {
+    if (__atomic_exchange_n(&Transmitting, true, __ATOMIC_ACQUIRE))
+        return false;
+
+    while (Head - Tail + Length > SERIAL_BUFFER_SIZE && Waiting()) {
+        while (!(CheckSerial() & SERIAL_LINE_EMPTY));
+        FillTransmitter();
+    }
+
+    // It can still be full, if the oldest text belongs to a writer this interrupt cut off.
+    bool Room = Head - Tail + Length <= SERIAL_BUFFER_SIZE;
+    __atomic_store_n(&Transmitting, false, __ATOMIC_RELEASE);
+    return Room;
+}
+
+void WriteSerialChar(const char chr) {
+    WriteSerialString(&chr, 1);
+}
+
 void WriteSerialString(const char* str, size_t len) {
-    for (size_t i = 0; i < len; i++) {
-        WriteSerialChar(str[i]);
+    if (Synchronous) {
+        for (size_t i = 0; i < len; i++)
+            WriteSerialDirect(str[i]);
+        return;
+    }
+
+    while (len > 0) {
+        // Anything bigger than a quarter of the ring goes in pieces, so it can't hold up everyone else for long.
+        size_t Length = MIN(len, SERIAL_BUFFER_SIZE / 4);
+        size_t Start;
+
+        while (!Reserve(Length, &Start)) {
+            if (!MakeRoom(Length)) {
+                __atomic_add_fetch(&Dropped, len, __ATOMIC_RELAXED);
+                return;
+            }
+        }
+
+        for (size_t i = 0; i < Length; i++)
+            Buffer[(Start + i) & SERIAL_BUFFER_MASK] = SERIAL_SLOT_FULL | (uint8_t) str[i];
+
+        Transmit();
+
+        str += Length;
+        len -= Length;
+    }
+}
+
+static void SerialInterrupt(INTERRUPT_FRAME* Frame) {
+    UNUSED(Frame);
+
+    // Reading the identity register acknowledges the transmitter-empty interrupt.
+    ReadPort(SERIAL_IDENTITY(COM1), 1);
+    Transmit();
+}
+
+void InitSerialInterrupts() {
+    WritePort(SERIAL_MODEM(COM1), 0x03 | SERIAL_MODEM_OUT2, 1);
+    InstallIRQ(COM1_IRQ, SerialInterrupt);
+    InterruptsReady = true;
+
+    // Send whatever built up during boot.
+    Transmit();
+}
+
+/**
+ * The kernel is going down, so nothing else will drain the ring. Write out what's in it, and bypass it from here on.
+ * Whoever was transmitting is ignored; if they were on this core, they're never coming back.
+ */
+void SerialPanic() {
+    if (__atomic_exchange_n(&Synchronous, true, __ATOMIC_ACQ_REL))
+        return;
+
+    WritePort(SERIAL_INTERRUPTS(COM1), 0, 1);
+
+    size_t End = __atomic_load_n(&Head, __ATOMIC_ACQUIRE);
+    for (size_t i = Tail; i != End; i++) {
+        uint16_t Value = Buffer[i & SERIAL_BUFFER_MASK];
+        if (Value & SERIAL_SLOT_FULL)
+            WriteSerialDirect(Value & 0xFF);
     }
-}
\ No newline at end of file
+
+    Tail = End;
+
+    if (Dropped != 0)
+        SerialPrintf("[  SER] %u bytes of output were dropped.\r\n", Dropped);
+}
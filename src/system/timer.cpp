@@ -0,0 +1,434 @@
+#include <kernel/chroma.h>
+#include <kernel/system/timer.h>
+#include <driver/io/apic.h>
+
+/************************
+ *** Team Kitty, 2021 ***
+ ***     Chroma       ***
+ ***********************/
+
+/* This file contains the local APIC timer setup, the time base, and the timer wheels.
+ *
+ * The APIC timer counts down at the bus frequency, which nothing tells us, so we measure it:
+ *  PIT channel 2 is set to run for CALIBRATION_MS, and we see how far the APIC timer and the TSC got in that time.
+ * Channel 2 is the one wired to the PC speaker. Its gate and output can be read back through port 0x61,
+ *  so it can be polled without taking an interrupt. The speaker itself stays off.
+ */
+
+#define PIT_FREQUENCY       1193182
+#define PIT_CHANNEL2        0x42
+#define PIT_COMMAND         0x43
+#define PIT_GATE            0x61
+
+#define PIT_GATE_ENABLE     (1 << 0)
+#define PIT_SPEAKER         (1 << 1)
+#define PIT_OUTPUT          (1 << 5)
+
+#define CALIBRATION_MS      10
+
+#define LVT_MASKED          (1 << 16)
+#define TIMER_DIVIDE_16     0x3
+
+/* Each wheel has WHEEL_LEVELS levels of WHEEL_SLOTS lists.
+ * A list on level 0 holds the timers due on one tick; a list on level n holds the timers due in one span of 64^n ticks.
+ * When a level-n span comes round, its list is cascaded: every timer in it is placed again, a level or more further down.
+ * So arming and cancelling are constant time, and each timer is moved at most WHEEL_LEVELS times.
+ *
+ * The TSC is taken to run at the same rate, and from the same point, on every core.
+ */
+#define WHEEL_BITS          6
+#define WHEEL_SLOTS         (1 << WHEEL_BITS)
+#define WHEEL_MASK          (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS        4
+// The furthest ahead a timer can be placed. Anything later waits in the last list it can reach, and is placed again from there.
+#define WHEEL_SPAN          ((size_t) 1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+typedef struct {
+    ticketlock_t Lock;
+    bool Running;                       // Set once this core's APIC timer is ready to be programmed.
+    size_t Now;                         // Every tick up to and including this one has been dealt with.
+    size_t Programmed;                  // The tick the APIC timer is set to fire on, or TIMER_NEVER.
+    uint64_t Occupied[WHEEL_LEVELS];    // Bit n is set if Slots[Level][n] is not empty.
+    timer_event_t* Slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} timer_wheel_t;
+
+static timer_wheel_t Wheels[Constants::Core::MAX_CORES];
+
+// What calibration found. Read on every clock read and timer programmed, written once, so it's kept under a seqlock.
+typedef struct {
+    size_t APICTicksPerMs;      // APIC timer counts per millisecond, with the divisor above.
+    size_t TSCTicksPerMs;
+    size_t CyclesPerTick;
+    size_t TSCBase;             // The TSC value at tick 0.
+} time_base_t;
+
+static seqlock_t TimeLock;
+static time_base_t TimeBase;
+
+static time_base_t ReadTimeBase() {
+    time_base_t Copy;
+    size_t Sequence;
+    do {
+        Sequence = SeqReadBegin(&TimeLock);
+        Copy = TimeBase;
+    } while (SeqReadRetry(&TimeLock, Sequence));
+
+    return Copy;
+}
+
+void CalibrateTimer() {
+    using namespace Device;
+    APIC* Local = APIC::driver;
+
+    // Gate channel 2 off, with the speaker disconnected, while it is being programmed.
+    uint8_t Gate = ReadPort(PIT_GATE, 1) & ~(PIT_SPEAKER | PIT_GATE_ENABLE);
+    WritePort(PIT_GATE, Gate, 1);
+
+    // Channel 2, low byte then high byte, mode 0: output goes high when the count runs out.
+    size_t Count = PIT_FREQUENCY * CALIBRATION_MS / 1000;
+    WritePort(PIT_COMMAND, 0xB0, 1);
+    WritePort(PIT_CHANNEL2, Count & 0xFF, 1);
+    WritePort(PIT_CHANNEL2, (Count >> 8) & 0xFF, 1);
+
+    Local->WriteRegister(APIC::Registers::TIMER_DIVISOR, TIMER_DIVIDE_16);
+    Local->WriteRegister(APIC::Registers::LVT, LVT_MASKED);
+
+    // Open the gate, and start everything counting at the same moment.
+    WritePort(PIT_GATE, Gate | PIT_GATE_ENABLE, 1);
+    Local->WriteRegister(APIC::Registers::TIMER_INIT, 0xFFFFFFFF);
+    size_t TSCStart = ReadTimeStampCounter();
+
+    while (!(ReadPort(PIT_GATE, 1) & PIT_OUTPUT)) { }
+
+    size_t Elapsed = 0xFFFFFFFF - Local->ReadRegister(APIC::Registers::TIMER_CURRENT);
+    size_t TSCElapsed = ReadTimeStampCounter() - TSCStart;
+
+    Local->WriteRegister(APIC::Registers::TIMER_INIT, 0);
+    WritePort(PIT_GATE, Gate, 1);
+
+    size_t Flags = SeqWriteLockIRQSave(&TimeLock);
+    TimeBase.APICTicksPerMs = Elapsed / CALIBRATION_MS;
+    TimeBase.TSCTicksPerMs = TSCElapsed / CALIBRATION_MS;
+    TimeBase.CyclesPerTick = TimeBase.TSCTicksPerMs * 1000 / CHROMA_TICK_HZ;
+    TimeBase.TSCBase = ReadTimeStampCounter();
+    SeqWriteUnlockIRQRestore(&TimeLock, Flags);
+
+    SerialPrintf("[ TIME] APIC timer runs at %u kHz (divided by 16), TSC at %u kHz.\r\n", Elapsed / CALIBRATION_MS,
+                 TSCElapsed / CALIBRATION_MS);
+}
+
+void StartCoreTimer() {
+    using namespace Device;
+    APIC* Local = APIC::driver;
+    size_t CoreID = GetCurrentCoreID();
+
+    if (ReadTimeBase().APICTicksPerMs == 0 || CoreID >= Constants::Core::MAX_CORES) {
+        SerialPrintf("[ TIME] Core %u can't start its timer before it is calibrated.\r\n", CoreID);
+        return;
+    }
+
+    timer_wheel_t* Wheel = &Wheels[CoreID];
+    size_t Flags = TicketLockIRQSave(&Wheel->Lock);
+
+    Local->WriteRegister(APIC::Registers::TIMER_DIVISOR, TIMER_DIVIDE_16);
+    Local->WriteRegister(APIC::Registers::LVT, TIMER_VECTOR);
+    Local->WriteRegister(APIC::Registers::TIMER_INIT, 0);
+    Wheel->Programmed = TIMER_NEVER;
+    Wheel->Running = true;
+
+    TicketUnlockIRQRestore(&Wheel->Lock, Flags);
+
+    // Give the scheduler one look at this core, in case it already has something waiting.
+    ProgramNextTimer(true);
+
+    SerialPrintf("[ TIME] Core %u timer running, %u ticks per second.\r\n", CoreID, CHROMA_TICK_HZ);
+}
+
+size_t GetTicks() {
+    time_base_t Base = ReadTimeBase();
+    if (Base.CyclesPerTick == 0)
+        return 0;
+
+    return (ReadTimeStampCounter() - Base.TSCBase) / Base.CyclesPerTick;
+}
+
+size_t GetUptimeMilliseconds() {
+    time_base_t Base = ReadTimeBase();
+    if (Base.TSCTicksPerMs == 0)
+        return 0;
+
+    return (ReadTimeStampCounter() - Base.TSCBase) / Base.TSCTicksPerMs;
+}
+
+/**
+ * Rounded up, so that anything longer than nothing waits for at least one tick.
+ */
+size_t MillisecondsToTicks(size_t Milliseconds) {
+    return (Milliseconds * CHROMA_TICK_HZ + 999) / 1000;
+}
+
+size_t GetTSCFrequency() {
+    return ReadTimeBase().TSCTicksPerMs;
+}
+
+size_t GetTickTSC(size_t Tick) {
+    time_base_t Base = ReadTimeBase();
+    return Base.TSCBase + Tick * Base.CyclesPerTick;
+}
+
+/**
+ * Put a timer in the list for its deadline, counting from Base: the first tick that hasn't been dealt with yet.
+ * A timer that is already due goes in the list for Base.
+ */
+static void Place(timer_wheel_t* Wheel, timer_event_t* Timer, size_t Base) {
+    size_t When = Timer->Deadline > Base ? Timer->Deadline : Base;
+    if (When - Base >= WHEEL_SPAN)
+        When = Base + WHEEL_SPAN - 1;
+
+    size_t Level = 0;
+    while (Level < WHEEL_LEVELS - 1 && When - Base >= ((size_t) 1 << (WHEEL_BITS * (Level + 1))))
+        Level++;
+
+    size_t Slot = (When >> (WHEEL_BITS * Level)) & WHEEL_MASK;
+    timer_event_t** Head = &Wheel->Slots[Level][Slot];
+
+    Timer->Prev = nullptr;
+    Timer->Next = *Head;
+    if (*Head != nullptr)
+        (*Head)->Prev = Timer;
+    *Head = Timer;
+
+    Wheel->Occupied[Level] |= 1ull << Slot;
+    Timer->Position = Level * WHEEL_SLOTS + Slot;
+    Timer->Wheel = Wheel;
+}
+
+static void Unlink(timer_wheel_t* Wheel, timer_event_t* Timer) {
+    size_t Level = Timer->Position / WHEEL_SLOTS;
+    size_t Slot = Timer->Position % WHEEL_SLOTS;
+
+    if (Timer->Prev != nullptr)
+        Timer->Prev->Next = Timer->Next;
+    else
+        Wheel->Slots[Level][Slot] = Timer->Next;
+
+    if (Timer->Next != nullptr)
+        Timer->Next->Prev = Timer->Prev;
+
+    if (Wheel->Slots[Level][Slot] == nullptr)
+        Wheel->Occupied[Level] &= ~(1ull << Slot);
+
+    Timer->Next = Timer->Prev = nullptr;
+    Timer->Wheel = nullptr;
+}
+
+// Empty one list, and return what was in it.
+static timer_event_t* Detach(timer_wheel_t* Wheel, size_t Level, size_t Slot) {
+    timer_event_t* List = Wheel->Slots[Level][Slot];
+    Wheel->Slots[Level][Slot] = nullptr;
+    Wheel->Occupied[Level] &= ~(1ull << Slot);
+    return List;
+}
+
+/**
+ * Deal with every tick up to and including Target, and return the timers that came due, linked through Next.
+ * A core that has been idle may have slept through thousands of ticks;
+ *  while level 0 is empty, nothing can come due before the next cascade, so it skips straight there.
+ */
+static timer_event_t* Advance(timer_wheel_t* Wheel, size_t Target) {
+    timer_event_t* Expired = nullptr;
+
+    while (Wheel->Now < Target) {
+        size_t Tick = Wheel->Now + 1;
+
+        if (Wheel->Occupied[0] == 0 && (Tick & WHEEL_MASK) != 0) {
+            size_t Cascade = (Tick | WHEEL_MASK) + 1;
+            Wheel->Now = Cascade - 1 < Target ? Cascade - 1 : Target;
+            continue;
+        }
+
+        Wheel->Now = Tick;
+
+        // Highest first, so that nothing is cascaded into a list that has already been dealt with this tick.
+        for (size_t Level = WHEEL_LEVELS - 1; Level > 0; Level--) {
+            if (Tick & (((size_t) 1 << (WHEEL_BITS * Level)) - 1))
+                continue;
+
+            timer_event_t* List = Detach(Wheel, Level, (Tick >> (WHEEL_BITS * Level)) & WHEEL_MASK);
+            while (List != nullptr) {
+                timer_event_t* Next = List->Next;
+                Place(Wheel, List, Tick);
+                List = Next;
+            }
+        }
+
+        timer_event_t* List = Detach(Wheel, 0, Tick & WHEEL_MASK);
+        while (List != nullptr) {
+            timer_event_t* Next = List->Next;
+
+            if (List->Deadline > Tick) {
+                Place(Wheel, List, Tick + 1);
+            } else {
+                List->Wheel = nullptr;
+                List->Prev = nullptr;
+                List->Next = Expired;
+                Expired = List;
+            }
+
+            List = Next;
+        }
+    }
+
+    return Expired;
+}
+
+static size_t EarliestIn(timer_event_t* List, size_t Earliest) {
+    for (; List != nullptr; List = List->Next)
+        if (List->Deadline < Earliest)
+            Earliest = List->Deadline;
+
+    return Earliest;
+}
+
+/**
+ * Each level's lists come round in order, starting from the one after the current tick's,
+ *  so the first non-empty list on each level holds that level's earliest timer.
+ * Except on the last level, where timers beyond WHEEL_SPAN wait out of order; that's hours away, so it's searched in full.
+ */
+static size_t NextDeadline(timer_wheel_t* Wheel) {
+    size_t Earliest = TIMER_NEVER;
+
+    for (size_t Level = 0; Level < WHEEL_LEVELS - 1; Level++) {
+        uint64_t Occupied = Wheel->Occupied[Level];
+        if (Occupied == 0)
+            continue;
+
+        size_t Start = ((Wheel->Now >> (WHEEL_BITS * Level)) + 1) & WHEEL_MASK;
+        uint64_t Rotated = Start == 0 ? Occupied : (Occupied >> Start) | (Occupied << (WHEEL_SLOTS - Start));
+        size_t Slot = (__builtin_ctzll(Rotated) + Start) & WHEEL_MASK;
+
+        Earliest = EarliestIn(Wheel->Slots[Level][Slot], Earliest);
+    }
+
+    for (uint64_t Occupied = Wheel->Occupied[WHEEL_LEVELS - 1]; Occupied != 0; Occupied &= Occupied - 1)
+        Earliest = EarliestIn(Wheel->Slots[WHEEL_LEVELS - 1][__builtin_ctzll(Occupied)], Earliest);
+
+    return Earliest;
+}
+
+/**
+ * Set the APIC timer to fire at the start of the given tick. Only for the core that owns the wheel, with its lock held.
+ * The timer only counts 32 bits, so a deadline far enough away is reached in several goes; each early wakeup just sets it again.
+ */
+static void Program(timer_wheel_t* Wheel, size_t Deadline) {
+    using namespace Device;
+    Wheel->Programmed = Deadline;
+
+    if (Deadline == TIMER_NEVER) {
+        APIC::driver->WriteRegister(APIC::Registers::TIMER_INIT, 0);
+        return;
+    }
+
+    time_base_t Base = ReadTimeBase();
+    size_t Count = 0xFFFFFFFF;
+    if (Deadline < (TIMER_NEVER - Base.TSCBase) / Base.CyclesPerTick) {
+        size_t Target = Base.TSCBase + Deadline * Base.CyclesPerTick;
+        size_t Now = ReadTimeStampCounter();
+        size_t Cycles = Target > Now ? Target - Now : 0;
+
+        // Round up, so that the interrupt never arrives before the tick has begun.
+        size_t Exact = Cycles / Base.TSCTicksPerMs * Base.APICTicksPerMs
+                     + (Cycles % Base.TSCTicksPerMs) * Base.APICTicksPerMs / Base.TSCTicksPerMs + 1;
+        if (Exact < Count)
+            Count = Exact;
+    }
+
+    APIC::driver->WriteRegister(APIC::Registers::TIMER_INIT, Count);
+}
+
+void TimerArm(timer_event_t* Timer, size_t Deadline, timer_callback_t Callback, void* Argument) {
+    size_t CoreID = GetCurrentCoreID();
+    if (CoreID >= Constants::Core::MAX_CORES)
+        return;
+
+    TimerCancel(Timer);
+
+    timer_wheel_t* Wheel = &Wheels[CoreID];
+    size_t Flags = TicketLockIRQSave(&Wheel->Lock);
+
+    Timer->Deadline = Deadline;
+    Timer->Callback = Callback;
+    Timer->Argument = Argument;
+    Place(Wheel, Timer, Wheel->Now + 1);
+
+    if (Wheel->Running && Deadline < Wheel->Programmed)
+        Program(Wheel, Deadline);
+
+    TicketUnlockIRQRestore(&Wheel->Lock, Flags);
+}
+
+/**
+ * A timer that has already been taken off its wheel to fire can't be stopped any more; its callback will still run.
+ */
+bool TimerCancel(timer_event_t* Timer) {
+    timer_wheel_t* Wheel = (timer_wheel_t*) __atomic_load_n(&Timer->Wheel, __ATOMIC_ACQUIRE);
+    if (Wheel == nullptr)
+        return false;
+
+    size_t Flags = TicketLockIRQSave(&Wheel->Lock);
+
+    bool Armed = Timer->Wheel == Wheel;
+    if (Armed)
+        Unlink(Wheel, Timer);
+
+    TicketUnlockIRQRestore(&Wheel->Lock, Flags);
+    return Armed;
+}
+
+void TimerInterrupt() {
+    size_t CoreID = GetCurrentCoreID();
+    if (CoreID >= Constants::Core::MAX_CORES)
+        return;
+
+    timer_wheel_t* Wheel = &Wheels[CoreID];
+    size_t Flags = TicketLockIRQSave(&Wheel->Lock);
+
+    // It's one-shot, so it isn't set for anything any more.
+    Wheel->Programmed = TIMER_NEVER;
+    timer_event_t* Expired = Advance(Wheel, GetTicks());
+
+    TicketUnlockIRQRestore(&Wheel->Lock, Flags);
+
+    // Outside the lock, so that a callback can arm another timer.
+    while (Expired != nullptr) {
+        timer_event_t* Next = Expired->Next;
+        Expired->Next = nullptr;
+        Expired->Callback(Expired->Argument);
+        Expired = Next;
+    }
+}
+
+/**
+ * The end of the slice is the start of the next tick.
+ * If the timer is already set for the right tick it's left alone, so yielding doesn't push back the end of the slice.
+ */
+void ProgramNextTimer(bool NeedSlice) {
+    size_t CoreID = GetCurrentCoreID();
+    if (CoreID >= Constants::Core::MAX_CORES)
+        return;
+
+    timer_wheel_t* Wheel = &Wheels[CoreID];
+    size_t Flags = TicketLockIRQSave(&Wheel->Lock);
+
+    if (Wheel->Running) {
+        size_t Deadline = NextDeadline(Wheel);
+        size_t SliceEnd = GetTicks() + 1;
+        if (NeedSlice && SliceEnd < Deadline)
+            Deadline = SliceEnd;
+
+        if (Deadline != Wheel->Programmed)
+            Program(Wheel, Deadline);
+    }
+
+    TicketUnlockIRQRestore(&Wheel->Lock, Flags);
+}
@@ -0,0 +1,218 @@
+#include <kernel/chroma.h>
+#include <kernel/system/trace.h>
+#include <kernel/system/process/process.h>
+#include <kernel/system/process/futex.h>
+
+/************************
+ *** Team Kitty, 2021 ***
+ ***     Chroma       ***
+ ***********************/
+
+/* This file contains the event tracer.
+ * Each core's ring is written with a single atomic increment to claim a slot, then plain stores.
+ * A record's Sequence is zeroed before it's filled and set last, so a reader can tell a finished record
+ *  from one that's half written, or one that was overwritten while it was being read.
+ *
+ * The claim is atomic because a thread can be moved to another core between reading its core ID and claiming,
+ *  so now and then two cores write into the same ring. They still get different slots.
+ */
+
+#define TRACE_MASK  (CHROMA_TRACE_RECORDS - 1)
+
+static_assert((CHROMA_TRACE_RECORDS & TRACE_MASK) == 0, "CHROMA_TRACE_RECORDS must be a power of two");
+
+typedef struct {
+    volatile size_t Head;       // How many records have been claimed, ever.
+    size_t Tail;                // How many have been drained, or skipped.
+    size_t Dropped;             // How many were overwritten before they could be drained.
+    trace_record_t* Records;    // Null until TraceInit.
+} trace_ring_t;
+
+static trace_ring_t Rings[Constants::Core::MAX_CORES];
+
+// Only one drain at a time. A drain prints to serial for as long as it takes, so anyone else waiting sleeps rather than spins.
+// TraceDump doesn't take it, because it only reads.
+static Mutex DrainLock;
+
+static const char* EventNames[TRACE_EVENT_COUNT] = {
+    "schedule", "switch", "irq", "wake", "alloc", "free"
+};
+
+void TraceInit() {
+    size_t Bytes = sizeof(trace_record_t) * CHROMA_TRACE_RECORDS;
+    uint8_t* Records = (uint8_t*) kmalloc(Bytes * Constants::Core::MAX_CORES);
+    if (Records == nullptr) {
+        SerialPrintf("[TRACE] Unable to allocate the trace rings; tracing is off.\r\n");
+        return;
+    }
+
+    memset(Records, 0, Bytes * Constants::Core::MAX_CORES);
+
+    for (size_t i = 0; i < Constants::Core::MAX_CORES; i++)
+        __atomic_store_n(&Rings[i].Records, (trace_record_t*) (Records + i * Bytes), __ATOMIC_RELEASE);
+
+    SerialPrintf("[TRACE] %u records per core, %u bytes each.\r\n", CHROMA_TRACE_RECORDS, sizeof(trace_record_t));
+}
+
+void Trace(trace_event_t Event, size_t A, size_t B) {
+    size_t CoreID = GetCurrentCoreID();
+    if (CoreID >= Constants::Core::MAX_CORES)
+        return;
+
+    trace_ring_t* Ring = &Rings[CoreID];
+    trace_record_t* Records = __atomic_load_n(&Ring->Records, __ATOMIC_ACQUIRE);
+    if (Records == nullptr)
+        return;
+
+    size_t Index = __atomic_fetch_add(&Ring->Head, 1, __ATOMIC_RELAXED);
+    trace_record_t* Record = &Records[Index & TRACE_MASK];
+
+    __atomic_store_n(&Record->Sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    Record->Timestamp = ReadTimeStampCounter();
+    Record->Event = Event;
+    Record->Arguments[0] = A;
+    Record->Arguments[1] = B;
+
+    __atomic_store_n(&Record->Sequence, Index + 1, __ATOMIC_RELEASE);
+}
+
+static void PrintPID(const char* Key, size_t PID) {
+    if (PID == TRACE_IDLE)
+        SerialPrintf(" %s=idle", Key);
+    else
+        SerialPrintf(" %s=%u", Key, PID);
+}
+
+static void PrintRecord(size_t CoreID, trace_record_t* Record) {
+    const char* Name = Record->Event < TRACE_EVENT_COUNT ? EventNames[Record->Event] : "unknown";
+    SerialPrintf("[TRACE] core=%u tsc=%u %s", CoreID, Record->Timestamp, Name);
+
+    size_t A = Record->Arguments[0];
+    size_t B = Record->Arguments[1];
+
+    switch (Record->Event) {
+        case TRACE_SCHEDULE:
+            PrintPID("pid", A);
+            SerialPrintf(" forced=%u", B);
+            break;
+        case TRACE_SWITCH:
+            PrintPID("from", A);
+            PrintPID("to", B);
+            break;
+        case TRACE_IRQ:
+            SerialPrintf(" vector=%u", A);
+            break;
+        case TRACE_WAKE:
+            PrintPID("pid", A);
+            break;
+        case TRACE_ALLOC:
+            SerialPrintf(" address=0x%p size=%u", A, B);
+            break;
+        case TRACE_FREE:
+            SerialPrintf(" address=0x%p", A);
+            break;
+        default:
+            SerialPrintf(" a=0x%x b=0x%x", A, B);
+            break;
+    }
+
+    SerialPrintf("\r\n");
+}
+
+/**
+ * Copy out the record written as write number Index, if it's finished and still there.
+ * Returns 1 if it was copied, 0 if it's still being written, and -1 if it has been overwritten.
+ */
+static int ReadRecord(trace_ring_t* Ring, size_t Index, trace_record_t* Out) {
+    trace_record_t* Record = &Ring->Records[Index & TRACE_MASK];
+
+    size_t Sequence = __atomic_load_n(&Record->Sequence, __ATOMIC_ACQUIRE);
+    if (Sequence != Index + 1) {
+        // Zero is ambiguous: either this write or a later one is in progress. The head says which.
+        if (Sequence > Index + 1 || __atomic_load_n(&Ring->Head, __ATOMIC_ACQUIRE) - Index > CHROMA_TRACE_RECORDS)
+            return -1;
+        return 0;
+    }
+
+    Out->Timestamp = Record->Timestamp;
+    Out->Event = Record->Event;
+    Out->Arguments[0] = Record->Arguments[0];
+    Out->Arguments[1] = Record->Arguments[1];
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&Record->Sequence, __ATOMIC_RELAXED) == Sequence ? 1 : -1;
+}
+
+size_t TraceDrain() {
+    size_t Printed = 0;
+    DrainLock.Lock();
+
+    for (size_t CoreID = 0; CoreID < Constants::Core::MAX_CORES; CoreID++) {
+        trace_ring_t* Ring = &Rings[CoreID];
+        if (__atomic_load_n(&Ring->Records, __ATOMIC_ACQUIRE) == nullptr)
+            continue;
+
+        size_t Dropped = Ring->Dropped;
+        size_t Head = __atomic_load_n(&Ring->Head, __ATOMIC_ACQUIRE);
+        if (Head - Ring->Tail > CHROMA_TRACE_RECORDS) {
+            Ring->Dropped += Head - Ring->Tail - CHROMA_TRACE_RECORDS;
+            Ring->Tail = Head - CHROMA_TRACE_RECORDS;
+        }
+
+        while (Ring->Tail != Head) {
+            trace_record_t Copy;
+            int Result = ReadRecord(Ring, Ring->Tail, &Copy);
+            if (Result == 0)
+                break;
+
+            Ring->Tail++;
+            if (Result < 0) {
+                Ring->Dropped++;
+                continue;
+            }
+
+            PrintRecord(CoreID, &Copy);
+            Printed++;
+        }
+
+        if (Ring->Dropped != Dropped)
+            SerialPrintf("[TRACE] core=%u dropped=%u\r\n", CoreID, Ring->Dropped - Dropped);
+    }
+
+    DrainLock.Unlock();
+    return Printed;
+}
+
+/**
+ * Called on the way down, so it takes no locks and allocates nothing.
+ * Records from before the last drain are printed again; on a panic, more context beats less.
+ */
+void TraceDump() {
+    SerialPrintf("[TRACE] Dumping the trace rings.\r\n");
+
+    for (size_t CoreID = 0; CoreID < Constants::Core::MAX_CORES; CoreID++) {
+        trace_ring_t* Ring = &Rings[CoreID];
+        if (__atomic_load_n(&Ring->Records, __ATOMIC_ACQUIRE) == nullptr)
+            continue;
+
+        size_t Head = __atomic_load_n(&Ring->Head, __ATOMIC_ACQUIRE);
+        size_t Index = Head > CHROMA_TRACE_RECORDS ? Head - CHROMA_TRACE_RECORDS : 0;
+
+        for (; Index != Head; Index++) {
+            trace_record_t Copy;
+            if (ReadRecord(Ring, Index, &Copy) > 0)
+                PrintRecord(CoreID, &Copy);
+        }
+    }
+
+    SerialPrintf("[TRACE] End of trace.\r\n");
+}
+
+void TraceThread() {
+    while (true) {
+        TraceDrain();
+        ProcessManager::Sleep(100);
+    }
+}
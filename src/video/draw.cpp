@@ -17,10 +17,14 @@
 
 
 PRINTINFO PrintInfo;
+// Anything that moves the cursor or changes the colours writes under this; GetPrintInfo reads under it.
+static seqlock_t PrintLock;
 
 #define FONT bitfont_latin
 
 void InitPrint() {
+    size_t Flags = SeqWriteLockIRQSave(&PrintLock);
+
     PrintInfo.charHeight = 8;
     PrintInfo.charWidth = 8;
     PrintInfo.charFGColor = 0x00FFFFFF;
@@ -40,6 +44,9 @@ void InitPrint() {
 
     PrintInfo.charsPerRow = bootldr.fb_width / (PrintInfo.charScale * PrintInfo.charWidth);
     PrintInfo.rowsPerScrn = bootldr.fb_height / (PrintInfo.charScale * PrintInfo.charHeight);
+
+    SeqWriteUnlockIRQRestore(&PrintLock, Flags);
+
     SerialPrintf("[Print] A single character is %ux%u pixels.\r\n", PrintInfo.charScale * PrintInfo.charWidth,
                  PrintInfo.charScale * PrintInfo.charHeight);
     SerialPrintf("[Print] The screen is %ux%u, meaning you can fit %ux%u characters on screen.\r\n", bootldr.fb_width,
@@ -49,8 +56,21 @@ void InitPrint() {
 
 }
 
+/**
+ * Take a consistent copy of the print state, without holding up anyone printing.
+ */
+void GetPrintInfo(PRINTINFO* Snapshot) {
+    size_t Sequence;
+    do {
+        Sequence = SeqReadBegin(&PrintLock);
+        *Snapshot = PrintInfo;
+    } while (SeqReadRetry(&PrintLock, Sequence));
+}
+
 void SetForegroundColor(uint32_t color) {
+    size_t Flags = SeqWriteLockIRQSave(&PrintLock);
     PrintInfo.charFGColor = color;
+    SeqWriteUnlockIRQRestore(&PrintLock, Flags);
 }
 
 uint32_t GetForegroundColor() {
@@ -58,7 +78,9 @@ uint32_t GetForegroundColor() {
 }
 
 void SetBackgroundColor(uint32_t color) {
+    size_t Flags = SeqWriteLockIRQSave(&PrintLock);
     PrintInfo.charBGColor = color;
+    SeqWriteUnlockIRQRestore(&PrintLock, Flags);
 }
 
 uint32_t GetBackgroundColor() {
@@ -156,7 +178,12 @@ static void Backspace() {
     }
 }
 
+/**
+ * The whole character is drawn under the lock, so that two cores printing at once can't draw into the same place.
+ */
 void WriteChar(const char character) {
+    size_t Flags = SeqWriteLockIRQSave(&PrintLock);
+
     // TODO: Color codes!
     switch (character) {
         case '\b':
@@ -179,6 +206,8 @@ void WriteChar(const char character) {
             break;
     }
 
+    SeqWriteUnlockIRQRestore(&PrintLock, Flags);
+
 }
 
 void WriteString(const char* string) {
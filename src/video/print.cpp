@@ -108,8 +108,13 @@ extern "C" int SerialPrintf(const char* Format, ...) {
             }
 
         } else {
-            WriteSerialChar(*Format);
-            Format++;
+            // Hand over plain text a run at a time, so it goes into the serial buffer in one piece.
+            const char* Run = Format;
+            while (*Format != '\0' && *Format != '%')
+                Format++;
+
+            WriteSerialString(Run, Format - Run);
+            CharsWritten += Format - Run;
         }
     }
 
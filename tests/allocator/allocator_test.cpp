@@ -0,0 +1,210 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <kernel/system/memory.h>
+
+/************************
+ *** Team Kitty, 2021 ***
+ ***     Chroma       ***
+ ***********************/
+
+/* This file runs the TLSF allocator on the host, against a pool from mmap.
+ *
+ * It plays a random trace of malloc, malign, realloc and free in two passes, from the same seed:
+ *  first with AllocatorCheckHeap and AllocatorCheckPool after every operation, then timed with no checks at all.
+ * Every live block is filled with its own byte, and checked before it's freed or moved, to catch overlaps.
+ * At the end of the timed pass it reports ops/sec and how fragmented the pool has become,
+ *  then frees everything and makes sure the pool has coalesced back into one block.
+ *
+ * Usage: allocator_slN [seed] [checked ops] [timed ops]
+ */
+
+#define POOL_SIZE       (32ul << 20)
+#define LIVE_SLOTS      1024
+#define MAX_SIZE_LN     16          // Requests go up to 64KiB, most of them far smaller.
+#define MAX_ALIGN_LN    12
+
+extern "C" int SerialPrintf(const char* Format, ...) {
+    va_list Args;
+    va_start(Args, Format);
+    int Written = vfprintf(stderr, Format, Args);
+    va_end(Args);
+    return Written;
+}
+
+typedef struct {
+    uint8_t* Address;
+    size_t Size;
+    uint8_t Fill;
+} live_block_t;
+
+static live_block_t Live[LIVE_SLOTS];
+
+// xorshift64, so that a seed gives the same trace on any libc.
+static uint64_t State;
+
+static uint64_t Random() {
+    State ^= State << 13;
+    State ^= State >> 7;
+    State ^= State << 17;
+    return State;
+}
+
+// Log-uniform, so that small requests dominate, the way they do in the kernel.
+static size_t RandomSize() {
+    return 1 + Random() % ((size_t) 1 << (Random() % (MAX_SIZE_LN + 1)));
+}
+
+static bool Intact(live_block_t* Block) {
+    for (size_t i = 0; i < Block->Size; i++)
+        if (Block->Address[i] != Block->Fill)
+            return false;
+    return true;
+}
+
+static bool Fail(size_t Op, const char* Message) {
+    fprintf(stderr, "[TLSF] SL_LIMIT_LN %d: op %zu: %s\n", ALLOCATOR_SL_LIMIT_LN, Op, Message);
+    return false;
+}
+
+/**
+ * One step of the trace: an empty slot is allocated, a full one is reallocated or freed.
+ */
+static bool Step(allocator_t Allocator, size_t Op) {
+    live_block_t* Block = &Live[Random() % LIVE_SLOTS];
+    uint64_t Choice = Random() % 10;
+
+    if (Block->Address == nullptr) {
+        size_t Size = RandomSize();
+        size_t Alignment = (size_t) 1 << (Random() % (MAX_ALIGN_LN + 1));
+
+        if (Choice < 6)
+            Block->Address = (uint8_t*) AllocatorMalloc(Allocator, Size);
+        else if (Choice < 9)
+            Block->Address = (uint8_t*) AllocatorMalign(Allocator, Alignment, Size);
+        else
+            Block->Address = (uint8_t*) AllocatorRealloc(Allocator, nullptr, Size);
+
+        if (Block->Address == nullptr)
+            return Fail(Op, "allocation failed");
+        if (Choice >= 6 && Choice < 9 && ((size_t) Block->Address & (Alignment - 1)))
+            return Fail(Op, "malign returned a misaligned block");
+        if (AllocatorGetBlockSize(Block->Address) < Size)
+            return Fail(Op, "block is smaller than requested");
+
+        Block->Size = Size;
+        Block->Fill = (uint8_t) Random();
+        memset(Block->Address, Block->Fill, Size);
+        return true;
+    }
+
+    if (!Intact(Block))
+        return Fail(Op, "live block was overwritten");
+
+    if (Choice < 3) {
+        size_t Size = RandomSize();
+        uint8_t* Moved = (uint8_t*) AllocatorRealloc(Allocator, Block->Address, Size);
+        if (Moved == nullptr)
+            return Fail(Op, "realloc failed");
+
+        Block->Address = Moved;
+        Block->Size = MIN(Block->Size, Size);
+        if (!Intact(Block))
+            return Fail(Op, "realloc lost the contents");
+
+        memset(Moved, Block->Fill, Size);
+        Block->Size = Size;
+    } else {
+        if (Choice < 4)
+            AllocatorRealloc(Allocator, Block->Address, 0);
+        else
+            AllocatorFree(Allocator, Block->Address);
+        Block->Address = nullptr;
+    }
+
+    return true;
+}
+
+static int Check(allocator_t Allocator, mempool_t Pool) {
+    return AllocatorCheckHeap(Allocator) + AllocatorCheckPool(Pool);
+}
+
+static void Reset(allocator_t Allocator, uint64_t Seed) {
+    for (size_t i = 0; i < LIVE_SLOTS; i++) {
+        AllocatorFree(Allocator, Live[i].Address);
+        Live[i].Address = nullptr;
+    }
+    State = Seed * 0x9E3779B97F4A7C15ull | 1;
+}
+
+static double Seconds() {
+    struct timespec Now;
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return Now.tv_sec + Now.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+    uint64_t Seed = argc > 1 ? strtoull(argv[1], nullptr, 0) : 1;
+    size_t CheckedOps = argc > 2 ? strtoull(argv[2], nullptr, 0) : 50000;
+    size_t TimedOps = argc > 3 ? strtoull(argv[3], nullptr, 0) : 2000000;
+
+    void* Memory = mmap(nullptr, POOL_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Memory == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    allocator_t Allocator = CreateAllocatorWithPool(Memory, POOL_SIZE);
+    mempool_t Pool = GetPoolFromAllocator(Allocator);
+    if (Check(Allocator, Pool) != 0) {
+        fprintf(stderr, "[TLSF] A fresh allocator is already inconsistent.\n");
+        return 1;
+    }
+
+    Reset(Allocator, Seed);
+    for (size_t Op = 0; Op < CheckedOps; Op++) {
+        if (!Step(Allocator, Op))
+            return 1;
+
+        if (Check(Allocator, Pool) != 0) {
+            Fail(Op, "heap check failed");
+            return 1;
+        }
+    }
+
+    Reset(Allocator, Seed);
+    double Start = Seconds();
+    for (size_t Op = 0; Op < TimedOps; Op++)
+        if (!Step(Allocator, Op))
+            return 1;
+    double Elapsed = Seconds() - Start;
+
+    if (Check(Allocator, Pool) != 0) {
+        Fail(TimedOps, "heap check failed after the timed pass");
+        return 1;
+    }
+
+    allocator_stats_t Stats;
+    AllocatorGetPoolStats(Pool, &Stats);
+    double Fragmentation = Stats.FreeBytes == 0 ? 0 : 1.0 - (double) Stats.LargestFreeBlock / Stats.FreeBytes;
+
+    printf("[TLSF] SL_LIMIT_LN %d: %zu checked ops clean; %zu ops in %.3fs, %.0f ops/sec\n", ALLOCATOR_SL_LIMIT_LN,
+           CheckedOps, TimedOps, Elapsed, TimedOps / Elapsed);
+    printf("[TLSF] SL_LIMIT_LN %d: %zu used blocks (%zu bytes), %zu free blocks (%zu bytes), largest free %zu, "
+           "fragmentation %.2f%%\n", ALLOCATOR_SL_LIMIT_LN, Stats.UsedBlocks, Stats.UsedBytes, Stats.FreeBlocks,
+           Stats.FreeBytes, Stats.LargestFreeBlock, Fragmentation * 100);
+
+    Reset(Allocator, Seed);
+    AllocatorGetPoolStats(Pool, &Stats);
+    if (Check(Allocator, Pool) != 0 || Stats.UsedBlocks != 0 || Stats.FreeBlocks != 1) {
+        fprintf(stderr, "[TLSF] SL_LIMIT_LN %d: the pool didn't coalesce back to one block: %zu used, %zu free\n",
+                ALLOCATOR_SL_LIMIT_LN, Stats.UsedBlocks, Stats.FreeBlocks);
+        return 1;
+    }
+
+    munmap(Memory, POOL_SIZE);
+    return 0;
+}
@@ -0,0 +1,181 @@
+#include <kernel/chroma.h>
+
+/************************
+ *** Team Kitty, 2021 ***
+ ***     Chroma       ***
+ ***********************/
+
+/* This file is the buddy allocator physmem.c had before its free lists got bitmaps, kept as a reference to benchmark against.
+ *
+ * Freeing a block walks the whole free list of its order to look for its buddy, and merging repeats that walk one order up.
+ * Two things are fixed, or it can't survive a trace at all:
+ *  blocks are split and added aligned to their own size, so that the XOR in CheckBuddies finds real buddies,
+ *  and a block appended to the end of a list has its link cleared.
+ * It has no frame cache; the benchmark keeps physmem.c's caches out of the way too.
+ *
+ * It provides just what the benchmark calls: ListMemoryMap, AddRangeToPhysMem, PhysAllocateMem and PhysFreeMem.
+ */
+
+#define MIN_ORDER 3
+#define PEEK(type, address) (*((volatile type*)(address)))
+
+static buddy_t LowBuddy = {
+        .MaxOrder = 32,
+        .Base = 0,
+        .List = (directptr_t[32 - MIN_ORDER]) {0},
+        .Lock = {.NowServing = 0, .NextTicket = 0},
+};
+
+static buddy_t HighBuddy = {
+        .MaxOrder = 64,
+        .Base = 0,
+        .List = (directptr_t[64 - MIN_ORDER]) {0},
+        .Lock = {.NowServing = 0, .NextTicket = 0},
+};
+
+static bool CheckBuddies(buddy_t* Buddy, directptr_t InputA, directptr_t InputB, size_t Size) {
+    size_t LowerBuddy = MIN(CAST(size_t, InputA), CAST(size_t, InputB)) - (size_t) Buddy->Base;
+    size_t HigherBuddy = MAX(CAST(size_t, InputA), CAST(size_t, InputB)) - (size_t) Buddy->Base;
+
+    return (LowerBuddy ^ Size) == HigherBuddy;
+}
+
+static void PushFreeBlock(buddy_t* Buddy, directptr_t Address, size_t Order) {
+    PEEK(directptr_t, Address) = Buddy->List[Order - MIN_ORDER];
+    Buddy->List[Order - MIN_ORDER] = Address;
+}
+
+/**
+ * Walk the list for this order. If the buddy is on it, take it off and merge one order up; otherwise, append the block.
+ */
+static void MergeIntoBuddyList(buddy_t* Buddy, directptr_t Address, size_t Order) {
+    directptr_t ListHead = Buddy->List[Order - MIN_ORDER];
+    directptr_t ListPrevious = 0;
+
+    if (ListHead == 0 || Order == (size_t) Buddy->MaxOrder - 1) {
+        PushFreeBlock(Buddy, Address, Order);
+        return;
+    }
+
+    while (true) {
+        if (CheckBuddies(Buddy, ListHead, Address, 1ull << Order)) {
+            if (ListPrevious != 0)
+                PEEK(directptr_t, ListPrevious) = PEEK(directptr_t, ListHead);
+            else
+                Buddy->List[Order - MIN_ORDER] = PEEK(directptr_t, ListHead);
+
+            MergeIntoBuddyList(Buddy, MIN(ListHead, Address), Order + 1);
+            return;
+        }
+
+        if (PEEK(directptr_t, ListHead) == 0) {
+            PEEK(directptr_t, Address) = 0;
+            PEEK(directptr_t, ListHead) = Address;
+            return;
+        }
+
+        ListPrevious = ListHead;
+        ListHead = PEEK(directptr_t, ListHead);
+    }
+}
+
+static void AddToBuddyList(buddy_t* Buddy, directptr_t Address, size_t Order) {
+    size_t Flags = TicketLockIRQSave(&Buddy->Lock);
+    MergeIntoBuddyList(Buddy, Address, Order);
+    TicketUnlockIRQRestore(&Buddy->Lock, Flags);
+}
+
+static void AddRangeToBuddy(buddy_t* Buddy, directptr_t Base, size_t Size) {
+    while (Size >= (1ull << MIN_ORDER)) {
+        size_t Offset = (size_t) Base - (size_t) Buddy->Base;
+        int Order = MIN_ORDER;
+
+        while (Order + 1 < Buddy->MaxOrder && (Offset & ((1ull << (Order + 1)) - 1)) == 0 &&
+               Size >= (1ull << (Order + 1)))
+            Order++;
+
+        AddToBuddyList(Buddy, Base, Order);
+        Base = (void*) ((((char*) Base) + (1ull << Order)));
+        Size -= 1ull << Order;
+    }
+}
+
+static directptr_t BuddyAllocate(buddy_t* Buddy, size_t Size) {
+    int InitialOrder = MAX((64 - CLZ(Size - 1)), MIN_ORDER);
+
+    if (InitialOrder >= Buddy->MaxOrder)
+        return NULL;
+
+    size_t Flags = TicketLockIRQSave(&Buddy->Lock);
+
+    for (int Order = InitialOrder; Order < Buddy->MaxOrder; Order++) {
+        if (Buddy->List[Order - MIN_ORDER] != 0) {
+            directptr_t Address = Buddy->List[Order - MIN_ORDER];
+            Buddy->List[Order - MIN_ORDER] = PEEK(directptr_t, Address);
+
+            while (Order > InitialOrder) {
+                Order--;
+                PushFreeBlock(Buddy, (void*) ((size_t) Address + (1ull << Order)), Order);
+            }
+
+            TicketUnlockIRQRestore(&Buddy->Lock, Flags);
+            return Address;
+        }
+    }
+
+    TicketUnlockIRQRestore(&Buddy->Lock, Flags);
+    return NULL;
+}
+
+static buddy_t* BuddyForAddress(directptr_t Pointer) {
+    if (Pointer < (void*) (LOWER_REGION))
+        return &LowBuddy;
+    else
+        return &HighBuddy;
+}
+
+void ListMemoryMap() {
+    for (MMapEnt* MapEntry = &bootldr.mmap; (size_t) MapEntry < (size_t) &bootldr + bootldr.size; MapEntry++) {
+        if (MMapEnt_Type(MapEntry) != MMAP_FREE)
+            continue;
+
+        size_t From = AlignUpwards(MMapEnt_Ptr(MapEntry), PAGE_SIZE);
+        size_t To = AlignDownwards(MMapEnt_Ptr(MapEntry) + MMapEnt_Size(MapEntry), PAGE_SIZE);
+
+        if (From != 0 && From < To)
+            AddRangeToPhysMem((directptr_t) From, To - From);
+    }
+}
+
+void AddRangeToPhysMem(directptr_t Base, size_t Size) {
+    if ((size_t) Base < LOWER_REGION) {
+        size_t LowSize = MIN(Size, LOWER_REGION - (size_t) Base);
+        AddRangeToBuddy(&LowBuddy, Base, LowSize);
+        Base = (directptr_t) ((size_t) Base + LowSize);
+        Size -= LowSize;
+    }
+
+    if (Size != 0) {
+        if (HighBuddy.Base == NULL)
+            HighBuddy.Base = Base;
+        AddRangeToBuddy(&HighBuddy, Base, Size);
+    }
+}
+
+directptr_t PhysAllocateMem(size_t Size) {
+    directptr_t Pointer = NULL;
+
+    if (HighBuddy.Base != NULL)
+        Pointer = BuddyAllocate(&HighBuddy, Size);
+
+    if (Pointer == NULL)
+        Pointer = BuddyAllocate(&LowBuddy, Size);
+
+    ASSERT(Pointer != NULL, "PhysAllocateMem: Unable to allocate memory!");
+
+    return Pointer;
+}
+
+void PhysFreeMem(directptr_t Pointer, size_t Size) {
+    AddToBuddyList(BuddyForAddress(Pointer), Pointer, MAX(64 - CLZ(Size - 1), MIN_ORDER));
+}
@@ -0,0 +1,265 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <kernel/boot/boot.h>
+#include <kernel/system/memory.h>
+
+/************************
+ *** Team Kitty, 2021 ***
+ ***     Chroma       ***
+ ***********************/
+
+/* This file runs the physical memory manager on the host, against "physical" memory mapped at a fixed address.
+ *
+ * It builds a BOOTBOOT memory map covering that memory, with a reserved hole, and hands it to ListMemoryMap.
+ * Then it plays a random trace of single page and multi-page allocations and frees, twice from the same seed:
+ *  first checking every page of every block as it's freed, then timed.
+ * Before and after, it counts the free frames by allocating every one of them, to catch frames that got lost.
+ *
+ * GetCurrentCoreID reports a core past the end of the frame caches, so every request goes straight to the buddy lists.
+ * Linked against physmem.c, that's the bitmap buddy; linked against list_buddy.c, the list walk it replaced.
+ *
+ * The more blocks are live at once, the longer the free lists get, which is what the list walk pays for.
+ *
+ * Usage: physmem_<name> [seed] [checked ops] [timed ops] [live blocks]
+ */
+
+#define MEMORY_BASE     0x40000000ul
+#define MEMORY_SIZE     (256ul << 20)
+#define HOLE_OFFSET     (24ul << 20)
+#define HOLE_SIZE       (1ul << 20)
+
+#define MAX_LIVE_SLOTS  32768
+#define MAX_PAGES       32
+
+#ifndef PHYSMEM_NAME
+#define PHYSMEM_NAME    "physmem"
+#endif
+
+extern "C" {
+
+struct {
+    bootinfo Header;
+    MMapEnt Rest[2];
+} __attribute__((packed)) BootImage;
+
+extern bootinfo bootldr __attribute__((alias("BootImage")));
+
+// Set while counting frames, when running out is the point.
+static bool ExpectFailure;
+static size_t Failures;
+
+int SerialPrintf(const char* Format, ...) {
+    va_list Args;
+    va_start(Args, Format);
+    int Written = vfprintf(stderr, Format, Args);
+    va_end(Args);
+    return Written;
+}
+
+void SomethingWentWrong(const char* Message) {
+    if (!ExpectFailure) {
+        fprintf(stderr, "[ Phys] %s\n", Message);
+        Failures++;
+    }
+}
+
+size_t GetCurrentCoreID() {
+    return 64;
+}
+
+size_t AlignUpwards(size_t Pointer, size_t Alignment) {
+    return (Pointer + Alignment - 1) & ~(Alignment - 1);
+}
+
+size_t AlignDownwards(size_t Pointer, size_t Alignment) {
+    return Pointer & ~(Alignment - 1);
+}
+
+size_t DisableInterrupts() {
+    return 0;
+}
+
+void RestoreInterrupts(size_t Flags) {
+    (void) Flags;
+}
+
+size_t TicketLockIRQSave(ticketlock_t* Lock) {
+    (void) Lock;
+    return 0;
+}
+
+void TicketUnlockIRQRestore(ticketlock_t* Lock, size_t Flags) {
+    (void) Lock;
+    (void) Flags;
+}
+
+void TicketPrintStats(const char* Name, ticketlock_t* Lock) {
+    (void) Name;
+    (void) Lock;
+}
+
+}
+
+typedef struct {
+    size_t* Address;
+    size_t Pages;
+    size_t Tag;
+} live_block_t;
+
+static live_block_t Live[MAX_LIVE_SLOTS];
+static size_t LiveSlots;
+
+// xorshift64, so that a seed gives the same trace on any libc.
+static uint64_t State;
+
+static uint64_t Random() {
+    State ^= State << 13;
+    State ^= State >> 7;
+    State ^= State << 17;
+    return State;
+}
+
+// Most requests are for a single frame, the way they are in the kernel; the rest are spread up to MAX_PAGES.
+static size_t RandomPages() {
+    return Random() % 4 ? 1 : 2 + Random() % (MAX_PAGES - 1);
+}
+
+static bool Fail(size_t Op, const char* Message) {
+    fprintf(stderr, "[ Phys] %s: op %zu: %s\n", PHYSMEM_NAME, Op, Message);
+    return false;
+}
+
+static size_t* PageOf(live_block_t* Block, size_t Page) {
+    return (size_t*) ((size_t) Block->Address + Page * PAGE_SIZE);
+}
+
+/**
+ * One step of the trace: an empty slot is allocated, a full one is freed.
+ * Each page of a live block holds its tag, so a block handed out twice shows up when either is freed.
+ */
+static bool Step(size_t Op, bool Checked) {
+    live_block_t* Block = &Live[Random() % LiveSlots];
+
+    if (Block->Address == nullptr) {
+        Block->Pages = RandomPages();
+        Block->Address = (size_t*) PhysAllocateMem(Block->Pages * PAGE_SIZE);
+        Block->Tag = Random() | 1;
+
+        if (Block->Address == nullptr)
+            return Fail(Op, "allocation failed");
+        if ((size_t) Block->Address < MEMORY_BASE || (size_t) Block->Address + Block->Pages * PAGE_SIZE > MEMORY_BASE + MEMORY_SIZE)
+            return Fail(Op, "block is outside of the memory map");
+        if ((size_t) Block->Address - (MEMORY_BASE + HOLE_OFFSET) < HOLE_SIZE)
+            return Fail(Op, "block is in the reserved hole");
+
+        for (size_t i = 0; i < Block->Pages; i++)
+            *PageOf(Block, i) = Block->Tag;
+        return true;
+    }
+
+    if (Checked)
+        for (size_t i = 0; i < Block->Pages; i++)
+            if (*PageOf(Block, i) != Block->Tag)
+                return Fail(Op, "live block was overwritten");
+
+    PhysFreeMem(Block->Address, Block->Pages * PAGE_SIZE);
+    Block->Address = nullptr;
+    return true;
+}
+
+static void Reset(uint64_t Seed) {
+    for (size_t i = 0; i < LiveSlots; i++) {
+        if (Live[i].Address != nullptr)
+            PhysFreeMem(Live[i].Address, Live[i].Pages * PAGE_SIZE);
+        Live[i].Address = nullptr;
+    }
+    State = Seed * 0x9E3779B97F4A7C15ull | 1;
+}
+
+/**
+ * Take every free frame, one at a time, then give them all back.
+ * @return How many there were, or 0 if any of them was handed out twice.
+ */
+static size_t CountFreeFrames() {
+    static directptr_t Frames[MEMORY_SIZE / PAGE_SIZE];
+    size_t Count = 0;
+
+    ExpectFailure = true;
+    while (Count < MEMORY_SIZE / PAGE_SIZE && (Frames[Count] = PhysAllocateMem(PAGE_SIZE)) != nullptr) {
+        *(size_t*) Frames[Count] = Count;
+        Count++;
+    }
+    ExpectFailure = false;
+
+    bool Unique = true;
+    for (size_t i = 0; i < Count; i++) {
+        Unique &= *(size_t*) Frames[i] == i;
+        PhysFreeMem(Frames[i], PAGE_SIZE);
+    }
+
+    return Unique ? Count : 0;
+}
+
+static double Seconds() {
+    struct timespec Now;
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return Now.tv_sec + Now.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+    uint64_t Seed = argc > 1 ? strtoull(argv[1], nullptr, 0) : 1;
+    size_t CheckedOps = argc > 2 ? strtoull(argv[2], nullptr, 0) : 100000;
+    size_t TimedOps = argc > 3 ? strtoull(argv[3], nullptr, 0) : 1000000;
+    LiveSlots = MAX(MIN(argc > 4 ? strtoull(argv[4], nullptr, 0) : 16384, MAX_LIVE_SLOTS), 1);
+
+    void* Memory = mmap((void*) MEMORY_BASE, MEMORY_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (Memory != (void*) MEMORY_BASE) {
+        perror("mmap");
+        return 1;
+    }
+
+    BootImage.Header.size = sizeof(BootImage);
+    BootImage.Header.mmap = {MEMORY_BASE, HOLE_OFFSET | MMAP_FREE};
+    BootImage.Rest[0] = {MEMORY_BASE + HOLE_OFFSET, HOLE_SIZE | MMAP_USED};
+    BootImage.Rest[1] = {MEMORY_BASE + HOLE_OFFSET + HOLE_SIZE, (MEMORY_SIZE - HOLE_OFFSET - HOLE_SIZE) | MMAP_FREE};
+
+    ListMemoryMap();
+
+    size_t InitialFrames = CountFreeFrames();
+    if (InitialFrames == 0 || Failures != 0) {
+        fprintf(stderr, "[ Phys] %s: the memory map didn't produce any usable frames.\n", PHYSMEM_NAME);
+        return 1;
+    }
+
+    Reset(Seed);
+    for (size_t Op = 0; Op < CheckedOps; Op++)
+        if (!Step(Op, true))
+            return 1;
+
+    Reset(Seed);
+    double Start = Seconds();
+    for (size_t Op = 0; Op < TimedOps; Op++)
+        if (!Step(Op, false))
+            return 1;
+    double Elapsed = Seconds() - Start;
+
+    printf("[ Phys] %s: %zu live blocks: %zu checked ops clean; %zu ops in %.3fs, %.0f ops/sec\n", PHYSMEM_NAME,
+           LiveSlots, CheckedOps, TimedOps, Elapsed, TimedOps / Elapsed);
+
+    Reset(Seed);
+    size_t FinalFrames = CountFreeFrames();
+    if (FinalFrames != InitialFrames || Failures != 0) {
+        fprintf(stderr, "[ Phys] %s: %zu free frames at the start, %zu at the end.\n", PHYSMEM_NAME, InitialFrames,
+                FinalFrames);
+        return 1;
+    }
+
+    printf("[ Phys] %s: all %zu frames accounted for.\n", PHYSMEM_NAME, FinalFrames);
+
+    munmap(Memory, MEMORY_SIZE);
+    return 0;
+}
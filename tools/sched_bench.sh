@@ -0,0 +1,83 @@
+#!/bin/sh
+# Boot a kernel built with -DCHROMA_SCHED_BENCHMARK=ON under QEMU, collect its [BENCH] results from serial,
+#  and fail if any of them is over its limit.
+#
+# Usage: tools/sched_bench.sh [image]
+#  The image defaults to bin/img/chroma.img, as made by post.sh.
+#
+# Limits are environment variables; leave one unset to skip that check.
+#  MAX_YIELD_CYCLES      cycles for one yield, from one thread to the next
+#  MAX_SWITCH_CYCLES     average cycles spent in SwitchContext
+#  MAX_SCHEDULER_CYCLES  average cycles for a scheduler pass that switches
+#  MAX_WAKEUP_US         worst wakeup latency after a sleep, in microseconds
+#  MAX_IPC_ROUNDTRIP_CYCLES  average cycles for a message and its reply between two threads
+#  TIMEOUT               seconds to wait for the benchmark to finish (default 120)
+#  QEMU_FLAGS            extra arguments for qemu-system-x86_64
+
+IMAGE=${1:-bin/img/chroma.img}
+TIMEOUT=${TIMEOUT:-120}
+LOG=$(mktemp)
+
+if [ ! -f "$IMAGE" ]; then
+    echo "No image at $IMAGE. Build with -DCHROMA_SCHED_BENCHMARK=ON, then run post.sh."
+    exit 2
+fi
+
+qemu-system-x86_64 -nographic -no-reboot -m 256 -cpu max -drive file="$IMAGE",format=raw $QEMU_FLAGS > "$LOG" 2>&1 &
+QEMU=$!
+
+Waited=0
+while ! grep -q '^\[BENCH\] end' "$LOG"; do
+    if [ "$Waited" -ge "$TIMEOUT" ] || ! kill -0 "$QEMU" 2>/dev/null; then
+        break
+    fi
+    sleep 1
+    Waited=$((Waited + 1))
+done
+
+kill "$QEMU" 2>/dev/null
+wait "$QEMU" 2>/dev/null
+
+grep '^\[BENCH\]' "$LOG" | tr -d '\r'
+
+if ! grep -q '^\[BENCH\] end' "$LOG"; then
+    echo "FAIL: the benchmark did not finish within ${TIMEOUT}s. Full log in $LOG"
+    exit 1
+fi
+
+# Print the value of a key from the named result line.
+field() {
+    tr -d '\r' < "$LOG" | awk -v name="$1" -v key="$2" '
+        $1 == "[BENCH]" && $2 == name {
+            for (i = 3; i <= NF; i++) {
+                split($i, kv, "=")
+                if (kv[1] == key) { print kv[2]; exit }
+            }
+        }'
+}
+
+Status=0
+
+# check <description> <name> <key> <limit>
+check() {
+    [ -z "$4" ] && return
+    Value=$(field "$2" "$3")
+    if [ -z "$Value" ]; then
+        echo "FAIL: no $2 $3 in the results"
+        Status=1
+    elif [ "$Value" -gt "$4" ]; then
+        echo "FAIL: $1 is $Value, over the limit of $4"
+        Status=1
+    else
+        echo "ok: $1 is $Value (limit $4)"
+    fi
+}
+
+check "yield cost" yield cycles "$MAX_YIELD_CYCLES"
+check "SwitchContext cost" switch_context avg "$MAX_SWITCH_CYCLES"
+check "scheduler cost" scheduler avg "$MAX_SCHEDULER_CYCLES"
+check "worst wakeup latency" wakeup_us max "$MAX_WAKEUP_US"
+check "IPC round trip" ipc_roundtrip avg "$MAX_IPC_ROUNDTRIP_CYCLES"
+
+rm -f "$LOG"
+exit $Status